@@ -0,0 +1,43 @@
+# Decoding throughput for streams of small items, the shape of typical
+# telemetry data: many short arrays and maps of integers, floats and
+# short strings.
+#
+#   ruby -Ilib bench/decode_items.rb [count [rounds]]
+#
+# To compare two builds, e.g. the initial-byte table against the switch
+# dispatch of the commit before it, build each into its own directory
+# and run this script with -I pointing at each; jobs the older build
+# can't do are left out.
+
+require 'cbor'
+require 'benchmark'
+
+count = (ARGV[0] || 200_000).to_i
+rounds = (ARGV[1] || 5).to_i
+
+items = Array.new(count) do |i|
+  case i % 4
+  when 0 then [i, -i, i * 1.5, "temp"]
+  when 1 then {"id" => i, "v" => i % 7 == 0, "t" => 1_400_000_000 + i}
+  when 2 then i
+  else "sensor-#{i % 100}"
+  end
+end
+sequence = items.map(&:to_cbor).join
+document = items.to_cbor
+
+def best_of(rounds)
+  Array.new(rounds) { GC.start; Benchmark.realtime { yield } }.min
+end
+
+{
+  "decode document" => lambda { CBOR.decode(document) },
+  "  with key_cache" => lambda { CBOR.decode(document, key_cache: true) },
+  "  symbolize_keys" => lambda { CBOR.decode(document, symbolize_keys: true) },
+  "each sequence" => lambda { CBOR::Unpacker.new.feed_each(sequence) { } },
+  "decode_sequence" => lambda { CBOR.decode_sequence(sequence) },
+}.each do |name, job|
+  next if name == "decode_sequence" && !CBOR.respond_to?(:decode_sequence)
+  t = best_of(rounds, &job)
+  printf("%-20s %8.2f ms %10.0f items/s\n", name, t * 1000, count / t)
+end
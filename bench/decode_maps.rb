@@ -0,0 +1,30 @@
+# Decoding throughput for maps of 10 to 1000 keys, which the unpacker
+# builds in one go with a Hash allocated to its final size.
+#
+#   ruby -Ilib bench/decode_maps.rb [total_keys [rounds]]
+#
+# Every row decodes the same total number of keys, spread over maps of
+# the given size.
+
+require 'cbor'
+require 'benchmark'
+
+total = (ARGV[0] || 1_000_000).to_i
+rounds = (ARGV[1] || 5).to_i
+
+def best_of(rounds)
+  Array.new(rounds) { GC.start; Benchmark.realtime { yield } }.min
+end
+
+[10, 30, 100, 300, 1000].each do |size|
+  maps = total / size
+  string_keys = Array.new(maps) { |m| Array.new(size) { |i| ["key#{i}", m + i] }.to_h }
+  integer_keys = Array.new(maps) { |m| Array.new(size) { |i| [i, m * 0.5] }.to_h }
+  {
+    "string keys" => string_keys.to_cbor,
+    "integer keys" => integer_keys.to_cbor,
+  }.each do |kind, document|
+    t = best_of(rounds) { CBOR.decode(document) }
+    printf("%5d-key maps, %-12s %8.2f ms %10.0f keys/s\n", size, kind, t * 1000, total / t)
+  end
+end
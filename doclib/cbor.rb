@@ -8,9 +8,27 @@ module CBOR
   # @overload encode(obj, io)
   #   @return [IO]
   #
+  # @overload encode(obj, io = nil, options)
+  #   @param options [Hash] see Packer#initialize
+  #
+  #   CBOR.encode(message, deterministic: true)  # sorted map keys
+  #
   def self.encode(arg)
   end
 
+  #
+  # Returns the number of bytes encode would write for _obj_, without
+  # allocating them.  Objects with their own to_cbor are serialized to
+  # find out.
+  #
+  #   frame = CBOR.encoded_size(message)
+  #
+  # @param obj [Object] object to measure
+  # @param options [Hash] see Packer#initialize
+  # @return [Integer]
+  #
+  def self.encoded_size(obj, options = {})
+  end
   #
   # Serializes an object into an IO or String. Alias of encode.
   #
@@ -38,17 +56,132 @@ module CBOR
   #
   # Deserializes an object from an IO or String.
   #
-  # @overload decode(string)
+  # @overload decode(string, options={})
   #   @param string [String] data to deserialize
   #
-  # @overload decode(io)
+  # @overload decode(io, options={})
   #   @param io [IO]
   #
+  # See Unpacker#initialize for supported options.
+  #
   # @return [Object] deserialized object
   #
   def self.decode(arg)
   end
 
+  #
+  # Deserializes all items of a CBOR sequence (RFC 8742) and returns them in
+  # an Array.  Raises EOFError if the last item is incomplete.
+  #
+  # @param string [String] data to deserialize
+  # @param limit [Integer] maximum number of items to decode; the rest
+  #   of _string_ is ignored
+  # @param options [Hash] see Unpacker#initialize
+  # @return [Array] deserialized items
+  #
+  def self.decode_sequence(string, limit: nil, **options)
+  end
+
+  #
+  # Same as decode_sequence, but splits _string_ at item boundaries into
+  # slices of about the same size and decodes them in parallel Ractors.
+  # Falls back to decode_sequence where Ractors are not available or
+  # _string_ is shorter than 64 KiB per worker.  With +freeze: true+,
+  # the decoded items are shareable and are passed back without copying.
+  #
+  # @param string [String] data to deserialize
+  # @param workers [Integer] maximum number of Ractors to use
+  # @param options [Hash] see Unpacker#initialize
+  # @return [Array] deserialized items
+  #
+  def self.parallel_decode_sequence(string, workers: Etc.nprocessors, **options)
+  end
+
+  #
+  # Checks that _string_ holds exactly one well-formed CBOR data item,
+  # without deserializing it.  Long strings are checked with the GVL
+  # released, so other threads can run (or validate) in parallel.
+  #
+  # @param string [String] data to check
+  # @param utf8 [Boolean] also check that text strings are valid UTF-8
+  # @param sequence [Boolean] accept a CBOR sequence of any number of items
+  # @return [Boolean]
+  #
+  def self.valid?(string, utf8: false, sequence: false)
+  end
+
+  #
+  # Same as valid?, but raises the error decode would raise (with the
+  # byte offset of the problem in the message) instead of returning false.
+  #
+  # @return [true]
+  #
+  def self.validate!(string, utf8: false, sequence: false)
+  end
+
+  #
+  # Deserializes only the item at _path_ in the object in _string_,
+  # skipping everything else without creating objects for it.
+  # See Unpacker#dig.
+  #
+  #   CBOR.dig(data, "meta", "trace_id")
+  #
+  # @param string [String] data to deserialize
+  # @param path [Array<Object>] array indexes and map keys
+  # @return [Object] deserialized item at _path_, or nil if there is none
+  #
+  def self.dig(string, *path)
+  end
+
+  #
+  # Registers a converter for tag number _tag_, applied while decoding
+  # in place of the built-in handling (CBOR::Tagged for unknown tags).
+  # A Class is instantiated with the tag content as the only argument;
+  # anything else is sent +call+ with it.  +nil+ removes the converter.
+  #
+  #   CBOR.register_tag(37, UUIDTools::UUID.method(:parse_raw))
+  #
+  # Converters must be registered from the main Ractor, and are only
+  # used in other Ractors if they are shareable.  Extensions can register
+  # native converters with CBOR_register_tag_decoder (see
+  # ext/cbor/tag_registry.h).
+  #
+  # @param tag [Integer] tag number
+  # @param klass_or_proc [Class, #call, nil] converter
+  # @return [nil]
+  #
+  def self.register_tag(tag, klass_or_proc)
+  end
+
+  #
+  # Registers how instances of _klass_ (and its subclasses) are
+  # serialized, in place of calling their to_cbor.  _packer_ is either a
+  # Symbol, naming a method without arguments whose result is written
+  # instead, or anything else that responds to +call+, which is given the
+  # object.  For Struct and Data classes, +:to_a+ and +:to_h+ read the
+  # members directly, without calling Ruby code.  With _tag_, the result
+  # is wrapped in that tag; for Struct and Data classes, the tag is then
+  # also decoded back into an object of _klass_ (with the members set
+  # as Marshal does, without calling initialize; missing Struct members
+  # are nil, while missing Data members raise MalformedFormatError).
+  # Without _packer_, removes the registration.  Registering a superclass
+  # does not change how CBOR::Tagged, CBOR::Simple, CBOR::TypedArray,
+  # CBOR::Raw, Regexp and URI objects are written.
+  #
+  #   CBOR.register_type(Point, packer: :to_a, tag: 40001)
+  #   CBOR.register_type(Money, packer: :to_s)
+  #
+  # Types must be registered from the main Ractor; callable packers are
+  # only used in other Ractors if they are shareable.
+  #
+  # @param klass [Class] class to register
+  # @param packer [Symbol, #call, nil] method name or converter
+  # @param tag [Integer, nil] tag number
+  # @return [nil]
+  #
+  def self.register_type(klass, packer: nil, tag: nil)
+  end
+
   #
   # Deserializes an object from an IO or String. Alias of decode.
   #
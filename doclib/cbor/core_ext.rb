@@ -93,6 +93,10 @@ class Time
   #
   # Same as CBOR.encode(self[, io]).
   #
+  # Encoded as tag 1 with the seconds since the epoch: an Integer, or a
+  # Float if there are fractional seconds.  Tag 1 and tag 0 (RFC 3339
+  # strings) are decoded as Time.
+  #
   # @return [String] serialized data
   #
   def to_cbor(io=nil)
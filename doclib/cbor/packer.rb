@@ -18,6 +18,25 @@ module CBOR
     #   This packer writes serialzied objects into the IO when the internal buffer is filled.
     #   _io_ must respond to write(string) or append(string) method.
     #
+    # Supported options for the packer itself:
+    #
+    # * *:typed_arrays* write Arrays of only Integers (Fixnums) or only
+    #   Floats as RFC 8746 typed arrays, using the smallest little-endian
+    #   element type that holds all elements exactly (float32 or float64
+    #   for Floats); +true+ for Arrays of at least 16 elements, or the
+    #   minimum number of elements.  Arrays that would be larger as typed
+    #   arrays (such as small Integers, which take one byte either way)
+    #   are written as they are.  Unpacker's +typed_arrays: true+ reads
+    #   them back as Arrays.
+    # * *:deterministic* write map keys in the bytewise order of their
+    #   encodings, for the core deterministic encoding of RFC 8949
+    #   (section 4.2.1).  Each key is encoded once; Hashes with two keys
+    #   that encode the same (such as :a and "a") raise ArgumentError.
+    # * *:structs* write Struct and Data objects that have no to_cbor
+    #   (and no CBOR.register_type registration) as an Array of their
+    #   members with +:array+, or as a Hash of member names and values with
+    #   +:map+, reading the members directly.
+    #
     def initialize(*args)
     end
 
@@ -66,6 +85,16 @@ module CBOR
     def write_map_header(n)
     end
 
+    #
+    # Writes _bytes_, which must hold an encoded CBOR data item, as is.
+    # Long strings are referenced rather than copied, like with
+    # Buffer#write.  See also CBOR::Raw.
+    #
+    # @return [Packer] self
+    #
+    def write_raw(bytes)
+    end
+
     #
     # Flushes data in the internal buffer to the internal IO. Same as _buffer.flush.
     # If internal IO is not set, it does nothing.
@@ -0,0 +1,46 @@
+module CBOR
+
+  #
+  # CBOR::Raw is an already encoded data item.  The packer writes its
+  # bytes as they are wherever it occurs, so a large document that is
+  # sent over and over needs to be encoded only once; long bytes are
+  # referenced rather than copied.
+  #
+  # Raw objects are frozen (and so shareable between Ractors), and hold
+  # their bytes in a frozen binary String.
+  #
+  #   HEADER = CBOR::Raw.new(CBOR.encode(header), validate: true)
+  #   CBOR.encode([HEADER, payload])
+  #
+  class Raw
+    #
+    # Creates a Raw.  The bytes are not checked unless +validate: true+
+    # is given, which raises the error decode would raise (see
+    # CBOR.validate!) if they are not exactly one well-formed data item.
+    #
+    # @param bytes [String] encoded data item
+    # @param options [Hash]
+    #
+    def initialize(bytes, validate: false)
+    end
+
+    #
+    # The encoded data item
+    #
+    # @return [String]
+    #
+    def bytes
+    end
+
+    #
+    # Number of bytes
+    #
+    # @return [Integer]
+    #
+    def size
+    end
+
+    alias length size
+  end
+
+end
@@ -0,0 +1,71 @@
+module CBOR
+
+  #
+  # CBOR::SequenceIndex holds the byte offsets and lengths of the items of a
+  # CBOR sequence (RFC 8742), so that single items can be decoded without
+  # decoding the ones before them.
+  #
+  class SequenceIndex
+    #
+    # Scans a CBOR sequence once, checking that it is well-formed but
+    # without deserializing anything, and returns an index of its items.
+    #
+    # An IO is read in chunks, so the sequence does not need to fit into
+    # memory; items are later read back with pread (or seek and read).
+    #
+    # Raises EOFError if the last item is incomplete and
+    # CBOR::MalformedFormatError if the data is not well-formed.
+    #
+    # @param source [String, IO] the sequence
+    # @param options [Hash] used to decode items, see Unpacker#initialize
+    # @return [SequenceIndex]
+    #
+    def self.build(source, options={})
+    end
+
+    #
+    # Number of items
+    #
+    # @return [Integer]
+    #
+    def size
+    end
+    alias length size
+
+    #
+    # Byte offsets of the items, from the start of the sequence (for an
+    # IO, its position when the index was built)
+    #
+    # @return [Array<Integer>]
+    #
+    def offsets
+    end
+
+    #
+    # Encoded lengths of the items in bytes
+    #
+    # @return [Array<Integer>]
+    #
+    def lengths
+    end
+
+    #
+    # Encoded bytes of item _i_
+    #
+    # @param i [Integer] index, negative counting from the end
+    # @return [String, nil] nil if out of range
+    #
+    def raw(i)
+    end
+
+    #
+    # Deserializes item _i_
+    #
+    # @param i [Integer] index, negative counting from the end
+    # @return [Object] deserialized item, nil if out of range
+    #
+    def [](i)
+    end
+  end
+
+end
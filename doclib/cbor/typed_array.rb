@@ -0,0 +1,61 @@
+module CBOR
+
+  #
+  # CBOR::TypedArray is an RFC 8746 typed array: a byte string of packed
+  # numbers together with their element type.  The unpacker creates it
+  # for tags 64 to 87 with the +typed_arrays: :packed+ option, without
+  # copying or converting the data, and writes it back as such.
+  #
+  # It is a Struct with the members _type_ and _data_.  _type_ is one of
+  # :uint8, :uint8_clamped, :int8, :uint16_be, :uint16_le, :int16_be,
+  # :int16_le (and the same for 32 and 64 bits), :float16_be, :float16_le,
+  # :float32_be, :float32_le, :float64_be, :float64_le, :float128_be or
+  # :float128_le; _data_ is the binary String.
+  #
+  #   ta = CBOR.decode(bytes, typed_arrays: :packed)
+  #   ta.type   # => :float32_le
+  #   ta.to_a   # => [1.5, 2.0, ...]
+  #
+  class TypedArray < Struct
+    #
+    # Creates a TypedArray.  If _data_ is an Array, its elements are
+    # converted to the element type (raising RangeError for Integers out
+    # of its range, and TypeError for non-Integers in integer types).
+    #
+    #   CBOR::TypedArray.new(:float32_le, [1.5, 2.0]).to_cbor
+    #
+    # @param type [Symbol] element type
+    # @param data [String, Array] packed elements, or the elements
+    #
+    def initialize(type, data)
+    end
+
+    #
+    # The CBOR tag number of the element type
+    #
+    # @return [Integer]
+    #
+    def tag
+    end
+
+    #
+    # Number of elements
+    #
+    # @return [Integer]
+    #
+    def size
+    end
+
+    alias length size
+
+    #
+    # Converts the elements into an Array of Integers or Floats.
+    # Raises ArgumentError for float128 elements.
+    #
+    # @return [Array]
+    #
+    def to_a
+    end
+  end
+
+end
@@ -19,6 +19,35 @@ module CBOR
     #
     # See Buffer#initialize for supported options.
     #
+    # Supported options for the unpacker itself:
+    #
+    # * *:symbolize_keys* deserialize text string map keys as Symbols
+    # * *:key_cache* cache frozen map key Strings so that repeated keys
+    #   are returned as the same object without allocation; +true+ for
+    #   a cache of 256 entries, or the number of entries (rounded up to
+    #   a power of 2).  Off by default, except with :symbolize_keys,
+    #   where the cache holds Symbols.
+    # * *:freeze* return text and byte strings as deduplicated frozen
+    #   Strings (as with String#-@), and freeze Arrays, Hashes, tagged
+    #   objects and simple values, so that deserialized objects are
+    #   deeply frozen and can be shared between Ractors.
+    # * *:typed_arrays* how to deserialize RFC 8746 typed arrays (tags 64
+    #   to 87): +:packed+ for a TypedArray holding the byte string as is,
+    #   +:array+ (or +true+, as for Packer) for an Array of Integers or
+    #   Floats.  By default (+nil+) they are deserialized as CBOR::Tagged,
+    #   as all other unknown tags.
+    #   Arrays of float128 elements are always left as CBOR::Tagged.
+    # * *:strict* +:deterministic+ to raise MalformedFormatError for
+    #   anything not in core deterministic encoding (RFC 8949, section
+    #   4.2.1): integers, lengths, tag numbers and floats longer than
+    #   needed, indefinite lengths, and map keys that are duplicate or
+    #   not sorted by their encoded bytes.  Checked while deserializing,
+    #   at little extra cost; what Packer writes with +:deterministic+
+    #   passes.  Bignums (tags 2 and 3) must not fit in a plain integer or
+    #   start with a zero byte.  _dig_, _next_event_ and _next_events_
+    #   raise ArgumentError with this option, as they do not check map
+    #   keys.
+    #
     def initialize(*args)
     end
 
@@ -43,8 +72,23 @@ module CBOR
 
     alias unpack read
 
+    #
+    # Deserializes all complete objects in the internal buffer (and, if an
+    # IO is set, until the IO raises EOFError) and returns them in an Array.
+    # A partially received object stays in the buffer for the next call.
+    #
+    # This method could raise same errors with _read_ excepting EOFError.
+    #
+    # @param limit [Integer] maximum number of objects to read
+    # @return [Array] deserialized objects
+    #
+    def read_all(limit: nil)
+    end
+
     #
     # Deserializes an object and ignores it. This method is faster than _read_.
+    # It only advances the read position and does not create any objects,
+    # also for indefinite length items and tags.
     #
     # This method could raise same errors with _read_.
     #
@@ -53,6 +97,23 @@ module CBOR
     def skip
     end
 
+    #
+    # Deserializes only the part of the next object at _path_ and skips the
+    # rest of it, like _skip_ does.  Integers in the path index arrays; other
+    # path elements are map keys, with Symbols standing for text strings.
+    # UTF-8 and US-ASCII Strings match text string keys, and binary
+    # (ASCII-8BIT) Strings byte string keys.  Tags on the way to the item
+    # are ignored.
+    #
+    # This method could raise same errors with _read_.  After an error,
+    # the unpacker should be reset.
+    #
+    # @param path [Array<Object>]
+    # @return [Object] deserialized item at _path_, or nil if there is none
+    #
+    def dig(*path)
+    end
+
     #
     # Deserializes a nil value if it exists and returns _true_.
     # Otherwise, if a byte exists but the byte doesn't represent nil value,
@@ -89,6 +150,41 @@ module CBOR
     def read_map_header
     end
 
+    #
+    # Reads the next token of the serialized data and returns it as an event.
+    # Arrays and maps are not built; the unpacker only keeps track of their
+    # nesting, so documents of any size can be processed in constant memory.
+    #
+    # * [:array_start, n] an array of _n_ items (nil if indefinite length)
+    # * [:map_start, n] a map of _n_ pairs (nil if indefinite length)
+    # * [:tag, t] tag _t_; the tagged item follows
+    # * [:value, v] a scalar or a complete string
+    # * [:end] the end of the innermost array or map
+    #
+    # Tags are not interpreted, so e.g. a bignum is reported as a tag and
+    # a byte string.
+    #
+    # If there're not enough buffer, this method raises EOFError; the
+    # unpacker can continue after more data has been fed.
+    #
+    # @return [Array] event
+    #
+    def next_event
+    end
+
+    #
+    # Reads up to _limit_ events (see _next_event_) into _events_, which is
+    # cleared first, as flat pairs of event type and argument ([:end] adds
+    # nil as argument).  Unlike _next_event_, this stops when the buffer
+    # runs out instead of raising EOFError.
+    #
+    # @param events [Array] array to fill
+    # @param limit [Integer] maximum number of events
+    # @return [Integer] number of events read
+    #
+    def next_events(events, limit=1024)
+    end
+
     #
     # Appends data into the internal buffer.
     # This method calls buffer.append(data).
@@ -126,6 +222,14 @@ module CBOR
     def feed_each(data, &block)
     end
 
+    #
+    # Returns counters of the map key cache (see the :key_cache option).
+    #
+    # @return [Hash] :size, :hits and :misses
+    #
+    def key_cache_stats
+    end
+
     #
     # Resets deserialization state of the unpacker and clears the internal buffer.
     #
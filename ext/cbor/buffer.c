@@ -40,13 +40,13 @@ static ID s_replace;
 #endif
 
 #ifndef DISABLE_RMEM
-static msgpack_rmem_t s_rmem;
+static msgpack_rmem_pools_t s_rmem;
 #endif
 
 void msgpack_buffer_static_init()
 {
 #ifndef DISABLE_RMEM
-    msgpack_rmem_init(&s_rmem);
+    msgpack_rmem_pools_init(&s_rmem);
 #endif
 #ifndef HAVE_RB_STR_REPLACE
     s_replace = rb_intern("replace");
@@ -63,7 +63,7 @@ void msgpack_buffer_static_init()
 void msgpack_buffer_static_destroy()
 {
 #ifndef DISABLE_RMEM
-    msgpack_rmem_destroy(&s_rmem);
+    msgpack_rmem_pools_destroy(&s_rmem);
 #endif
 }
 
@@ -77,13 +77,16 @@ void msgpack_buffer_init(msgpack_buffer_t* b)
     b->io_buffer_size = MSGPACK_BUFFER_IO_BUFFER_SIZE_DEFAULT;
     b->io = Qnil;
     b->io_buffer = Qnil;
+#ifndef DISABLE_RMEM
+    b->rmem_pool = msgpack_rmem_pools_current(&s_rmem);
+#endif
 }
 
-static void _msgpack_buffer_chunk_destroy(msgpack_buffer_chunk_t* c)
+static void _msgpack_buffer_chunk_destroy(msgpack_buffer_t* b, msgpack_buffer_chunk_t* c)
 {
     if(c->mem != NULL) {
 #ifndef DISABLE_RMEM
-        if(!msgpack_rmem_free(&s_rmem, c->mem)) {
+        if(!msgpack_rmem_pool_free(b->rmem_pool, c->mem)) {
             free(c->mem);
         }
         /* no needs to update rmem_owner because chunks will not be
@@ -104,11 +107,11 @@ void msgpack_buffer_destroy(msgpack_buffer_t* b)
     msgpack_buffer_chunk_t* c = b->head;
     while(c != &b->tail) {
         msgpack_buffer_chunk_t* n = c->next;
-        _msgpack_buffer_chunk_destroy(c);
+        _msgpack_buffer_chunk_destroy(b, c);
         free(c);
         c = n;
     }
-    _msgpack_buffer_chunk_destroy(c);
+    _msgpack_buffer_chunk_destroy(b, c);
 
     c = b->free_list;
     while(c != NULL) {
@@ -136,7 +139,7 @@ void msgpack_buffer_mark(msgpack_buffer_t* b)
 
 bool _msgpack_buffer_shift_chunk(msgpack_buffer_t* b)
 {
-    _msgpack_buffer_chunk_destroy(b->head);
+    _msgpack_buffer_chunk_destroy(b, b->head);
 
     if(b->head == &b->tail) {
         /* list becomes empty. don't add head to free_list
@@ -164,6 +167,25 @@ void msgpack_buffer_clear(msgpack_buffer_t* b)
     }
 }
 
+void msgpack_buffer_write_into_string(msgpack_buffer_t* b, VALUE string)
+{
+    /* as a mapped chunk, it is never reallocated or freed */
+    char* mem = RSTRING_PTR(string);
+    b->tail.first = mem;
+    b->tail.last = mem;
+    b->tail.mem = NULL;
+    b->tail.mapped_string = string;
+    b->tail_buffer_end = mem + RSTRING_LEN(string);
+    b->read_buffer = mem;
+}
+
+bool msgpack_buffer_is_filled_string(msgpack_buffer_t* b, VALUE string)
+{
+    return b->head == &b->tail && b->tail.mapped_string == string &&
+        b->read_buffer == RSTRING_PTR(string) &&
+        b->tail.last == RSTRING_PTR(string) + RSTRING_LEN(string);
+}
+
 size_t msgpack_buffer_read_to_string_nonblock(msgpack_buffer_t* b, VALUE string, size_t length)
 {
     size_t avail = msgpack_buffer_top_readable_size(b);
@@ -368,7 +390,7 @@ static inline void* _msgpack_buffer_chunk_malloc(
 #endif
             /* alloc new rmem page */
             *allocated_size = MSGPACK_RMEM_PAGE_SIZE;
-            char* buffer = msgpack_rmem_alloc(&s_rmem);
+            char* buffer = msgpack_rmem_pool_alloc(b->rmem_pool);
             c->mem = buffer;
 
             /* update rmem owner */
@@ -117,6 +117,7 @@ struct msgpack_buffer_t {
     char* rmem_last;
     char* rmem_end;
     void** rmem_owner;
+    struct msgpack_rmem_pool_t* rmem_pool;
 #endif
 
     union msgpack_buffer_cast_block_t cast_block;
@@ -148,6 +149,13 @@ void msgpack_buffer_mark(msgpack_buffer_t* b);
 
 void msgpack_buffer_clear(msgpack_buffer_t* b);
 
+/* Makes the empty buffer write into _string_ (up to its length) before
+ * allocating chunks of its own. */
+void msgpack_buffer_write_into_string(msgpack_buffer_t* b, VALUE string);
+
+/* true if the buffer holds exactly _string_, filled up */
+bool msgpack_buffer_is_filled_string(msgpack_buffer_t* b, VALUE string);
+
 static inline void msgpack_buffer_set_write_reference_threshold(msgpack_buffer_t* b, size_t length)
 {
     if(length < MSGPACK_BUFFER_STRING_WRITE_REFERENCE_MINIMUM) {
@@ -439,6 +447,56 @@ static inline VALUE _msgpack_buffer_refer_head_mapped_string(msgpack_buffer_t* b
     return rb_str_substr(b->head->mapped_string, offset, length);
 }
 
+static inline bool _msgpack_buffer_top_is_ascii(msgpack_buffer_t* b, size_t length)
+{
+    unsigned char bits = 0;
+    size_t i;
+    for (i = 0; i < length; i++) {
+      bits |= (unsigned char) b->read_buffer[i];
+    }
+    return (bits & 0x80) == 0;
+}
+
+/* Symbol for the UTF-8 text at the read position; does not consume it */
+static inline VALUE _msgpack_buffer_top_as_symbol(msgpack_buffer_t* b, size_t length)
+{
+    VALUE result;
+#ifdef HAVE_RB_CHECK_SYMBOL_CSTR
+    /* most keys name existing symbols: look them up without a String
+     * (rb_check_symbol_cstr raises for invalid UTF-8) */
+    if (_msgpack_buffer_top_is_ascii(b, length)) {
+      result = rb_check_symbol_cstr(b->read_buffer, length, rb_utf8_encoding());
+      if (result != Qnil) {
+        return result;
+      }
+    }
+    VALUE name = rb_enc_str_new(b->read_buffer, length, rb_utf8_encoding());
+    if (rb_enc_str_coderange(name) == ENC_CODERANGE_BROKEN) {
+      /* not valid UTF-8: a binary Symbol, as before */
+      rb_enc_associate_index(name, rb_ascii8bit_encindex());
+    }
+    result = rb_str_intern(name);
+#else
+#ifndef HAVE_RB_STR_INTERN
+#ifndef HAVE_RB_INTERN_STR
+    /* MRI 1.8 doesn't have rb_intern_str or rb_intern2, hack it... */
+    char *tmp = xmalloc(length+1);
+    memcpy(tmp, b->read_buffer, length);
+    tmp[length] = 0;
+    result = ID2SYM(rb_intern(tmp));
+    xfree(tmp);
+#else
+    result = ID2SYM(rb_intern2(b->read_buffer, length));
+    /* FIXME: This is stuck at ASCII encoding */
+#endif
+#else
+    /* enable GC-able symbols here: */
+    result = rb_str_intern(rb_str_new(b->read_buffer, length));
+#endif
+#endif
+    return result;
+}
+
 static inline VALUE msgpack_buffer_read_top_as_string(msgpack_buffer_t* b, size_t length, bool will_be_frozen, bool as_symbol)
 {
 #ifndef DISABLE_BUFFER_READ_REFERENCE_OPTIMIZE
@@ -454,23 +512,7 @@ static inline VALUE msgpack_buffer_read_top_as_string(msgpack_buffer_t* b, size_
 
     VALUE result;
     if (as_symbol) {
-#ifndef HAVE_RB_STR_INTERN
-#ifndef HAVE_RB_INTERN_STR
-      /* MRI 1.8 doesn't have rb_intern_str or rb_intern2, hack it... */
-      char *tmp = xmalloc(length+1);
-      memcpy(tmp, b->read_buffer, length);
-      tmp[length] = 0;
-      result = ID2SYM(rb_intern(tmp));
-      xfree(tmp);
-#else
-      result = ID2SYM(rb_intern2(b->read_buffer, length));
-      /* FIXME: This is stuck at ASCII encoding */
-#endif
-#else
-      /* enable GC-able symbols here: */
-      result = rb_str_intern(rb_str_new(b->read_buffer, length));
-#endif
-      /* todo: rb_check_id_cstr(const char *ptr, long len, rb_encoding *enc) */
+      result = _msgpack_buffer_top_as_symbol(b, length);
     } else {
       result = rb_str_new(b->read_buffer, length);
       /* todo: use rb_enc_str_new(const char *ptr, long len, rb_encoding *enc) ::  */
@@ -29,6 +29,7 @@
 #define IB_MT(ib) ((ib) >> 5)
 
 /* Tag numbers handled by this implementation */
+#define TAG_TIME_STRING 0
 #define TAG_TIME_EPOCH 1
 #define TAG_BIGNUM 2
 #define TAG_BIGNUM_NEG 3
@@ -28,19 +28,23 @@
 #include "core_ext.h"
 #include "packer.h"
 #include "packer_class.h"
+#include "typed_array.h"
+#include "raw.h"
+#include "type_registry.h"
 
 static inline VALUE delegete_to_pack(int argc, VALUE* argv, VALUE self)
 {
     if(argc == 0) {
         return MessagePack_pack(1, &self);
-    } else if(argc == 1) {
-        /* write to io */
-        VALUE argv2[2];
+    } else if(argc <= 2) {
+        /* write to io, or with options */
+        VALUE argv2[3];
         argv2[0] = self;
         argv2[1] = argv[0];
-        return MessagePack_pack(2, argv2);
+        argv2[2] = argc == 2 ? argv[1] : Qnil;
+        return MessagePack_pack(argc + 1, argv2);
     } else {
-        rb_raise(rb_eArgError, "wrong number of arguments (%d for 0..1)", argc);
+        rb_raise(rb_eArgError, "wrong number of arguments (%d for 0..2)", argc);
     }
 }
 
@@ -152,6 +156,20 @@ static VALUE Tagged_to_msgpack(int argc, VALUE* argv, VALUE self)
     return packer;
 }
 
+static VALUE TypedArray_to_msgpack(int argc, VALUE* argv, VALUE self)
+{
+    ENSURE_PACKER(argc, argv, packer, pk);
+    msgpack_packer_write_typed_array_value(pk, self);
+    return packer;
+}
+
+static VALUE Raw_to_msgpack(int argc, VALUE* argv, VALUE self)
+{
+    ENSURE_PACKER(argc, argv, packer, pk);
+    msgpack_packer_write_raw(pk, MessagePack_Raw_bytes(self));
+    return packer;
+}
+
 static VALUE Regexp_to_msgpack(int argc, VALUE* argv, VALUE self)
 {
     ENSURE_PACKER(argc, argv, packer, pk);
@@ -169,7 +187,7 @@ static VALUE URI_to_msgpack(int argc, VALUE* argv, VALUE self)
 static VALUE Time_to_msgpack(int argc, VALUE* argv, VALUE self)
 {
     ENSURE_PACKER(argc, argv, packer, pk);
-    msgpack_packer_write_processed_value(pk, self, rb_intern("to_i"), TAG_TIME_EPOCH);
+    msgpack_packer_write_time_value(pk, self);
     return packer;
 }
 
@@ -191,11 +209,21 @@ void MessagePack_core_ext_module_init()
     rb_define_method(rb_cSymbol, "to_cbor", Symbol_to_msgpack, -1);
     rb_define_method(rb_cTime,   "to_cbor", Time_to_msgpack, -1);
     rb_define_method(rb_cRegexp,   "to_cbor", Regexp_to_msgpack, -1);
+    msgpack_type_registry_add_builtin(rb_cRegexp);
     if (rb_const_defined(rb_cObject, rb_intern("URI"))) {
-      rb_define_method(rb_const_get(rb_cObject, rb_intern("URI")),
-                       "to_cbor", URI_to_msgpack, -1);
+      VALUE mURI = rb_const_get(rb_cObject, rb_intern("URI"));
+      rb_define_method(mURI, "to_cbor", URI_to_msgpack, -1);
+      if (rb_const_defined(mURI, rb_intern("Generic"))) {
+        msgpack_type_registry_add_builtin(rb_const_get(mURI, rb_intern("Generic")));
+      }
     }
     rb_define_method(rb_cCBOR_Simple,   "to_cbor", Simple_to_msgpack, -1);
     rb_define_method(rb_cCBOR_Tagged,   "to_cbor", Tagged_to_msgpack, -1);
+    rb_define_method(cMessagePack_TypedArray, "to_cbor", TypedArray_to_msgpack, -1);
+    rb_define_method(cMessagePack_Raw, "to_cbor", Raw_to_msgpack, -1);
+    msgpack_type_registry_add_builtin(rb_cCBOR_Simple);
+    msgpack_type_registry_add_builtin(rb_cCBOR_Tagged);
+    msgpack_type_registry_add_builtin(cMessagePack_TypedArray);
+    msgpack_type_registry_add_builtin(cMessagePack_Raw);
 }
 
@@ -8,10 +8,21 @@ have_func("rb_intern_str", ["ruby.h"])
 have_func("rb_sym2str", ["ruby.h"])
 have_func("rb_str_intern", ["ruby.h"])
 have_func("rb_integer_unpack", ["ruby.h"])
+have_func("rb_enc_interned_str", ["ruby.h", "ruby/encoding.h"])
+have_func("rb_check_symbol_cstr", ["ruby.h", "ruby/encoding.h"])
+have_func("rb_thread_call_without_gvl", ["ruby.h", "ruby/thread.h"])
+have_func("rb_hash_new_capa", ["ruby.h"])
+have_func("rb_hash_bulk_insert", ["ruby.h"])
+have_header("ruby/ractor.h")
+have_header("ruby/thread_native.h")
+have_header("ruby/atomic.h")
+have_func("rb_ractor_local_storage_ptr_newkey", ["ruby.h", "ruby/ractor.h"])
+have_func("rb_ext_ractor_safe", ["ruby.h"])
 
 append_cflags(%w[-I.. -Wall -O3 -g -std=c99])
 #$CFLAGS << %[ -DDISABLE_RMEM]
 #$CFLAGS << %[ -DDISABLE_RMEM_REUSE_INTERNAL_FRAGMENT]
+#$CFLAGS << %[ -DDISABLE_RMEM_RACTOR_LOCAL]
 #$CFLAGS << %[ -DDISABLE_BUFFER_READ_REFERENCE_OPTIMIZE]
 #$CFLAGS << %[ -DDISABLE_BUFFER_READ_TO_S_OPTIMIZE]
 
@@ -26,6 +26,13 @@
  */
 
 #include "packer.h"
+#include "packer_class.h"
+#include "typed_array.h"
+#include "raw.h"
+
+static ID s_call;
+static ID s_to_h;
+static ID s_to_i;
 
 #ifdef RUBINIUS
 static ID s_to_iter;
@@ -36,6 +43,10 @@ static ID s_value;
 
 void msgpack_packer_static_init()
 {
+    s_call = rb_intern("call");
+    s_to_h = rb_intern("to_h");
+    s_to_i = rb_intern("to_i");
+
 #ifdef RUBINIUS
     s_to_iter = rb_intern("to_iter");
     s_next = rb_intern("next");
@@ -54,6 +65,7 @@ void msgpack_packer_init(msgpack_packer_t* pk)
     msgpack_buffer_init(PACKER_BUFFER_(pk));
 
     pk->io = Qnil;
+    pk->scratch_packer = Qnil;
 }
 
 void msgpack_packer_destroy(msgpack_packer_t* pk)
@@ -68,6 +80,11 @@ void msgpack_packer_mark(msgpack_packer_t* pk)
     /* See MessagePack_Buffer_wrap */
     /* msgpack_buffer_mark(PACKER_BUFFER_(pk)); */
     rb_gc_mark(pk->buffer_ref);
+    rb_gc_mark(pk->scratch_packer);
+    int i;
+    for(i = 0; i < MSGPACK_PACKER_TYPE_CACHE_SIZE; i++) {
+        rb_gc_mark(pk->type_cache[i].klass);
+    }
 }
 
 void msgpack_packer_reset(msgpack_packer_t* pk)
@@ -80,10 +97,65 @@ void msgpack_packer_reset(msgpack_packer_t* pk)
 }
 
 
+static void write_typed_array(msgpack_packer_t* pk, int type, VALUE v)
+{
+    size_t length = RARRAY_LEN(v) * MessagePack_TypedArray_element_size(type);
+    cbor_encoder_write_head(pk, IB_TAG, TAG_TYPED_ARRAY_FIRST + type);
+    cbor_encoder_write_head(pk, IB_BYTES, length);
+
+    /* converted in one pass, directly into the buffer */
+    msgpack_buffer_t* b = PACKER_BUFFER_(pk);
+    msgpack_buffer_ensure_writable(b, length);
+    MessagePack_TypedArray_store(type, v, b->tail.last);
+    b->tail.last += length;
+}
+
+static inline size_t typed_array_size(int type, unsigned long len)
+{
+    size_t length = len * MessagePack_TypedArray_element_size(type);
+    return msgpack_packer_head_size(TAG_TYPED_ARRAY_FIRST + type) +
+        msgpack_packer_head_size(length) + length;
+}
+
+/* element type to write the Array _v_ as a typed array with, or -1 if it
+ * can't be one, or would be larger than as a plain array */
+static int typed_array_type(msgpack_packer_t* pk, VALUE v, unsigned long len)
+{
+    if(pk->typed_arrays_min_length == 0 || len < pk->typed_arrays_min_length) {
+        return -1;
+    }
+    int type = MessagePack_TypedArray_detect(v);
+    if(type < 0) {
+        return -1;
+    }
+
+    /* elements are all Fixnums or all Floats */
+    size_t typed = typed_array_size(type, len);
+    size_t plain = msgpack_packer_head_size(len);
+    unsigned long i;
+    for(i = 0; i < len && plain < typed; i++) {
+        VALUE e = RARRAY_AREF(v, i);
+        if(FIXNUM_P(e)) {
+            long l = FIX2LONG(e);
+            plain += msgpack_packer_head_size(l < 0 ? ~(uint64_t) l : (uint64_t) l);
+        } else {
+            plain += msgpack_packer_double_size(RFLOAT_VALUE(e));
+        }
+    }
+    return plain < typed ? -1 : type;
+}
+
 void msgpack_packer_write_array_value(msgpack_packer_t* pk, VALUE v)
 {
     /* actual return type of RARRAY_LEN is long */
     unsigned long len = RARRAY_LEN(v);
+
+    int type = typed_array_type(pk, v, len);
+    if(type >= 0) {
+        write_typed_array(pk, type, v);
+        return;
+    }
+
     msgpack_packer_write_array_header(pk, len);
 
     unsigned long i;
@@ -93,6 +165,45 @@ void msgpack_packer_write_array_value(msgpack_packer_t* pk, VALUE v)
     }
 }
 
+typedef struct {
+    VALUE time;
+    struct timespec ts;
+} time_timespec_args_t;
+
+static VALUE time_timespec(VALUE arg)
+{
+    time_timespec_args_t* args = (time_timespec_args_t*) arg;
+    args->ts = rb_time_timespec(args->time);
+    return Qnil;
+}
+
+bool msgpack_packer_time_timespec(VALUE v, struct timespec* ts)
+{
+    time_timespec_args_t args;
+    int state = 0;
+    args.time = v;
+    rb_protect(time_timespec, (VALUE) &args, &state);
+    if(state != 0) {
+        if(!rb_obj_is_kind_of(rb_errinfo(), rb_eArgError)) {
+            rb_jump_tag(state);
+        }
+        /* "time out of system range" */
+        rb_set_errinfo(Qnil);
+        return false;
+    }
+    *ts = args.ts;
+    return true;
+}
+
+void msgpack_packer_write_typed_array_value(msgpack_packer_t* pk, VALUE v)
+{
+    int type = MessagePack_TypedArray_type(v);
+    VALUE data = MessagePack_TypedArray_data(v, type);
+    cbor_encoder_write_head(pk, IB_TAG, TAG_TYPED_ARRAY_FIRST + type);
+    cbor_encoder_write_head(pk, IB_BYTES, RSTRING_LEN(data));
+    msgpack_buffer_append_string(PACKER_BUFFER_(pk), data);
+}
+
 static int write_hash_foreach(VALUE key, VALUE value, VALUE pk_value)
 {
     if (key == Qundef) {
@@ -104,6 +215,116 @@ static int write_hash_foreach(VALUE key, VALUE value, VALUE pk_value)
     return ST_CONTINUE;
 }
 
+typedef struct {
+    size_t offset;
+    const char* key;
+    size_t length;
+    VALUE value;
+} sorted_entry_t;
+
+typedef struct {
+    msgpack_packer_t* key_pk;
+    sorted_entry_t* entries;
+    unsigned long count;
+    unsigned long capacity;
+} sorted_entries_t;
+
+static msgpack_packer_t* scratch_packer_of(msgpack_packer_t* pk)
+{
+    if(pk->scratch_packer == Qnil) {
+        pk->scratch_packer = rb_obj_alloc(cMessagePack_Packer);
+    }
+    msgpack_packer_t* key_pk;
+    Data_Get_Struct(pk->scratch_packer, msgpack_packer_t, key_pk);
+    key_pk->typed_arrays_min_length = pk->typed_arrays_min_length;
+    key_pk->deterministic = pk->deterministic;
+    key_pk->structs = pk->structs;
+    return key_pk;
+}
+
+/* encodes the keys one after the other; their offsets go into entries */
+static int collect_sorted_entry(VALUE key, VALUE value, VALUE arg)
+{
+    if (key == Qundef) {
+        return ST_CONTINUE;
+    }
+    sorted_entries_t* se = (sorted_entries_t*) arg;
+    if(se->count == se->capacity) {
+        return ST_STOP;
+    }
+    msgpack_buffer_t* kb = PACKER_BUFFER_(se->key_pk);
+    size_t offset = msgpack_buffer_all_readable_size(kb);
+    msgpack_packer_write_value(se->key_pk, key);
+    sorted_entry_t* e = &se->entries[se->count++];
+    e->offset = offset;
+    e->length = msgpack_buffer_all_readable_size(kb) - offset;
+    e->value = value;
+    return ST_CONTINUE;
+}
+
+/* bytewise lexicographic order; a prefix sorts first */
+static int compare_sorted_entries(const void* a, const void* b)
+{
+    const sorted_entry_t* ea = (const sorted_entry_t*) a;
+    const sorted_entry_t* eb = (const sorted_entry_t*) b;
+    size_t n = ea->length < eb->length ? ea->length : eb->length;
+    int c = memcmp(ea->key, eb->key, n);
+    if(c != 0) {
+        return c;
+    }
+    return ea->length < eb->length ? -1 : ea->length > eb->length ? 1 : 0;
+}
+
+/*
+ * Each key is encoded exactly once, into the key packer; the entries are
+ * then sorted by pointers into a copy of its buffer, and the keys are
+ * written from there.  Values are written after sorting, so they can
+ * reuse the key packer for maps of their own.
+ */
+static void write_sorted_hash_value(msgpack_packer_t* pk, VALUE v, unsigned long len)
+{
+    msgpack_packer_t* key_pk = scratch_packer_of(pk);
+    msgpack_buffer_t* kb = PACKER_BUFFER_(key_pk);
+    msgpack_buffer_clear(kb);
+
+    VALUE entries_v;
+    sorted_entries_t se;
+    se.key_pk = key_pk;
+    se.entries = ALLOCV_N(sorted_entry_t, entries_v, len);
+    se.count = 0;
+    se.capacity = len;
+    rb_hash_foreach(v, collect_sorted_entry, (VALUE) &se);
+    if(se.count != len) {
+        rb_raise(rb_eRuntimeError, "hash modified during iteration");
+    }
+
+    VALUE keys = msgpack_buffer_all_as_string(kb);
+    msgpack_buffer_clear(kb);
+    const char* base = RSTRING_PTR(keys);
+
+    unsigned long i;
+    for(i = 0; i < len; i++) {
+        se.entries[i].key = base + se.entries[i].offset;
+    }
+    qsort(se.entries, len, sizeof(sorted_entry_t), compare_sorted_entries);
+
+    for(i = 1; i < len; i++) {
+        if(compare_sorted_entries(&se.entries[i - 1], &se.entries[i]) == 0) {
+            rb_raise(rb_eArgError, "duplicate map key in deterministic encoding");
+        }
+    }
+
+    msgpack_buffer_t* b = PACKER_BUFFER_(pk);
+    for(i = 0; i < len; i++) {
+        msgpack_buffer_append(b, se.entries[i].key, se.entries[i].length);
+        msgpack_packer_write_value(pk, se.entries[i].value);
+    }
+
+    ALLOCV_END(entries_v);
+    RB_GC_GUARD(keys);
+    RB_GC_GUARD(v);
+}
+
 void msgpack_packer_write_hash_value(msgpack_packer_t* pk, VALUE v)
 {
     /* actual return type of RHASH_SIZE is long (if SIZEOF_LONG == SIZEOF_VOIDP
@@ -111,6 +332,11 @@ void msgpack_packer_write_hash_value(msgpack_packer_t* pk, VALUE v)
     unsigned long len = RHASH_SIZE(v);
     msgpack_packer_write_map_header(pk, len);
 
+    if(pk->deterministic && len > 1) {
+        write_sorted_hash_value(pk, v, len);
+        return;
+    }
+
 #ifdef RUBINIUS
     VALUE iter = rb_funcall(v, s_to_iter, 0);
     VALUE entry = Qnil;
@@ -124,8 +350,105 @@ void msgpack_packer_write_hash_value(msgpack_packer_t* pk, VALUE v)
 #endif
 }
 
+static const msgpack_type_entry_t* lookup_registered_type(msgpack_packer_t* pk, VALUE v)
+{
+    if(msgpack_type_registry_table == NULL) {
+        return NULL;
+    }
+    if(pk->type_cache_generation != msgpack_type_registry_generation) {
+        memset(pk->type_cache, 0, sizeof(pk->type_cache));
+        pk->type_cache_generation = msgpack_type_registry_generation;
+    }
+    VALUE klass = rb_obj_class(v);
+    msgpack_packer_type_cache_t* c =
+        &pk->type_cache[(klass / sizeof(VALUE)) & (MSGPACK_PACKER_TYPE_CACHE_SIZE - 1)];
+    if(c->klass != klass) {
+        c->klass = klass;
+        c->entry = msgpack_type_registry_lookup(klass);
+    }
+    return c->entry;
+}
+
+static void write_registered_value(msgpack_packer_t* pk, const msgpack_type_entry_t* e, VALUE v)
+{
+    msgpack_type_registry_check(e);
+    if(e->tagged) {
+        cbor_encoder_write_head(pk, IB_TAG, e->tag);
+    }
+
+    long i;
+    long len;
+    switch(e->packer) {
+    case MSGPACK_TYPE_PACKER_MEMBERS_ARRAY:
+        len = RSTRUCT_LEN(v);
+        msgpack_packer_write_array_header(pk, len);
+        for(i = 0; i < len; i++) {
+            msgpack_packer_write_value(pk, RSTRUCT_GET(v, i));
+        }
+        break;
+    case MSGPACK_TYPE_PACKER_MEMBERS_MAP:
+        len = RSTRUCT_LEN(v);
+        if(len != e->members) {
+            msgpack_packer_write_hash_value(pk, rb_funcall(v, s_to_h, 0));
+            break;
+        }
+        msgpack_packer_write_map_header(pk, len);
+        for(i = 0; i < len; i++) {
+            long j = pk->deterministic ? e->member_order[i] : i;
+            msgpack_packer_write_string_value(pk, RARRAY_AREF(e->member_names, j));
+            msgpack_packer_write_value(pk, RSTRUCT_GET(v, j));
+        }
+        break;
+    case MSGPACK_TYPE_PACKER_METHOD:
+        msgpack_packer_write_value(pk, rb_funcall(v, e->method, 0));
+        break;
+    default:
+        msgpack_packer_write_value(pk, rb_funcall(e->handler, s_call, 1, v));
+    }
+}
+
+/* Struct and Data objects are written natively with the structs option,
+ * unless they have a to_cbor of their own */
+static inline bool writes_struct_natively(msgpack_packer_t* pk, VALUE v)
+{
+    return pk->structs != MSGPACK_PACKER_STRUCTS_NONE && RB_TYPE_P(v, T_STRUCT) &&
+        !rb_respond_to(v, pk->to_msgpack_method);
+}
+
+static void write_struct_value(msgpack_packer_t* pk, VALUE v)
+{
+    long len = RSTRUCT_LEN(v);
+    long i;
+    if(pk->structs == MSGPACK_PACKER_STRUCTS_ARRAY) {
+        msgpack_packer_write_array_header(pk, len);
+        for(i = 0; i < len; i++) {
+            msgpack_packer_write_value(pk, RSTRUCT_GET(v, i));
+        }
+        return;
+    }
+    if(pk->deterministic) {
+        msgpack_packer_write_hash_value(pk, rb_funcall(v, s_to_h, 0));
+        return;
+    }
+    VALUE members = rb_struct_members(v);
+    msgpack_packer_write_map_header(pk, len);
+    for(i = 0; i < len; i++) {
+        msgpack_packer_write_symbol_value(pk, RARRAY_AREF(members, i));
+        msgpack_packer_write_value(pk, RSTRUCT_GET(v, i));
+    }
+}
+
 static void _msgpack_packer_write_other_value(msgpack_packer_t* pk, VALUE v)
 {
+    const msgpack_type_entry_t* e = lookup_registered_type(pk, v);
+    if(e != NULL) {
+        write_registered_value(pk, e, v);
+        return;
+    }
+    if(writes_struct_natively(pk, v)) {
+        write_struct_value(pk, v);
+        return;
+    }
     rb_funcall(v, pk->to_msgpack_method, 1, pk->to_msgpack_arg);
 }
 
@@ -162,8 +485,321 @@ void msgpack_packer_write_value(msgpack_packer_t* pk, VALUE v)
     case T_FLOAT:
         msgpack_packer_write_float_value(pk, v);
         break;
+    case T_DATA:
+        if(rb_obj_class(v) == rb_cTime) {
+            msgpack_packer_write_time_value(pk, v);
+            break;
+        }
+        if(rb_obj_class(v) == cMessagePack_Raw) {
+            msgpack_packer_write_raw(pk, MessagePack_Raw_bytes(v));
+            break;
+        }
+        /* fall through */
     default:
         _msgpack_packer_write_other_value(pk, v);
     }
 }
 
+typedef struct {
+    msgpack_packer_t* pk;
+    int flags;                  /* MSGPACK_PACKER_SIZE_* */
+    size_t size;
+    size_t items;               /* visited so far, with MSGPACK_PACKER_SIZE_PROBE */
+    bool unknown;
+} encoded_size_t;
+
+static bool add_encoded_size(encoded_size_t* es, VALUE v);
+
+/* sizes of the common immediates, checked inline for container items;
+ * 0 for other objects */
+static inline size_t immediate_encoded_size(VALUE v)
+{
+    if(FIXNUM_P(v)) {
+        long l = FIX2LONG(v);
+        return msgpack_packer_head_size(l < 0 ? ~(uint64_t) l : (uint64_t) l);
+    }
+#ifdef FLONUM_P
+    if(FLONUM_P(v)) {
+        return msgpack_packer_double_size(rb_float_value(v));
+    }
+#endif
+    if(v == Qnil || v == Qtrue || v == Qfalse) {
+        return 1;
+    }
+    return 0;
+}
+
+static inline bool add_item_encoded_size(encoded_size_t* es, VALUE v)
+{
+    if(es->flags & MSGPACK_PACKER_SIZE_PROBE) {
+        es->items++;
+        if(es->items * MSGPACK_PACKER_SIZE_PROBE_BYTES_PER_ITEM >
+                es->size + MSGPACK_PACKER_SIZE_PROBE_SLACK) {
+            return false;
+        }
+    }
+    size_t size = immediate_encoded_size(v);
+    if(size != 0) {
+        es->size += size;
+        return true;
+    }
+    return add_encoded_size(es, v);
+}
+
+static int encoded_size_foreach(VALUE key, VALUE value, VALUE arg)
+{
+    if (key == Qundef) {
+        return ST_CONTINUE;
+    }
+    encoded_size_t* es = (encoded_size_t*) arg;
+    if(!add_item_encoded_size(es, key) || !add_item_encoded_size(es, value)) {
+        es->unknown = true;
+        return ST_STOP;
+    }
+    return ST_CONTINUE;
+}
+
+static size_t string_encoded_size(VALUE v)
+{
+#ifdef COMPAT_HAVE_ENCODING
+    int enc = ENCODING_GET(v);
+    if (enc != s_enc_ascii8bit && enc != s_enc_utf8 && enc != s_enc_usascii &&
+            !ENC_CODERANGE_ASCIIONLY(v)) {
+        v = rb_str_encode(v, s_enc_utf8_value, 0, Qnil);
+    }
+#endif
+    size_t length = RSTRING_LEN(v);
+    return msgpack_packer_head_size(length) + length;
+}
+
+/* writes _v_ to the scratch packer to see how long it is */
+static bool add_measured_size(encoded_size_t* es, VALUE v)
+{
+    if(!(es->flags & MSGPACK_PACKER_SIZE_MEASURE_OTHERS)) {
+        return false;
+    }
+    msgpack_packer_t* spk = scratch_packer_of(es->pk);
+    msgpack_buffer_clear(PACKER_BUFFER_(spk));
+    msgpack_packer_write_value(spk, v);
+    es->size += msgpack_buffer_all_readable_size(PACKER_BUFFER_(spk));
+    msgpack_buffer_clear(PACKER_BUFFER_(spk));
+    return true;
+}
+
+static bool add_registered_encoded_size(encoded_size_t* es, const msgpack_type_entry_t* e, VALUE v)
+{
+    if(e->tagged) {
+        es->size += msgpack_packer_head_size(e->tag);
+    }
+
+    long i;
+    long len;
+    switch(e->packer) {
+    case MSGPACK_TYPE_PACKER_MEMBERS_ARRAY:
+        len = RSTRUCT_LEN(v);
+        es->size += msgpack_packer_head_size(len);
+        for(i = 0; i < len; i++) {
+            if(!add_item_encoded_size(es, RSTRUCT_GET(v, i))) {
+                return false;
+            }
+        }
+        return true;
+    case MSGPACK_TYPE_PACKER_MEMBERS_MAP:
+        len = RSTRUCT_LEN(v);
+        if(len != e->members) {
+            break;
+        }
+        es->size += msgpack_packer_head_size(len);
+        for(i = 0; i < len; i++) {
+            es->size += string_encoded_size(RARRAY_AREF(e->member_names, i));
+            if(!add_item_encoded_size(es, RSTRUCT_GET(v, i))) {
+                return false;
+            }
+        }
+        return true;
+    default:
+        break;
+    }
+
+    /* the other packers run Ruby code */
+    if(!(es->flags & MSGPACK_PACKER_SIZE_MEASURE_OTHERS)) {
+        return false;
+    }
+    msgpack_type_registry_check(e);
+    VALUE converted;
+    if(e->packer == MSGPACK_TYPE_PACKER_MEMBERS_MAP) {
+        converted = rb_funcall(v, s_to_h, 0);
+    } else if(e->packer == MSGPACK_TYPE_PACKER_METHOD) {
+        converted = rb_funcall(v, e->method, 0);
+    } else {
+        converted = rb_funcall(e->handler, s_call, 1, v);
+    }
+    return add_encoded_size(es, converted);
+}
+
+/* the order of the members doesn't matter */
+static bool add_struct_encoded_size(encoded_size_t* es, VALUE v)
+{
+    long len = RSTRUCT_LEN(v);
+    long i;
+    VALUE members = Qnil;
+    if(es->pk->structs == MSGPACK_PACKER_STRUCTS_MAP) {
+        members = rb_struct_members(v);
+    }
+    es->size += msgpack_packer_head_size(len);
+    for(i = 0; i < len; i++) {
+        if(members != Qnil && !add_item_encoded_size(es, RARRAY_AREF(members, i))) {
+            return false;
+        }
+        if(!add_item_encoded_size(es, RSTRUCT_GET(v, i))) {
+            return false;
+        }
+    }
+    return true;
+}
+
+static bool add_bignum_encoded_size(encoded_size_t* es, VALUE v)
+{
+#ifdef HAVE_RB_INTEGER_UNPACK
+    int nlz_bits;
+    size_t len = rb_absint_size(v, &nlz_bits);
+    int flags = INTEGER_PACK_LSWORD_FIRST | INTEGER_PACK_NATIVE_BYTE_ORDER;
+    bool negative = !RBIGNUM_POSITIVE_P(v);
+    if (negative) {
+        flags |= INTEGER_PACK_2COMP;
+        if (nlz_bits == CHAR_BIT - 1 && rb_absint_singlebit_p(v))
+            len--;
+    }
+    if (len > SIZEOF_LONG_LONG) {
+        es->size += 1 + msgpack_packer_head_size(len) + len;
+        return true;
+    }
+    uint64_t u;
+    rb_integer_pack(v, &u, 1, sizeof(u), 0, flags);
+    es->size += msgpack_packer_head_size(negative ? ~u : u);
+    return true;
+#else
+    return add_measured_size(es, v);
+#endif
+}
+
+static bool add_array_encoded_size(encoded_size_t* es, VALUE v)
+{
+    msgpack_packer_t* pk = es->pk;
+    unsigned long len = RARRAY_LEN(v);
+    int type = typed_array_type(pk, v, len);
+    if(type >= 0) {
+        es->size += typed_array_size(type, len);
+        return true;
+    }
+
+    es->size += msgpack_packer_head_size(len);
+    unsigned long i;
+    if(!(es->flags & MSGPACK_PACKER_SIZE_MEASURE_OTHERS)) {
+        /* no Ruby code runs that could change the Array */
+        const VALUE* items = RARRAY_CONST_PTR(v);
+        for(i = 0; i < len; i++) {
+            if(!add_item_encoded_size(es, items[i])) {
+                return false;
+            }
+        }
+        return true;
+    }
+    for(i = 0; i < len; i++) {
+        if(!add_item_encoded_size(es, rb_ary_entry(v, i))) {
+            return false;
+        }
+    }
+    return true;
+}
+
+static bool add_encoded_size(encoded_size_t* es, VALUE v)
+{
+    size_t size = immediate_encoded_size(v);
+    if(size != 0) {
+        es->size += size;
+        return true;
+    }
+
+    switch(rb_type(v)) {
+    case T_SYMBOL:
+#ifdef HAVE_RB_SYM2STR
+        es->size += string_encoded_size(rb_sym2str(v));
+#else
+        {
+            size_t len = strlen(rb_id2name(SYM2ID(v)));
+            es->size += msgpack_packer_head_size(len) + len;
+        }
+#endif
+        return true;
+    case T_STRING:
+        es->size += string_encoded_size(v);
+        return true;
+    case T_ARRAY:
+        return add_array_encoded_size(es, v);
+    case T_HASH:
+        es->size += msgpack_packer_head_size(RHASH_SIZE(v));
+        rb_hash_foreach(v, encoded_size_foreach, (VALUE) es);
+        return !es->unknown;
+    case T_BIGNUM:
+        return add_bignum_encoded_size(es, v);
+    case T_FLOAT:
+        es->size += msgpack_packer_double_size(rb_num2dbl(v));
+        return true;
+    case T_STRUCT:
+        if(rb_obj_class(v) == rb_cCBOR_Tagged) {
+            es->size += msgpack_packer_head_size(rb_num2ulong(rb_struct_aref(v, INT2FIX(0))));
+            return add_item_encoded_size(es, rb_struct_aref(v, INT2FIX(1)));
+        }
+        if(rb_obj_class(v) == rb_cCBOR_Simple) {
+            es->size += msgpack_packer_head_size(FIX2LONG(rb_struct_aref(v, INT2FIX(0))));
+            return true;
+        }
+        break;
+    case T_DATA:
+        if(rb_obj_class(v) == cMessagePack_Raw) {
+            es->size += RSTRING_LEN(MessagePack_Raw_bytes(v));
+            return true;
+        }
+        if(rb_obj_class(v) == rb_cTime) {
+            struct timespec ts;
+            if(!msgpack_packer_time_timespec(v, &ts)) {
+                es->size += 1;
+                return add_item_encoded_size(es, rb_funcall(v, s_to_i, 0));
+            }
+            if (ts.tv_nsec == 0) {
+                es->size += 1 + msgpack_packer_head_size(ts.tv_sec < 0 ?
+                        ~(uint64_t) ts.tv_sec : (uint64_t) ts.tv_sec);
+            } else {
+                es->size += 1 + msgpack_packer_double_size(ts.tv_sec + ts.tv_nsec / 1e9);
+            }
+            return true;
+        }
+        break;
+    default:
+        break;
+    }
+
+    const msgpack_type_entry_t* e = lookup_registered_type(es->pk, v);
+    if(e != NULL) {
+        return add_registered_encoded_size(es, e, v);
+    }
+    if(writes_struct_natively(es->pk, v)) {
+        return add_struct_encoded_size(es, v);
+    }
+    return add_measured_size(es, v);
+}
+
+size_t msgpack_packer_encoded_size(msgpack_packer_t* pk, VALUE v, int flags)
+{
+    encoded_size_t es;
+    es.pk = pk;
+    es.flags = flags;
+    es.size = 0;
+    es.items = 0;
+    es.unknown = false;
+    if(!add_encoded_size(&es, v)) {
+        return MSGPACK_PACKER_SIZE_UNKNOWN;
+    }
+    return es.size;
+}
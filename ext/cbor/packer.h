@@ -28,11 +28,49 @@
 #define MSGPACK_RUBY_PACKER_H__
 
 #include "buffer.h"
+#include "type_registry.h"
 
 #ifndef MSGPACK_PACKER_IO_FLUSH_THRESHOLD_TO_WRITE_STRING_BODY
 #define MSGPACK_PACKER_IO_FLUSH_THRESHOLD_TO_WRITE_STRING_BODY (1024)
 #endif
 
+/* minimum Array length for typed_arrays: true */
+#ifndef MSGPACK_PACKER_TYPED_ARRAYS_MIN_LENGTH_DEFAULT
+#define MSGPACK_PACKER_TYPED_ARRAYS_MIN_LENGTH_DEFAULT (16)
+#endif
+
+/* CBOR.encode measures containers first, and writes them into a String
+ * of exactly that size, unless the items seen so far average less than
+ * this many bytes (after the slack) */
+#ifndef MSGPACK_PACKER_SIZE_PROBE_BYTES_PER_ITEM
+#define MSGPACK_PACKER_SIZE_PROBE_BYTES_PER_ITEM 16
+#endif
+
+#ifndef MSGPACK_PACKER_SIZE_PROBE_SLACK
+#define MSGPACK_PACKER_SIZE_PROBE_SLACK 128
+#endif
+
+/* smaller containers aren't worth measuring */
+#ifndef MSGPACK_PACKER_SIZE_PROBE_MIN_ITEMS
+#define MSGPACK_PACKER_SIZE_PROBE_MIN_ITEMS 16
+#endif
+
+/* number of classes whose type registry entries a packer remembers
+ * (a power of 2) */
+#ifndef MSGPACK_PACKER_TYPE_CACHE_SIZE
+#define MSGPACK_PACKER_TYPE_CACHE_SIZE 8
+#endif
+
+typedef struct {
+    VALUE klass;
+    const msgpack_type_entry_t* entry;  /* NULL if not registered */
+} msgpack_packer_type_cache_t;
+
+/* how Struct and Data objects without to_cbor are written */
+#define MSGPACK_PACKER_STRUCTS_NONE 0
+#define MSGPACK_PACKER_STRUCTS_ARRAY 1  /* members as an array */
+#define MSGPACK_PACKER_STRUCTS_MAP 2    /* member names and values as a map */
+
 struct msgpack_packer_t;
 typedef struct msgpack_packer_t msgpack_packer_t;
 
@@ -45,6 +83,25 @@ struct msgpack_packer_t {
     ID to_msgpack_method;
     VALUE to_msgpack_arg;
 
+    /* Arrays of at least this many Fixnums or Floats are written as
+     * typed arrays; 0 disables */
+    unsigned long typed_arrays_min_length;
+
+    /* sort map keys by their encoding (RFC 8949, section 4.2.1) */
+    bool deterministic;
+
+    /* MSGPACK_PACKER_STRUCTS_* */
+    int structs;
+
+    /* Packer that map keys are encoded into for sorting, and objects with
+     * their own to_cbor for measuring; created on demand */
+    VALUE scratch_packer;
+
+    /* recent CBOR.register_type lookups, valid for one generation of
+     * the registry */
+    msgpack_packer_type_cache_t type_cache[MSGPACK_PACKER_TYPE_CACHE_SIZE];
+    size_t type_cache_generation;
+
     VALUE buffer_ref;
 };
 
@@ -82,7 +139,7 @@ static inline void cbor_encoder_write_head(msgpack_packer_t* pk, unsigned int ib
         msgpack_buffer_ensure_writable(PACKER_BUFFER_(pk), 1);
         msgpack_buffer_write_1(PACKER_BUFFER_(pk), ib + (int)n);
     } else if (n < 256) {
-        msgpack_buffer_ensure_writable(PACKER_BUFFER_(pk), 3);
+        msgpack_buffer_ensure_writable(PACKER_BUFFER_(pk), 2);
         msgpack_buffer_write_2(PACKER_BUFFER_(pk), ib + 24, n);
     } else if (n < 65536) {
         msgpack_buffer_ensure_writable(PACKER_BUFFER_(pk), 3);
@@ -192,6 +249,51 @@ static inline void msgpack_packer_write_double(msgpack_packer_t* pk, double v)
   }
 }
 
+/* encoded sizes, following cbor_encoder_write_head and
+ * msgpack_packer_write_double */
+static inline size_t msgpack_packer_head_size(uint64_t n)
+{
+  if (n < 24)
+    return 1;
+  if (n < 256)
+    return 2;
+  if (n < 65536)
+    return 3;
+  if (n < 0x100000000LU)
+    return 5;
+  return 9;
+}
+
+static inline size_t msgpack_packer_double_size(double v)
+{
+  float fv = v;
+  if (fv == v) {
+    union {
+        float f;
+        uint32_t u32;
+    } castbuf = { fv };
+    uint32_t b32 = castbuf.u32;
+    if ((b32 & 0x1FFF) == 0) {
+      int exp = (b32 >> 23) & 0xff;
+      uint32_t mant = b32 & 0x7fffff;
+      if ((exp == 0 && mant == 0) ||
+          (exp >= 113 && exp <= 142) ||
+          (exp >= 103 && exp < 113 && !(mant & ((1U << (126 - exp)) - 1))) ||
+          (exp == 255 && mant == 0))
+        return 3;
+    }
+    return 5;
+  } else {
+    union {
+        double d;
+        uint64_t u64;
+    } castbuf = { v };
+    if (v != v && (castbuf.u64 & 0x1fffffffUL) == 0)
+      return (castbuf.u64 & 0x3ffffffffffUL) == 0 ? 3 : 5;
+    return 9;
+  }
+}
+
 static inline void msgpack_packer_write_array_header(msgpack_packer_t* pk, uint64_t n)
 {
   cbor_encoder_write_head(pk, IB_ARRAY, n);
@@ -253,29 +355,50 @@ static inline void msgpack_packer_write_bignum_value(msgpack_packer_t* pk, VALUE
 {
   long len;
   int ib = IB_UNSIGNED;
+
+#ifdef HAVE_RB_INTEGER_UNPACK
+  /* The argument of a negative integer, -1 - v, is the one's complement
+   * of the two's complement of v, so both are packed straight into the
+   * buffer without computing ~v as a Ruby object. */
+  int flags = INTEGER_PACK_BIG_ENDIAN;
+  int nlz_bits;
+  len = rb_absint_size(v, &nlz_bits);
   if (!RBIGNUM_POSITIVE_P(v)) {
-    v = rb_funcall(v, rb_intern("~"), 0);  /* should be rb_big_neg(), but that is static. */
     ib = IB_NEGATIVE;
+    flags |= INTEGER_PACK_2COMP;
+    if (nlz_bits == CHAR_BIT - 1 && rb_absint_singlebit_p(v))
+      len--;                    /* |v| is 2**(8*(len-1)), |v| - 1 is a byte shorter */
   }
 
-
-#ifdef HAVE_RB_INTEGER_UNPACK
-  len = rb_absint_size(v, NULL);
-
   if (len > SIZEOF_LONG_LONG) {                  /* i.e., need real bignum */
-    msgpack_buffer_ensure_writable(PACKER_BUFFER_(pk), 1);
-    msgpack_buffer_write_1(PACKER_BUFFER_(pk), IB_BIGNUM + IB_NEGFLAG_AS_BIT(ib));
+    msgpack_buffer_t* b = PACKER_BUFFER_(pk);
+    msgpack_buffer_ensure_writable(b, 1);
+    msgpack_buffer_write_1(b, IB_BIGNUM + IB_NEGFLAG_AS_BIT(ib));
     cbor_encoder_write_head(pk, IB_BYTES, len);
-    msgpack_buffer_ensure_writable(PACKER_BUFFER_(pk), len);
-
-    char buf[len];              /* XXX */
-    if (rb_integer_pack(v, buf, len, 1, 0, INTEGER_PACK_BIG_ENDIAN) != 1)
-      rb_raise(rb_eRangeError, "cbor rb_integer_pack() error");
-
-    msgpack_buffer_append(PACKER_BUFFER_(pk), buf, len);
+    msgpack_buffer_ensure_writable(b, len);
+
+    unsigned char* p = (unsigned char*) b->tail.last;
+    rb_integer_pack(v, p, len, 1, 0, flags);
+    if (ib == IB_NEGATIVE) {
+      long i;
+      for (i = 0; i < len; i++)
+        p[i] = ~p[i];
+    }
+    b->tail.last += len;
+  } else {
+    uint64_t u;
+    rb_integer_pack(v, &u, 1, sizeof(u), 0, INTEGER_PACK_LSWORD_FIRST | INTEGER_PACK_NATIVE_BYTE_ORDER |
+                   (flags & INTEGER_PACK_2COMP));
+    cbor_encoder_write_head(pk, ib, ib == IB_NEGATIVE ? ~u : u);
+  }
 
 #else
 
+  if (!RBIGNUM_POSITIVE_P(v)) {
+    v = rb_funcall(v, rb_intern("~"), 0);  /* should be rb_big_neg(), but that is static. */
+    ib = IB_NEGATIVE;
+  }
+
   len = RBIGNUM_LEN(v);
   if (len > SIZEOF_LONG_LONG/SIZEOF_BDIGITS) {
     msgpack_buffer_ensure_writable(PACKER_BUFFER_(pk), 1);
@@ -328,10 +451,10 @@ static inline void msgpack_packer_write_bignum_value(msgpack_packer_t* pk, VALUE
     }
 #endif
     }
-#endif
   } else {
     cbor_encoder_write_head(pk, ib, rb_big2ull(v));
   }
+#endif
 
 #ifdef RB_GC_GUARD
     RB_GC_GUARD(v);
@@ -350,10 +473,34 @@ static inline void msgpack_packer_write_simple_value(msgpack_packer_t* pk, VALUE
 
 void msgpack_packer_write_array_value(msgpack_packer_t* pk, VALUE v);
 
+void msgpack_packer_write_typed_array_value(msgpack_packer_t* pk, VALUE v);
+
 void msgpack_packer_write_hash_value(msgpack_packer_t* pk, VALUE v);
 
 void msgpack_packer_write_value(msgpack_packer_t* pk, VALUE v);
 
+#define MSGPACK_PACKER_SIZE_UNKNOWN ((size_t) -1)
+
+/* write objects with their own to_cbor to the scratch packer to measure
+ * them, rather than giving up */
+#define MSGPACK_PACKER_SIZE_MEASURE_OTHERS 1
+/* give up on objects of mostly short items, which are written about as
+ * fast as they are measured */
+#define MSGPACK_PACKER_SIZE_PROBE 2
+
+/*
+ * Number of bytes msgpack_packer_write_value would write for _v_, without
+ * writing them, or MSGPACK_PACKER_SIZE_UNKNOWN if it gives up.
+ */
+size_t msgpack_packer_encoded_size(msgpack_packer_t* pk, VALUE v, int flags);
+
+/* pre-encoded bytes, linked into the buffer rather than copied if they
+ * are at least write_reference_threshold long */
+static inline void msgpack_packer_write_raw(msgpack_packer_t* pk, VALUE string)
+{
+  msgpack_buffer_append_string(PACKER_BUFFER_(pk), string);
+}
+
 static inline void msgpack_packer_write_tagged_value(msgpack_packer_t* pk, VALUE v)
 {
   cbor_encoder_write_head(pk, IB_TAG, rb_num2ulong(rb_struct_aref(v, INT2FIX(0))));
@@ -366,5 +513,26 @@ static inline void msgpack_packer_write_processed_value(msgpack_packer_t* pk, VA
   msgpack_packer_write_value(pk, rb_funcall(v, method, 0));
 }
 
+/* like rb_time_timespec, but false if the Time is outside the range of
+ * time_t */
+bool msgpack_packer_time_timespec(VALUE v, struct timespec* ts);
+
+/* tag 1 with an integer epoch, or a float one if there are fractional
+ * seconds; Times outside the range of time_t are written as an integer
+ * (bignum) epoch */
+static inline void msgpack_packer_write_time_value(msgpack_packer_t* pk, VALUE v)
+{
+  struct timespec ts;
+  if (!msgpack_packer_time_timespec(v, &ts)) {
+    msgpack_packer_write_processed_value(pk, v, rb_intern("to_i"), TAG_TIME_EPOCH);
+    return;
+  }
+  cbor_encoder_write_head(pk, IB_TAG, TAG_TIME_EPOCH);
+  if (ts.tv_nsec == 0)
+    _msgpack_packer_write_long_long64(pk, ts.tv_sec);
+  else
+    msgpack_packer_write_double(pk, ts.tv_sec + ts.tv_nsec / 1e9);
+}
+
 #endif
 
@@ -68,6 +68,36 @@ static VALUE Packer_alloc(VALUE klass)
     return self;
 }
 
+static void Packer_set_options(msgpack_packer_t* pk, VALUE options)
+{
+    VALUE v = rb_hash_aref(options, ID2SYM(rb_intern("typed_arrays")));
+    if(v == Qtrue) {
+        pk->typed_arrays_min_length = MSGPACK_PACKER_TYPED_ARRAYS_MIN_LENGTH_DEFAULT;
+    } else if(RTEST(v)) {
+        long length = NUM2LONG(v);
+        if(length < 1) {
+            rb_raise(rb_eArgError, "typed_arrays minimum length must be positive");
+        }
+        pk->typed_arrays_min_length = (unsigned long) length;
+    } else {
+        pk->typed_arrays_min_length = 0;
+    }
+
+    v = rb_hash_aref(options, ID2SYM(rb_intern("deterministic")));
+    pk->deterministic = RTEST(v);
+
+    v = rb_hash_aref(options, ID2SYM(rb_intern("structs")));
+    if(v == Qnil) {
+        pk->structs = MSGPACK_PACKER_STRUCTS_NONE;
+    } else if(v == ID2SYM(rb_intern("array"))) {
+        pk->structs = MSGPACK_PACKER_STRUCTS_ARRAY;
+    } else if(v == ID2SYM(rb_intern("map"))) {
+        pk->structs = MSGPACK_PACKER_STRUCTS_MAP;
+    } else {
+        rb_raise(rb_eArgError, "structs must be :array, :map or nil");
+    }
+}
+
 static VALUE Packer_initialize(int argc, VALUE* argv, VALUE self)
 {
     VALUE io = Qnil;
@@ -100,7 +130,9 @@ static VALUE Packer_initialize(int argc, VALUE* argv, VALUE self)
         MessagePack_Buffer_initialize(PACKER_BUFFER_(pk), io, options);
     }
 
-    // TODO options
+    if(options != Qnil) {
+        Packer_set_options(pk, options);
+    }
 
     return self;
 }
@@ -139,6 +171,14 @@ static VALUE Packer_write_map_header(VALUE self, VALUE n)
     return self;
 }
 
+static VALUE Packer_write_raw(VALUE self, VALUE string)
+{
+    PACKER(self, pk);
+    StringValue(string);
+    msgpack_packer_write_raw(pk, string);
+    return self;
+}
+
 static VALUE Packer_flush(VALUE self)
 {
     PACKER(self, pk);
@@ -203,10 +243,13 @@ static VALUE Packer_write_to(VALUE self, VALUE io)
 
 VALUE MessagePack_pack(int argc, VALUE* argv)
 {
-    // TODO options
-
     VALUE v;
     VALUE io = Qnil;
+    VALUE options = Qnil;
+
+    if(argc >= 2 && rb_type(argv[argc - 1]) == T_HASH) {
+        options = argv[--argc];
+    }
 
     switch(argc) {
     case 2:
@@ -216,7 +259,7 @@ VALUE MessagePack_pack(int argc, VALUE* argv)
         v = argv[0];
         break;
     default:
-        rb_raise(rb_eArgError, "wrong number of arguments (%d for 1..2)", argc);
+        rb_raise(rb_eArgError, "wrong number of arguments (%d for 1..3)", argc);
     }
 
     VALUE self = Packer_alloc(cMessagePack_Packer);
@@ -227,6 +270,24 @@ VALUE MessagePack_pack(int argc, VALUE* argv)
     if(io != Qnil) {
         MessagePack_Buffer_initialize(PACKER_BUFFER_(pk), io, Qnil);
     }
+    if(options != Qnil) {
+        Packer_set_options(pk, options);
+    }
+
+    /* Large containers of long items are measured first and written
+     * straight into a String of that size, skipping the chunk growth and
+     * the copy into the result.  Should the size not match after all, the
+     * buffer goes on in chunks of its own. */
+    VALUE exact = Qnil;
+    if(io == Qnil && ((RB_TYPE_P(v, T_ARRAY) && RARRAY_LEN(v) >= MSGPACK_PACKER_SIZE_PROBE_MIN_ITEMS) ||
+                (RB_TYPE_P(v, T_HASH) && RHASH_SIZE(v) >= MSGPACK_PACKER_SIZE_PROBE_MIN_ITEMS))) {
+        size_t size = msgpack_packer_encoded_size(pk, v, MSGPACK_PACKER_SIZE_PROBE);
+        if(size != MSGPACK_PACKER_SIZE_UNKNOWN) {
+            exact = rb_str_new(NULL, size);
+            msgpack_buffer_set_write_reference_threshold(PACKER_BUFFER_(pk), SIZE_MAX);
+            msgpack_buffer_write_into_string(PACKER_BUFFER_(pk), exact);
+        }
+    }
 
     msgpack_packer_write_value(pk, v);
 
@@ -234,6 +295,8 @@ VALUE MessagePack_pack(int argc, VALUE* argv)
     if(io != Qnil) {
         msgpack_buffer_flush(PACKER_BUFFER_(pk));
         retval = Qnil;
+    } else if(exact != Qnil && msgpack_buffer_is_filled_string(PACKER_BUFFER_(pk), exact)) {
+        retval = exact;
     } else {
         retval = msgpack_buffer_all_as_string(PACKER_BUFFER_(pk));
     }
@@ -249,6 +312,38 @@ VALUE MessagePack_pack(int argc, VALUE* argv)
     return retval;
 }
 
+/**
+ * Document-method: CBOR.encoded_size
+ *
+ * call-seq:
+ *   CBOR.encoded_size(obj, options={}) -> Integer
+ */
+static VALUE MessagePack_encoded_size(int argc, VALUE* argv, VALUE mod)
+{
+    UNUSED(mod);
+    VALUE options = Qnil;
+
+    if(argc == 2) {
+        options = argv[1];
+        if(rb_type(options) != T_HASH) {
+            rb_raise(rb_eArgError, "expected Hash but found %s.", rb_obj_classname(options));
+        }
+    } else if(argc != 1) {
+        rb_raise(rb_eArgError, "wrong number of arguments (%d for 1..2)", argc);
+    }
+
+    VALUE self = Packer_alloc(cMessagePack_Packer);
+    PACKER(self, pk);
+    if(options != Qnil) {
+        Packer_set_options(pk, options);
+    }
+
+    size_t size = msgpack_packer_encoded_size(pk, argv[0], MSGPACK_PACKER_SIZE_MEASURE_OTHERS);
+
+    RB_GC_GUARD(self);
+    return SIZET2NUM(size);
+}
+
 static VALUE MessagePack_dump_module_method(int argc, VALUE* argv, VALUE mod)
 {
     UNUSED(mod);
@@ -279,6 +374,7 @@ void MessagePack_Packer_module_init(VALUE mMessagePack)
     rb_define_method(cMessagePack_Packer, "write_nil", Packer_write_nil, 0);
     rb_define_method(cMessagePack_Packer, "write_array_header", Packer_write_array_header, 1);
     rb_define_method(cMessagePack_Packer, "write_map_header", Packer_write_map_header, 1);
+    rb_define_method(cMessagePack_Packer, "write_raw", Packer_write_raw, 1);
     rb_define_method(cMessagePack_Packer, "flush", Packer_flush, 0);
 
     /* delegation methods */
@@ -300,5 +396,6 @@ void MessagePack_Packer_module_init(VALUE mMessagePack)
     rb_define_module_function(mMessagePack, "pack", MessagePack_pack_module_method, -1);
     rb_define_module_function(mMessagePack, "encode", MessagePack_pack_module_method, -1);
     rb_define_module_function(mMessagePack, "dump", MessagePack_dump_module_method, -1);
+    rb_define_module_function(mMessagePack, "encoded_size", MessagePack_encoded_size, -1);
 }
 
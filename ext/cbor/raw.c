@@ -0,0 +1,151 @@
+/*
+ * CBOR for Ruby
+ *
+ * Copyright (C) 2013 Carsten Bormann
+ *
+ *    Licensed under the Apache License, Version 2.0 (the "License").
+ */
+
+#include "raw.h"
+#include "unpacker.h"
+#include "unpacker_class.h"
+
+VALUE cMessagePack_Raw;
+
+static VALUE s_validate;
+
+typedef struct {
+    VALUE bytes;                /* Qnil until initialized */
+} msgpack_raw_t;
+
+static void Raw_mark(void* ptr)
+{
+    rb_gc_mark(((msgpack_raw_t*) ptr)->bytes);
+}
+
+static size_t Raw_memsize(const void* ptr)
+{
+    UNUSED(ptr);
+    return sizeof(msgpack_raw_t);
+}
+
+static const rb_data_type_t raw_type = {
+    "CBOR::Raw",
+    { Raw_mark, RUBY_TYPED_DEFAULT_FREE, Raw_memsize, },
+    NULL, NULL,
+#ifdef RUBY_TYPED_FROZEN_SHAREABLE
+    RUBY_TYPED_FREE_IMMEDIATELY | RUBY_TYPED_FROZEN_SHAREABLE
+#else
+    RUBY_TYPED_FREE_IMMEDIATELY
+#endif
+};
+
+static VALUE Raw_alloc(VALUE klass)
+{
+    msgpack_raw_t* raw;
+    VALUE self = TypedData_Make_Struct(klass, msgpack_raw_t, &raw_type, raw);
+    raw->bytes = Qnil;
+    return self;
+}
+
+VALUE MessagePack_Raw_bytes(VALUE v)
+{
+    msgpack_raw_t* raw;
+    TypedData_Get_Struct(v, msgpack_raw_t, &raw_type, raw);
+    if(raw->bytes == Qnil) {
+        rb_raise(rb_eTypeError, "uninitialized CBOR::Raw");
+    }
+    return raw->bytes;
+}
+
+/*
+ * The bytes are copied (cheaply, as a shared String) and frozen, so the
+ * packer can link them into its buffer instead of copying them again,
+ * and a Raw can be kept in a constant and shared with other Ractors.
+ */
+static VALUE Raw_initialize(int argc, VALUE* argv, VALUE self)
+{
+    VALUE bytes;
+    VALUE options = Qnil;
+    rb_scan_args(argc, argv, "11", &bytes, &options);
+
+    rb_check_frozen(self);
+    StringValue(bytes);
+    if(options != Qnil) {
+        Check_Type(options, T_HASH);
+        if(RTEST(rb_hash_aref(options, s_validate))) {
+            size_t offset;
+            int r = msgpack_unpacker_validate(RSTRING_PTR(bytes), RSTRING_LEN(bytes), 0, &offset);
+            if(r != PRIMITIVE_OBJECT_COMPLETE) {
+                MessagePack_raise_validate_error(r, offset);
+            }
+        }
+    }
+
+    bytes = rb_str_new_frozen(bytes);
+    if(ENCODING_GET(bytes) != rb_ascii8bit_encindex()) {
+        bytes = rb_str_dup(bytes);
+        rb_enc_associate_index(bytes, rb_ascii8bit_encindex());
+        OBJ_FREEZE(bytes);
+    }
+
+    msgpack_raw_t* raw;
+    TypedData_Get_Struct(self, msgpack_raw_t, &raw_type, raw);
+    RB_OBJ_WRITE(self, &raw->bytes, bytes);
+    return rb_obj_freeze(self);
+}
+
+static VALUE Raw_initialize_copy(VALUE self, VALUE other)
+{
+    rb_check_frozen(self);
+    msgpack_raw_t* raw;
+    TypedData_Get_Struct(self, msgpack_raw_t, &raw_type, raw);
+    RB_OBJ_WRITE(self, &raw->bytes, MessagePack_Raw_bytes(other));
+    return self;
+}
+
+static VALUE Raw_size(VALUE self)
+{
+    return LONG2NUM(RSTRING_LEN(MessagePack_Raw_bytes(self)));
+}
+
+static VALUE Raw_equal(VALUE self, VALUE other)
+{
+    if(self == other) {
+        return Qtrue;
+    }
+    if(rb_obj_class(self) != rb_obj_class(other)) {
+        return Qfalse;
+    }
+    return rb_str_equal(MessagePack_Raw_bytes(self), MessagePack_Raw_bytes(other));
+}
+
+static VALUE Raw_hash(VALUE self)
+{
+    return rb_funcall(MessagePack_Raw_bytes(self), rb_intern("hash"), 0);
+}
+
+static VALUE Raw_inspect(VALUE self)
+{
+    return rb_sprintf("#<%"PRIsVALUE" bytes=%+"PRIsVALUE">", rb_obj_class(self),
+            MessagePack_Raw_bytes(self));
+}
+
+void MessagePack_Raw_module_init(VALUE mMessagePack)
+{
+    s_validate = ID2SYM(rb_intern("validate"));
+
+    cMessagePack_Raw = rb_define_class_under(mMessagePack, "Raw", rb_cObject);
+    rb_define_alloc_func(cMessagePack_Raw, Raw_alloc);
+
+    rb_define_method(cMessagePack_Raw, "initialize", Raw_initialize, -1);
+    rb_define_method(cMessagePack_Raw, "initialize_copy", Raw_initialize_copy, 1);
+    rb_define_method(cMessagePack_Raw, "bytes", MessagePack_Raw_bytes, 0);
+    rb_define_method(cMessagePack_Raw, "size", Raw_size, 0);
+    rb_define_method(cMessagePack_Raw, "length", Raw_size, 0);
+    rb_define_method(cMessagePack_Raw, "==", Raw_equal, 1);
+    rb_define_method(cMessagePack_Raw, "eql?", Raw_equal, 1);
+    rb_define_method(cMessagePack_Raw, "hash", Raw_hash, 0);
+    rb_define_method(cMessagePack_Raw, "inspect", Raw_inspect, 0);
+}
+
@@ -0,0 +1,24 @@
+/*
+ * CBOR for Ruby
+ *
+ * Copyright (C) 2013 Carsten Bormann
+ *
+ *    Licensed under the Apache License, Version 2.0 (the "License").
+ */
+#ifndef MSGPACK_RUBY_RAW_H__
+#define MSGPACK_RUBY_RAW_H__
+
+#include "compat.h"
+#include "sysdep.h"
+
+/* CBOR::Raw, a pre-encoded data item written verbatim by the packer */
+extern VALUE cMessagePack_Raw;
+
+/* the frozen binary String with the encoded item; raises TypeError
+ * for an uninitialized Raw */
+VALUE MessagePack_Raw_bytes(VALUE v);
+
+void MessagePack_Raw_module_init(VALUE mMessagePack);
+
+#endif
+
@@ -28,7 +28,13 @@
 #include "buffer_class.h"
 #include "packer_class.h"
 #include "unpacker_class.h"
+#include "sequence_index_class.h"
+#include "typed_array.h"
+#include "raw.h"
+#include "tag_registry.h"
+#include "type_registry.h"
 #include "core_ext.h"
+#include "rmem.h"
 
 
 VALUE rb_cCBOR_Tagged;
@@ -36,6 +42,11 @@ VALUE rb_cCBOR_Simple;
 
 void Init_cbor(void)
 {
+#if defined(HAVE_RB_EXT_RACTOR_SAFE) && (defined(RMEM_RACTOR_LOCAL) || defined(DISABLE_RMEM))
+    /* rmem pools are per-Ractor (see rmem.h) */
+    rb_ext_ractor_safe(true);
+#endif
+
     VALUE mMessagePack = rb_define_module("CBOR");
 
     rb_cCBOR_Tagged = rb_struct_define(NULL, "tag", "value", NULL);
@@ -46,6 +57,11 @@ void Init_cbor(void)
     MessagePack_Buffer_module_init(mMessagePack);
     MessagePack_Packer_module_init(mMessagePack);
     MessagePack_Unpacker_module_init(mMessagePack);
+    MessagePack_SequenceIndex_module_init(mMessagePack);
+    MessagePack_TypedArray_module_init(mMessagePack);
+    MessagePack_Raw_module_init(mMessagePack);
+    MessagePack_TagRegistry_module_init(mMessagePack);
+    MessagePack_TypeRegistry_module_init(mMessagePack);
     MessagePack_core_ext_module_init();
 }
 
@@ -2,9 +2,23 @@
 #define MessagePack_Buffer_module_init CBOR_Buffer_module_init
 #define MessagePack_Buffer_wrap CBOR_Buffer_wrap
 #define MessagePack_Packer_module_init CBOR_Packer_module_init
+#define MessagePack_Raw_bytes CBOR_Raw_bytes
+#define MessagePack_Raw_module_init CBOR_Raw_module_init
+#define MessagePack_SequenceIndex_module_init CBOR_SequenceIndex_module_init
+#define MessagePack_TagRegistry_module_init CBOR_TagRegistry_module_init
+#define MessagePack_TypeRegistry_module_init CBOR_TypeRegistry_module_init
+#define MessagePack_TypedArray_data CBOR_TypedArray_data
+#define MessagePack_TypedArray_decode CBOR_TypedArray_decode
+#define MessagePack_TypedArray_detect CBOR_TypedArray_detect
+#define MessagePack_TypedArray_element_size CBOR_TypedArray_element_size
+#define MessagePack_TypedArray_module_init CBOR_TypedArray_module_init
+#define MessagePack_TypedArray_store CBOR_TypedArray_store
+#define MessagePack_TypedArray_type CBOR_TypedArray_type
 #define MessagePack_Unpacker_module_init CBOR_Unpacker_module_init
 #define MessagePack_core_ext_module_init CBOR_core_ext_module_init
 #define MessagePack_pack CBOR_pack
+#define MessagePack_raise_validate_error CBOR_raise_validate_error
+#define MessagePack_register_tag_decoder CBOR_register_tag_decoder
 #define MessagePack_unpack CBOR_unpack
 #define _msgpack_buffer_append_long_string _CBOR_buffer_append_long_string
 #define _msgpack_buffer_expand _CBOR_buffer_expand
@@ -17,6 +31,9 @@
 #define _msgpack_rmem_chunk_free _CBOR_rmem_chunk_free
 #define cMessagePack_Buffer cCBOR_Buffer
 #define cMessagePack_Packer cCBOR_Packer
+#define cMessagePack_Raw cCBOR_Raw
+#define cMessagePack_SequenceIndex cCBOR_SequenceIndex
+#define cMessagePack_TypedArray cCBOR_TypedArray
 #define cMessagePack_Unpacker cCBOR_Unpacker
 #define msgpack_buffer_all_as_string CBOR_buffer_all_as_string
 #define msgpack_buffer_all_as_string_array CBOR_buffer_all_as_string_array
@@ -36,21 +53,39 @@
 #define msgpack_packer_reset CBOR_packer_reset
 #define msgpack_packer_static_destroy CBOR_packer_static_destroy
 #define msgpack_packer_static_init CBOR_packer_static_init
+#define msgpack_packer_time_timespec CBOR_packer_time_timespec
 #define msgpack_packer_write_array_value CBOR_packer_write_array_value
 #define msgpack_packer_write_hash_value CBOR_packer_write_hash_value
+#define msgpack_packer_write_typed_array_value CBOR_packer_write_typed_array_value
 #define msgpack_packer_write_value CBOR_packer_write_value
+#define msgpack_registry_in_main_ractor CBOR_registry_in_main_ractor
 #define msgpack_rmem_destroy CBOR_rmem_destroy
 #define msgpack_rmem_init CBOR_rmem_init
+#define msgpack_rmem_pools_current CBOR_rmem_pools_current
+#define msgpack_rmem_pools_destroy CBOR_rmem_pools_destroy
+#define msgpack_rmem_pools_init CBOR_rmem_pools_init
+#define msgpack_tag_registry_direct CBOR_tag_registry_direct
+#define msgpack_tag_registry_table CBOR_tag_registry_table
+#define msgpack_type_registry_add_builtin CBOR_type_registry_add_builtin
+#define msgpack_type_registry_check CBOR_type_registry_check
+#define msgpack_type_registry_generation CBOR_type_registry_generation
+#define msgpack_type_registry_lookup CBOR_type_registry_lookup
+#define msgpack_type_registry_table CBOR_type_registry_table
 #define msgpack_unpacker_destroy CBOR_unpacker_destroy
+#define msgpack_unpacker_dig CBOR_unpacker_dig
 #define msgpack_unpacker_init CBOR_unpacker_init
+#define msgpack_unpacker_is_between_items CBOR_unpacker_is_between_items
 #define msgpack_unpacker_mark CBOR_unpacker_mark
+#define msgpack_unpacker_next_event CBOR_unpacker_next_event
 #define msgpack_unpacker_peek_next_object_type CBOR_unpacker_peek_next_object_type
 #define msgpack_unpacker_read CBOR_unpacker_read
 #define msgpack_unpacker_read_array_header CBOR_unpacker_read_array_header
 #define msgpack_unpacker_read_container_header CBOR_unpacker_read_container_header
 #define msgpack_unpacker_read_map_header CBOR_unpacker_read_map_header
 #define msgpack_unpacker_reset CBOR_unpacker_reset
+#define msgpack_unpacker_set_key_cache_size CBOR_unpacker_set_key_cache_size
 #define msgpack_unpacker_skip CBOR_unpacker_skip
 #define msgpack_unpacker_skip_nil CBOR_unpacker_skip_nil
 #define msgpack_unpacker_static_destroy CBOR_unpacker_static_destroy
 #define msgpack_unpacker_static_init CBOR_unpacker_static_init
+#define msgpack_unpacker_validate CBOR_unpacker_validate
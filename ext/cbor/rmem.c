@@ -101,3 +101,77 @@ void _msgpack_rmem_chunk_free(msgpack_rmem_t* pm, msgpack_rmem_chunk_t* c)
     *c = tmp;
 }
 
+
+#ifdef RMEM_RACTOR_LOCAL
+static void msgpack_rmem_pool_release(void* ptr)
+{
+    /* the Ractor terminated; pages may still be referenced by objects
+     * which are not swept yet, so keep the pool for the next Ractor */
+    msgpack_rmem_pool_t* pool = ptr;
+    msgpack_rmem_pools_t* ps = pool->pools;
+
+    rb_nativethread_lock_lock(&ps->lock);
+    pool->next_unused = ps->unused;
+    ps->unused = pool;
+    rb_nativethread_lock_unlock(&ps->lock);
+}
+
+static const struct rb_ractor_local_storage_type s_pool_storage_type = {
+    NULL,
+    msgpack_rmem_pool_release,
+};
+
+void msgpack_rmem_pools_init(msgpack_rmem_pools_t* ps)
+{
+    ps->key = rb_ractor_local_storage_ptr_newkey(&s_pool_storage_type);
+    rb_nativethread_lock_initialize(&ps->lock);
+    ps->unused = NULL;
+}
+
+void msgpack_rmem_pools_destroy(msgpack_rmem_pools_t* ps)
+{
+    /* pools may be in use by other Ractors */
+}
+
+msgpack_rmem_pool_t* msgpack_rmem_pools_current(msgpack_rmem_pools_t* ps)
+{
+    msgpack_rmem_pool_t* pool = rb_ractor_local_storage_ptr(ps->key);
+    if(pool != NULL) {
+        return pool;
+    }
+
+    rb_nativethread_lock_lock(&ps->lock);
+    pool = ps->unused;
+    if(pool != NULL) {
+        ps->unused = pool->next_unused;
+    }
+    rb_nativethread_lock_unlock(&ps->lock);
+
+    if(pool == NULL) {
+        pool = malloc(sizeof(msgpack_rmem_pool_t));
+        msgpack_rmem_init(&pool->rmem);
+        rb_nativethread_lock_initialize(&pool->lock);
+        pool->pools = ps;
+    }
+    pool->next_unused = NULL;
+
+    rb_ractor_local_storage_ptr_set(ps->key, pool);
+    return pool;
+}
+
+#else
+void msgpack_rmem_pools_init(msgpack_rmem_pools_t* ps)
+{
+    msgpack_rmem_init(&ps->pool.rmem);
+}
+
+void msgpack_rmem_pools_destroy(msgpack_rmem_pools_t* ps)
+{
+    msgpack_rmem_destroy(&ps->pool.rmem);
+}
+
+msgpack_rmem_pool_t* msgpack_rmem_pools_current(msgpack_rmem_pools_t* ps)
+{
+    return &ps->pool;
+}
+#endif
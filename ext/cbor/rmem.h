@@ -114,5 +114,77 @@ static inline bool msgpack_rmem_free(msgpack_rmem_t* pm, void* mem)
 }
 
 
+/*
+ * Pools shared by all buffers of one Ractor.
+ *
+ * msgpack_rmem_t is not thread safe.  Every Ractor therefore gets its own
+ * pool, and each pool is guarded by a native lock because an object may
+ * be swept (and its pages freed) by a different Ractor than the one that
+ * allocated it.  Pools of terminated Ractors are recycled, never freed.
+ */
+#if !defined(DISABLE_RMEM_RACTOR_LOCAL) && defined(HAVE_RUBY_RACTOR_H) && \
+        defined(HAVE_RUBY_THREAD_NATIVE_H) && defined(HAVE_RB_RACTOR_LOCAL_STORAGE_PTR_NEWKEY)
+#define RMEM_RACTOR_LOCAL
+#include "ruby/ractor.h"
+#include "ruby/thread_native.h"
+#endif
+
+struct msgpack_rmem_pool_t;
+typedef struct msgpack_rmem_pool_t msgpack_rmem_pool_t;
+
+struct msgpack_rmem_pools_t;
+typedef struct msgpack_rmem_pools_t msgpack_rmem_pools_t;
+
+struct msgpack_rmem_pool_t {
+    msgpack_rmem_t rmem;
+#ifdef RMEM_RACTOR_LOCAL
+    rb_nativethread_lock_t lock;
+    msgpack_rmem_pools_t* pools;
+    msgpack_rmem_pool_t* next_unused;
+#endif
+};
+
+struct msgpack_rmem_pools_t {
+#ifdef RMEM_RACTOR_LOCAL
+    rb_ractor_local_key_t key;
+    rb_nativethread_lock_t lock;
+    msgpack_rmem_pool_t* unused;
+#else
+    msgpack_rmem_pool_t pool;
+#endif
+};
+
+void msgpack_rmem_pools_init(msgpack_rmem_pools_t* ps);
+
+void msgpack_rmem_pools_destroy(msgpack_rmem_pools_t* ps);
+
+/* returns the pool of the current Ractor */
+msgpack_rmem_pool_t* msgpack_rmem_pools_current(msgpack_rmem_pools_t* ps);
+
+static inline void* msgpack_rmem_pool_alloc(msgpack_rmem_pool_t* pool)
+{
+#ifdef RMEM_RACTOR_LOCAL
+    rb_nativethread_lock_lock(&pool->lock);
+    void* mem = msgpack_rmem_alloc(&pool->rmem);
+    rb_nativethread_lock_unlock(&pool->lock);
+    return mem;
+#else
+    return msgpack_rmem_alloc(&pool->rmem);
+#endif
+}
+
+static inline bool msgpack_rmem_pool_free(msgpack_rmem_pool_t* pool, void* mem)
+{
+#ifdef RMEM_RACTOR_LOCAL
+    rb_nativethread_lock_lock(&pool->lock);
+    bool freed = msgpack_rmem_free(&pool->rmem, mem);
+    rb_nativethread_lock_unlock(&pool->lock);
+    return freed;
+#else
+    return msgpack_rmem_free(&pool->rmem, mem);
+#endif
+}
+
+
 #endif
 
@@ -0,0 +1,265 @@
+/*
+ * CBOR for Ruby
+ *
+ * Copyright (C) 2013 Carsten Bormann
+ *
+ *    Licensed under the Apache License, Version 2.0 (the "License").
+ */
+
+#include "sequence_index_class.h"
+#include "unpacker_class.h"
+
+/* bytes read from an IO at a time while building the index */
+#ifndef MSGPACK_SEQUENCE_INDEX_READ_SIZE
+#define MSGPACK_SEQUENCE_INDEX_READ_SIZE (1024*1024)
+#endif
+
+VALUE cMessagePack_SequenceIndex;
+
+static ID s_read;
+static ID s_pread;
+static ID s_seek;
+static ID s_pos;
+
+typedef struct {
+    uint64_t* offsets;
+    uint64_t* lengths;
+    size_t size;
+    size_t capacity;
+    VALUE source;               /* frozen String or IO */
+    uint64_t start;             /* position of the IO when it was indexed */
+    VALUE options;              /* for decoding items */
+} msgpack_sequence_index_t;
+
+#define SEQUENCE_INDEX(from, name) \
+    msgpack_sequence_index_t *name = NULL; \
+    Data_Get_Struct(from, msgpack_sequence_index_t, name); \
+    if(name == NULL) { \
+        rb_raise(rb_eArgError, "NULL found for " # name " when shouldn't be."); \
+    }
+
+static void SequenceIndex_free(msgpack_sequence_index_t* si)
+{
+    if(si == NULL) {
+        return;
+    }
+    xfree(si->offsets);
+    xfree(si->lengths);
+    xfree(si);
+}
+
+static void SequenceIndex_mark(msgpack_sequence_index_t* si)
+{
+    rb_gc_mark(si->source);
+    rb_gc_mark(si->options);
+}
+
+static VALUE SequenceIndex_alloc(VALUE klass)
+{
+    msgpack_sequence_index_t* si = ALLOC_N(msgpack_sequence_index_t, 1);
+    memset(si, 0, sizeof(msgpack_sequence_index_t));
+    si->source = Qnil;
+    si->options = Qnil;
+    return Data_Wrap_Struct(klass, SequenceIndex_mark, SequenceIndex_free, si);
+}
+
+static void sequence_index_push(msgpack_sequence_index_t* si, uint64_t offset, uint64_t length)
+{
+    if(si->size == si->capacity) {
+        si->capacity = si->capacity == 0 ? 64 : si->capacity * 2;
+        REALLOC_N(si->offsets, uint64_t, si->capacity);
+        REALLOC_N(si->lengths, uint64_t, si->capacity);
+    }
+    si->offsets[si->size] = offset;
+    si->lengths[si->size] = length;
+    si->size++;
+}
+
+/*
+ * Indexes the complete items in ptr[0, length), which start at +base+
+ * in the source.  Returns the number of bytes indexed; the rest is an
+ * incomplete item.
+ */
+static size_t sequence_index_scan(msgpack_sequence_index_t* si, const char* ptr, size_t length, uint64_t base)
+{
+    size_t pos = 0;
+    while(pos < length) {
+        size_t end;
+        int r = msgpack_unpacker_validate(ptr + pos, length - pos, 0, &end);
+        if(r == PRIMITIVE_OBJECT_COMPLETE) {
+            end = length - pos;
+        } else if(r == PRIMITIVE_EOF) {
+            break;
+        } else if(r != PRIMITIVE_EXTRA_BYTES) {
+            MessagePack_raise_validate_error(r, (size_t) (base + pos + end));
+        }
+        sequence_index_push(si, base + pos, end);
+        pos += end;
+    }
+    return pos;
+}
+
+static VALUE io_pos(VALUE io)
+{
+    return rb_funcall(io, s_pos, 0);
+}
+
+static VALUE io_pos_unknown(VALUE io, VALUE error)
+{
+    UNUSED(io);
+    UNUSED(error);
+    return INT2FIX(0);
+}
+
+static void sequence_index_build_io(msgpack_sequence_index_t* si, VALUE io)
+{
+    /* offsets are relative to where reading starts; pipes have no
+     * position, and can't be read back from anyway */
+    if(rb_respond_to(io, s_pos)) {
+        si->start = NUM2ULL(rb_rescue2(io_pos, io, io_pos_unknown, io,
+                    rb_eSystemCallError, (VALUE) 0));
+    }
+
+    VALUE pending = rb_str_buf_new(0);
+    uint64_t base = 0;
+
+    while(true) {
+        /* read at least as much as is pending, so that an item larger
+         * than the read size is scanned O(log n) times, not O(n) */
+        long want = RSTRING_LEN(pending);
+        if(want < MSGPACK_SEQUENCE_INDEX_READ_SIZE) {
+            want = MSGPACK_SEQUENCE_INDEX_READ_SIZE;
+        }
+        VALUE chunk = rb_funcall(io, s_read, 1, LONG2NUM(want));
+        if(chunk == Qnil) {
+            break;
+        }
+        StringValue(chunk);
+        rb_str_buf_append(pending, chunk);
+
+        size_t n = sequence_index_scan(si, RSTRING_PTR(pending), RSTRING_LEN(pending), base);
+        base += n;
+        rb_str_update(pending, 0, (long) n, rb_str_new(NULL, 0));
+    }
+
+    if(RSTRING_LEN(pending) > 0) {
+        MessagePack_raise_validate_error(PRIMITIVE_EOF, (size_t) (base + RSTRING_LEN(pending)));
+    }
+}
+
+/*
+ * CBOR::SequenceIndex.build(string_or_io, options = {})
+ */
+static VALUE SequenceIndex_s_build(int argc, VALUE* argv, VALUE klass)
+{
+    VALUE source;
+    VALUE options = Qnil;
+    rb_scan_args(argc, argv, "1:", &source, &options);
+
+    VALUE self = SequenceIndex_alloc(klass);
+    SEQUENCE_INDEX(self, si);
+    si->options = options;
+
+    if(RB_TYPE_P(source, T_STRING)) {
+        si->source = rb_str_new_frozen(source);
+        size_t length = RSTRING_LEN(si->source);
+        size_t n = sequence_index_scan(si, RSTRING_PTR(si->source), length, 0);
+        if(n < length) {
+            MessagePack_raise_validate_error(PRIMITIVE_EOF, length);
+        }
+    } else if(rb_respond_to(source, s_read)) {
+        si->source = source;
+        sequence_index_build_io(si, source);
+    } else {
+        rb_raise(rb_eArgError, "expected String or IO but found %s.", rb_obj_classname(source));
+    }
+
+    return self;
+}
+
+static VALUE SequenceIndex_size(VALUE self)
+{
+    SEQUENCE_INDEX(self, si);
+    return SIZET2NUM(si->size);
+}
+
+static VALUE uint64_array(const uint64_t* values, size_t size)
+{
+    VALUE ary = rb_ary_new2(size);
+    size_t i;
+    for(i = 0; i < size; i++) {
+        rb_ary_push(ary, ULL2NUM(values[i]));
+    }
+    return ary;
+}
+
+static VALUE SequenceIndex_offsets(VALUE self)
+{
+    SEQUENCE_INDEX(self, si);
+    return uint64_array(si->offsets, si->size);
+}
+
+static VALUE SequenceIndex_lengths(VALUE self)
+{
+    SEQUENCE_INDEX(self, si);
+    return uint64_array(si->lengths, si->size);
+}
+
+/* encoded bytes of item i, or nil if out of range */
+static VALUE SequenceIndex_raw(VALUE self, VALUE index)
+{
+    SEQUENCE_INDEX(self, si);
+
+    long i = NUM2LONG(index);
+    if(i < 0) {
+        i += (long) si->size;
+    }
+    if(i < 0 || (size_t) i >= si->size) {
+        return Qnil;
+    }
+    uint64_t offset = si->offsets[i];
+    uint64_t length = si->lengths[i];
+
+    if(RB_TYPE_P(si->source, T_STRING)) {
+        return rb_str_substr(si->source, (long) offset, (long) length);
+    }
+    offset += si->start;
+    if(rb_respond_to(si->source, s_pread)) {
+        return rb_funcall(si->source, s_pread, 2, ULL2NUM(length), ULL2NUM(offset));
+    }
+    rb_funcall(si->source, s_seek, 1, ULL2NUM(offset));
+    return rb_funcall(si->source, s_read, 1, ULL2NUM(length));
+}
+
+static VALUE SequenceIndex_aref(VALUE self, VALUE index)
+{
+    SEQUENCE_INDEX(self, si);
+
+    VALUE raw = SequenceIndex_raw(self, index);
+    if(raw == Qnil) {
+        return Qnil;
+    }
+    VALUE argv[2] = { raw, si->options };
+    return MessagePack_unpack(si->options == Qnil ? 1 : 2, argv);
+}
+
+void MessagePack_SequenceIndex_module_init(VALUE mMessagePack)
+{
+    s_read = rb_intern("read");
+    s_pread = rb_intern("pread");
+    s_seek = rb_intern("seek");
+    s_pos = rb_intern("pos");
+
+    cMessagePack_SequenceIndex = rb_define_class_under(mMessagePack, "SequenceIndex", rb_cObject);
+
+    rb_undef_alloc_func(cMessagePack_SequenceIndex);
+
+    rb_define_singleton_method(cMessagePack_SequenceIndex, "build", SequenceIndex_s_build, -1);
+    rb_define_method(cMessagePack_SequenceIndex, "size", SequenceIndex_size, 0);
+    rb_define_alias(cMessagePack_SequenceIndex, "length", "size");
+    rb_define_method(cMessagePack_SequenceIndex, "offsets", SequenceIndex_offsets, 0);
+    rb_define_method(cMessagePack_SequenceIndex, "lengths", SequenceIndex_lengths, 0);
+    rb_define_method(cMessagePack_SequenceIndex, "raw", SequenceIndex_raw, 1);
+    rb_define_method(cMessagePack_SequenceIndex, "[]", SequenceIndex_aref, 1);
+}
+
@@ -0,0 +1,19 @@
+/*
+ * CBOR for Ruby
+ *
+ * Copyright (C) 2013 Carsten Bormann
+ *
+ *    Licensed under the Apache License, Version 2.0 (the "License").
+ */
+#ifndef MSGPACK_RUBY_SEQUENCE_INDEX_CLASS_H__
+#define MSGPACK_RUBY_SEQUENCE_INDEX_CLASS_H__
+
+#include "compat.h"
+#include "sysdep.h"
+
+extern VALUE cMessagePack_SequenceIndex;
+
+void MessagePack_SequenceIndex_module_init(VALUE mMessagePack);
+
+#endif
+
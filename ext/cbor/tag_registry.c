@@ -0,0 +1,202 @@
+/*
+ * CBOR for Ruby
+ *
+ * Copyright (C) 2013 Carsten Bormann
+ *
+ *    Licensed under the Apache License, Version 2.0 (the "License").
+ */
+
+#include "tag_registry.h"
+#ifdef HAVE_RUBY_RACTOR_H
+#include "ruby/ractor.h"
+#endif
+#ifdef HAVE_RUBY_ATOMIC_H
+#include "ruby/atomic.h"
+#endif
+
+#if defined(HAVE_RUBY_RACTOR_H) && defined(HAVE_RB_RACTOR_LOCAL_STORAGE_PTR_NEWKEY)
+#define TAG_REGISTRY_RACTORS
+/* set in the main Ractor only */
+static rb_ractor_local_key_t s_main_ractor_key;
+#endif
+
+const msgpack_tag_entry_t* msgpack_tag_registry_direct[MSGPACK_TAG_REGISTRY_DIRECT_SIZE];
+const msgpack_tag_table_t* msgpack_tag_registry_table;
+
+/* Ruby decoders registered so far.  They are pinned, since entries
+ * (which may still be in use) refer to them by address. */
+static VALUE s_ruby_decoders;
+
+static ID s_call;
+static ID s_negative_p;
+
+#ifdef HAVE_RUBY_ATOMIC_H
+#define PUBLISH(var, val) RUBY_ATOMIC_PTR_EXCHANGE(var, val)
+#else
+#define PUBLISH(var, val) ((var) = (val))
+#endif
+
+bool msgpack_registry_in_main_ractor(void)
+{
+#ifdef TAG_REGISTRY_RACTORS
+    return rb_ractor_local_storage_ptr(s_main_ractor_key) != NULL;
+#else
+    return true;
+#endif
+}
+
+static VALUE isolation_error(void)
+{
+    return rb_path2class("Ractor::IsolationError");
+}
+
+/*
+ * Replaced entries and tables are not freed (see tag_registry.h).
+ */
+void MessagePack_register_tag_decoder(uint64_t tag, msgpack_tag_decoder_t decoder, void* data)
+{
+    msgpack_tag_entry_t entry = { tag, decoder, data };
+
+    /* registering the same decoder again publishes nothing new */
+    const msgpack_tag_entry_t* current = msgpack_tag_registry_lookup(tag);
+    if(current == NULL ? decoder == NULL :
+            current->decoder == decoder && current->data == data) {
+        return;
+    }
+
+    if(tag < MSGPACK_TAG_REGISTRY_DIRECT_SIZE) {
+        msgpack_tag_entry_t* e = NULL;
+        if(decoder != NULL) {
+            e = ALLOC(msgpack_tag_entry_t);
+            *e = entry;
+        }
+        PUBLISH(msgpack_tag_registry_direct[tag], e);
+        return;
+    }
+
+    const msgpack_tag_table_t* old = msgpack_tag_registry_table;
+    size_t old_length = old == NULL ? 0 : old->length;
+    msgpack_tag_table_t* t = (msgpack_tag_table_t*) xmalloc(sizeof(msgpack_tag_table_t) +
+            old_length * sizeof(msgpack_tag_entry_t));
+    bool pending = decoder != NULL;
+    size_t i;
+    size_t n = 0;
+    for(i = 0; i < old_length; i++) {
+        if(pending && old->entries[i].tag > tag) {
+            t->entries[n++] = entry;
+            pending = false;
+        }
+        if(old->entries[i].tag != tag) {
+            t->entries[n++] = old->entries[i];
+        }
+    }
+    if(pending) {
+        t->entries[n++] = entry;
+    }
+    t->length = n;
+
+    PUBLISH(msgpack_tag_registry_table, n == 0 ? NULL : t);
+    if(n == 0) {
+        xfree(t);
+    }
+}
+
+/* Ruby decoders that are not shareable run in the main Ractor only */
+static inline void check_main_ractor(uint64_t tag)
+{
+    if(!msgpack_registry_in_main_ractor()) {
+        rb_raise(isolation_error(), "decoder for tag %llu is not shareable",
+                (unsigned long long) tag);
+    }
+}
+
+static VALUE call_ruby_decoder(uint64_t tag, VALUE item, void* data)
+{
+    UNUSED(tag);
+    return rb_funcall((VALUE) data, s_call, 1, item);
+}
+
+static VALUE call_unshareable_ruby_decoder(uint64_t tag, VALUE item, void* data)
+{
+    check_main_ractor(tag);
+    return rb_funcall((VALUE) data, s_call, 1, item);
+}
+
+static VALUE new_ruby_instance(uint64_t tag, VALUE item, void* data)
+{
+    UNUSED(tag);
+    return rb_class_new_instance(1, &item, (VALUE) data);
+}
+
+static VALUE new_unshareable_ruby_instance(uint64_t tag, VALUE item, void* data)
+{
+    check_main_ractor(tag);
+    return rb_class_new_instance(1, &item, (VALUE) data);
+}
+
+static inline bool ruby_decoder_shareable(VALUE handler)
+{
+#ifdef TAG_REGISTRY_RACTORS
+    return rb_ractor_shareable_p(handler);
+#else
+    UNUSED(handler);
+    return true;
+#endif
+}
+
+/**
+ * Document-method: CBOR.register_tag
+ *
+ * call-seq:
+ *   CBOR.register_tag(tag, klass_or_proc) -> nil
+ */
+static VALUE TagRegistry_register_tag(VALUE mod, VALUE tag, VALUE handler)
+{
+    UNUSED(mod);
+
+    if(!RB_INTEGER_TYPE_P(tag) || RTEST(rb_funcall(tag, s_negative_p, 0))) {
+        rb_raise(rb_eArgError, "tag must be a non-negative Integer");
+    }
+    uint64_t n = NUM2ULL(tag);
+
+    msgpack_tag_decoder_t decoder;
+    if(NIL_P(handler)) {
+        decoder = NULL;
+    } else if(rb_respond_to(handler, s_call)) {
+        decoder = ruby_decoder_shareable(handler) ?
+            call_ruby_decoder : call_unshareable_ruby_decoder;
+    } else if(RB_TYPE_P(handler, T_CLASS)) {
+        decoder = ruby_decoder_shareable(handler) ?
+            new_ruby_instance : new_unshareable_ruby_instance;
+    } else {
+        rb_raise(rb_eArgError, "tag decoder must be a Class or respond to call");
+    }
+
+    if(!msgpack_registry_in_main_ractor()) {
+        rb_raise(isolation_error(), "can not register tag %llu outside the main Ractor",
+                (unsigned long long) n);
+    }
+
+    if(decoder != NULL && !RTEST(rb_ary_includes(s_ruby_decoders, handler))) {
+        rb_ary_push(s_ruby_decoders, handler);
+        rb_gc_register_mark_object(handler);
+    }
+    MessagePack_register_tag_decoder(n, decoder, (void*) handler);
+    return Qnil;
+}
+
+void MessagePack_TagRegistry_module_init(VALUE mMessagePack)
+{
+    s_call = rb_intern("call");
+    s_negative_p = rb_intern("negative?");
+
+#ifdef TAG_REGISTRY_RACTORS
+    s_main_ractor_key = rb_ractor_local_storage_ptr_newkey(NULL);
+    rb_ractor_local_storage_ptr_set(s_main_ractor_key, (void*) &s_main_ractor_key);
+#endif
+
+    s_ruby_decoders = rb_ary_new();
+    rb_gc_register_address(&s_ruby_decoders);
+
+    rb_define_module_function(mMessagePack, "register_tag", TagRegistry_register_tag, 2);
+}
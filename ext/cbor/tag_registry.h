@@ -0,0 +1,89 @@
+/*
+ * CBOR for Ruby
+ *
+ * Copyright (C) 2013 Carsten Bormann
+ *
+ *    Licensed under the Apache License, Version 2.0 (the "License").
+ */
+#ifndef MSGPACK_RUBY_TAG_REGISTRY_H__
+#define MSGPACK_RUBY_TAG_REGISTRY_H__
+
+#include "compat.h"
+#include "sysdep.h"
+
+/*
+ * Converts the _item_ inside tag _tag_; _data_ is as registered.  Returns
+ * Qundef to leave the tag to the built-in handling (CBOR::Tagged for
+ * unknown tags).
+ */
+typedef VALUE (*msgpack_tag_decoder_t)(uint64_t tag, VALUE item, void* data);
+
+typedef struct {
+    uint64_t tag;
+    msgpack_tag_decoder_t decoder;
+    void* data;
+} msgpack_tag_entry_t;
+
+/* tags below this are looked up by index, others by binary search */
+#ifndef MSGPACK_TAG_REGISTRY_DIRECT_SIZE
+#define MSGPACK_TAG_REGISTRY_DIRECT_SIZE 256
+#endif
+
+typedef struct {
+    size_t length;
+    msgpack_tag_entry_t entries[1];     /* sorted by tag */
+} msgpack_tag_table_t;
+
+/*
+ * Entries and tables are never modified once published, so decoding
+ * in other Ractors can read them without locking.  For the same reason
+ * a replaced entry or table is never freed, as a reader may still hold
+ * it: each registration that changes a tag leaks one entry (tags below
+ * MSGPACK_TAG_REGISTRY_DIRECT_SIZE) or one table of at most as many
+ * entries as there are registered tags.  Registering the same decoder
+ * again leaks nothing.
+ */
+extern const msgpack_tag_entry_t* msgpack_tag_registry_direct[MSGPACK_TAG_REGISTRY_DIRECT_SIZE];
+extern const msgpack_tag_table_t* msgpack_tag_registry_table;
+
+static inline const msgpack_tag_entry_t* msgpack_tag_registry_lookup(uint64_t tag)
+{
+    if(tag < MSGPACK_TAG_REGISTRY_DIRECT_SIZE) {
+        return msgpack_tag_registry_direct[tag];
+    }
+
+    const msgpack_tag_table_t* t = msgpack_tag_registry_table;
+    if(t == NULL) {
+        return NULL;
+    }
+    size_t lo = 0;
+    size_t hi = t->length;
+    while(lo < hi) {
+        size_t mid = lo + (hi - lo) / 2;
+        if(t->entries[mid].tag < tag) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    if(lo < t->length && t->entries[lo].tag == tag) {
+        return &t->entries[lo];
+    }
+    return NULL;
+}
+
+/*
+ * Registers a native converter for tag _tag_, replacing any previous
+ * registration; a NULL _decoder_ removes it.  Other extensions can call
+ * this (as CBOR_register_tag_decoder) from their Init function, after
+ * requiring "cbor".  Must be called from the main Ractor.
+ */
+void MessagePack_register_tag_decoder(uint64_t tag, msgpack_tag_decoder_t decoder, void* data);
+
+/* registries are changed from the main Ractor only */
+bool msgpack_registry_in_main_ractor(void);
+
+void MessagePack_TagRegistry_module_init(VALUE mMessagePack);
+
+#endif
+
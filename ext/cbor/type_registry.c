@@ -0,0 +1,376 @@
+/*
+ * CBOR for Ruby
+ *
+ * Copyright (C) 2013 Carsten Bormann
+ *
+ *    Licensed under the Apache License, Version 2.0 (the "License").
+ */
+
+#include "type_registry.h"
+#include "tag_registry.h"
+#ifdef HAVE_RUBY_RACTOR_H
+#include "ruby/ractor.h"
+#endif
+#ifdef HAVE_RUBY_ATOMIC_H
+#include "ruby/atomic.h"
+#endif
+
+const msgpack_type_table_t* msgpack_type_registry_table;
+size_t msgpack_type_registry_generation;
+
+static ID s_call;
+static ID s_to_a;
+static ID s_to_h;
+static ID s_negative_p;
+static VALUE s_packer;
+static VALUE s_tag;
+
+/* Data (Ruby 3.2 and later), or Qnil */
+static VALUE s_cData;
+static VALUE s_eMalformedFormatError;
+
+/* classes with a built-in encoder, where lookups stop */
+#define BUILTIN_CLASSES_MAX 8
+static VALUE s_builtin_classes[BUILTIN_CLASSES_MAX];
+static int s_builtin_classes_count;
+
+#ifdef HAVE_RUBY_ATOMIC_H
+#define PUBLISH(var, val) RUBY_ATOMIC_PTR_EXCHANGE(var, val)
+#else
+#define PUBLISH(var, val) ((var) = (val))
+#endif
+
+static const msgpack_type_entry_t* find_type(const msgpack_type_table_t* t, VALUE klass)
+{
+    size_t lo = 0;
+    size_t hi = t->length;
+    while(lo < hi) {
+        size_t mid = lo + (hi - lo) / 2;
+        if(t->entries[mid].klass < klass) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    if(lo < t->length && t->entries[lo].klass == klass) {
+        return &t->entries[lo];
+    }
+    return NULL;
+}
+
+static bool is_builtin_class(VALUE klass)
+{
+    int i;
+    for(i = 0; i < s_builtin_classes_count; i++) {
+        if(s_builtin_classes[i] == klass) {
+            return true;
+        }
+    }
+    return false;
+}
+
+const msgpack_type_entry_t* msgpack_type_registry_lookup(VALUE klass)
+{
+    const msgpack_type_table_t* t = msgpack_type_registry_table;
+    if(t == NULL) {
+        return NULL;
+    }
+    for(; klass != Qnil; klass = rb_class_superclass(klass)) {
+        const msgpack_type_entry_t* e = find_type(t, klass);
+        if(e != NULL) {
+            return e;
+        }
+        if(is_builtin_class(klass)) {
+            /* registering a superclass such as Struct or Object does not
+             * replace the encoder of CBOR::Tagged, Regexp, ... */
+            break;
+        }
+    }
+    return NULL;
+}
+
+void msgpack_type_registry_add_builtin(VALUE klass)
+{
+    if(s_builtin_classes_count < BUILTIN_CLASSES_MAX) {
+        s_builtin_classes[s_builtin_classes_count++] = klass;
+    }
+}
+
+void msgpack_type_registry_check(const msgpack_type_entry_t* e)
+{
+#ifdef HAVE_RUBY_RACTOR_H
+    if(e->packer == MSGPACK_TYPE_PACKER_CALL && !rb_ractor_shareable_p(e->handler) &&
+            !msgpack_registry_in_main_ractor()) {
+        rb_raise(rb_path2class("Ractor::IsolationError"),
+                "packer for %"PRIsVALUE" is not shareable", e->klass);
+    }
+#else
+    UNUSED(e);
+#endif
+}
+
+typedef struct {
+    VALUE name;
+    long index;
+} member_name_t;
+
+/* member names in the order of their encoding: shorter first, then
+ * bytewise */
+static int compare_member_names(const void* a, const void* b)
+{
+    VALUE x = ((const member_name_t*) a)->name;
+    VALUE y = ((const member_name_t*) b)->name;
+    long lx = RSTRING_LEN(x);
+    long ly = RSTRING_LEN(y);
+    if(lx != ly) {
+        return lx < ly ? -1 : 1;
+    }
+    return memcmp(RSTRING_PTR(x), RSTRING_PTR(y), lx);
+}
+
+static bool has_members(VALUE klass)
+{
+    return RTEST(rb_class_inherited_p(klass, rb_cStruct)) ||
+        (s_cData != Qnil && RTEST(rb_class_inherited_p(klass, s_cData)));
+}
+
+static void set_members(msgpack_type_entry_t* e)
+{
+    e->members = -1;
+    if(e->klass == rb_cStruct || e->klass == s_cData) {
+        /* members differ between subclasses */
+        return;
+    }
+    VALUE members = rb_struct_s_members(e->klass);
+    long len = RARRAY_LEN(members);
+    VALUE names = rb_ary_new_capa(len);
+    member_name_t* sorted = ALLOCA_N(member_name_t, len);
+    long i;
+    for(i = 0; i < len; i++) {
+        VALUE name = rb_str_new_frozen(rb_id2str(SYM2ID(RARRAY_AREF(members, i))));
+        rb_ary_push(names, name);
+        sorted[i].name = name;
+        sorted[i].index = i;
+    }
+    qsort(sorted, len, sizeof(member_name_t), compare_member_names);
+    long* order = ALLOC_N(long, len);
+    for(i = 0; i < len; i++) {
+        order[i] = sorted[i].index;
+    }
+
+    e->members = len;
+    e->member_names = rb_obj_freeze(names);
+    e->member_order = order;
+    e->frozen = s_cData != Qnil && RTEST(rb_class_inherited_p(e->klass, s_cData));
+}
+
+/* Qundef if missing */
+static inline VALUE lookup_member(VALUE map, VALUE name)
+{
+    VALUE v = rb_hash_lookup2(map, name, Qundef);
+    if(v == Qundef) {
+        v = rb_hash_lookup2(map, rb_str_intern(name), Qundef);
+    }
+    return v;
+}
+
+/*
+ * Rebuilds an object of a registered class from the array or map its
+ * packer wrote, like Marshal does: without calling initialize.  Missing
+ * Struct members are nil, while Data requires all of them, as Data#new
+ * does; other map keys are ignored.
+ */
+static VALUE rebuild_from_members(uint64_t tag, VALUE item, void* data)
+{
+    const msgpack_type_entry_t* e = (const msgpack_type_entry_t*) data;
+    long i;
+    VALUE obj;
+    if(RB_TYPE_P(item, T_ARRAY)) {
+        long len = RARRAY_LEN(item);
+        if(len > e->members || (e->frozen && len < e->members)) {
+            rb_raise(s_eMalformedFormatError, "tag %llu: %ld members, but %"PRIsVALUE" has %ld",
+                    (unsigned long long) tag, len, e->klass, e->members);
+        }
+        obj = rb_obj_alloc(e->klass);
+        for(i = 0; i < len; i++) {
+            RSTRUCT_SET(obj, i, RARRAY_AREF(item, i));
+        }
+    } else if(RB_TYPE_P(item, T_HASH)) {
+        obj = rb_obj_alloc(e->klass);
+        for(i = 0; i < e->members; i++) {
+            VALUE name = RARRAY_AREF(e->member_names, i);
+            VALUE v = lookup_member(item, name);
+            if(v == Qundef) {
+                if(e->frozen) {
+                    rb_raise(s_eMalformedFormatError, "tag %llu: member %"PRIsVALUE" of %"PRIsVALUE" missing",
+                            (unsigned long long) tag, name, e->klass);
+                }
+                v = Qnil;
+            }
+            RSTRUCT_SET(obj, i, v);
+        }
+    } else {
+        return Qundef;
+    }
+    if(e->frozen) {
+        rb_obj_freeze(obj);
+    }
+    return obj;
+}
+
+/* whether the tag of _e_ is still decoded into its class (the decoder
+ * may refer to a copy of _e_ in an older table) */
+static bool rebuilds_from_tag(const msgpack_type_entry_t* e)
+{
+    if(e == NULL || !e->tagged || e->members < 0) {
+        return false;
+    }
+    const msgpack_tag_entry_t* t = msgpack_tag_registry_lookup(e->tag);
+    return t != NULL && t->decoder == rebuild_from_members &&
+        ((const msgpack_type_entry_t*) t->data)->klass == e->klass;
+}
+
+/*
+ * Replaced entries and tables are not freed, as for tags.  Classes and
+ * handlers are pinned, as the tables refer to them by address.
+ */
+static void register_type(msgpack_type_entry_t* entry, bool remove)
+{
+    const msgpack_type_table_t* old = msgpack_type_registry_table;
+    size_t old_length = old == NULL ? 0 : old->length;
+    const msgpack_type_entry_t* old_entry = old == NULL ? NULL : find_type(old, entry->klass);
+    if(rebuilds_from_tag(old_entry)) {
+        MessagePack_register_tag_decoder(old_entry->tag, NULL, NULL);
+    }
+
+    msgpack_type_table_t* t = (msgpack_type_table_t*) xmalloc(sizeof(msgpack_type_table_t) +
+            old_length * sizeof(msgpack_type_entry_t));
+    bool pending = !remove;
+    size_t i;
+    size_t n = 0;
+    for(i = 0; i < old_length; i++) {
+        if(pending && old->entries[i].klass > entry->klass) {
+            t->entries[n++] = *entry;
+            pending = false;
+        }
+        if(old->entries[i].klass != entry->klass) {
+            t->entries[n++] = old->entries[i];
+        }
+    }
+    if(pending) {
+        t->entries[n++] = *entry;
+    }
+    t->length = n;
+
+    PUBLISH(msgpack_type_registry_table, n == 0 ? NULL : t);
+    msgpack_type_registry_generation++;
+    if(n == 0) {
+        xfree(t);
+        return;
+    }
+
+    /* tagged Struct and Data members are decoded back into the class */
+    const msgpack_type_entry_t* e = find_type(t, entry->klass);
+    if(e != NULL && e->tagged && e->members >= 0) {
+        MessagePack_register_tag_decoder(e->tag, rebuild_from_members, (void*) e);
+    }
+}
+
+/**
+ * Document-method: CBOR.register_type
+ *
+ * call-seq:
+ *   CBOR.register_type(klass, packer: nil, tag: nil) -> nil
+ */
+static VALUE TypeRegistry_register_type(int argc, VALUE* argv, VALUE mod)
+{
+    UNUSED(mod);
+
+    VALUE klass;
+    VALUE options = Qnil;
+    rb_scan_args(argc, argv, "11", &klass, &options);
+
+    if(!RB_TYPE_P(klass, T_CLASS)) {
+        rb_raise(rb_eArgError, "type must be a Class");
+    }
+    VALUE handler = Qnil;
+    VALUE tag = Qnil;
+    if(options != Qnil) {
+        Check_Type(options, T_HASH);
+        handler = rb_hash_aref(options, s_packer);
+        tag = rb_hash_aref(options, s_tag);
+    }
+
+    if(!msgpack_registry_in_main_ractor()) {
+        rb_raise(rb_path2class("Ractor::IsolationError"),
+                "can not register %"PRIsVALUE" outside the main Ractor", klass);
+    }
+
+    msgpack_type_entry_t entry;
+    memset(&entry, 0, sizeof(entry));
+    entry.klass = klass;
+    entry.handler = handler;
+    entry.members = -1;
+    entry.member_names = Qnil;
+
+    if(tag != Qnil) {
+        if(!RB_INTEGER_TYPE_P(tag) || RTEST(rb_funcall(tag, s_negative_p, 0))) {
+            rb_raise(rb_eArgError, "tag must be a non-negative Integer");
+        }
+        entry.tagged = true;
+        entry.tag = NUM2ULL(tag);
+    }
+
+    bool is_struct = has_members(klass);
+    if(NIL_P(handler)) {
+        /* removes the registration */
+    } else if(SYMBOL_P(handler)) {
+        entry.method = SYM2ID(handler);
+        if(is_struct && entry.method == s_to_a) {
+            entry.packer = MSGPACK_TYPE_PACKER_MEMBERS_ARRAY;
+            set_members(&entry);
+        } else if(is_struct && entry.method == s_to_h) {
+            entry.packer = MSGPACK_TYPE_PACKER_MEMBERS_MAP;
+            set_members(&entry);
+        } else {
+            entry.packer = MSGPACK_TYPE_PACKER_METHOD;
+        }
+    } else if(rb_respond_to(handler, s_call)) {
+        entry.packer = MSGPACK_TYPE_PACKER_CALL;
+    } else {
+        rb_raise(rb_eArgError, "packer must be a Symbol or respond to call");
+    }
+
+    if(!NIL_P(handler)) {
+        rb_gc_register_mark_object(klass);
+        rb_gc_register_mark_object(handler);
+        if(entry.member_names != Qnil) {
+            rb_gc_register_mark_object(entry.member_names);
+        }
+    }
+    register_type(&entry, NIL_P(handler));
+    return Qnil;
+}
+
+void MessagePack_TypeRegistry_module_init(VALUE mMessagePack)
+{
+    s_call = rb_intern("call");
+    s_to_a = rb_intern("to_a");
+    s_to_h = rb_intern("to_h");
+    s_negative_p = rb_intern("negative?");
+    s_packer = ID2SYM(rb_intern("packer"));
+    s_tag = ID2SYM(rb_intern("tag"));
+
+    s_cData = Qnil;
+    if(rb_const_defined(rb_cObject, rb_intern("Data"))) {
+        VALUE data = rb_const_get(rb_cObject, rb_intern("Data"));
+        if(rb_respond_to(data, rb_intern("define"))) {
+            s_cData = data;
+        }
+    }
+    rb_gc_register_address(&s_cData);
+    s_eMalformedFormatError = rb_const_get(mMessagePack, rb_intern("MalformedFormatError"));
+
+    rb_define_module_function(mMessagePack, "register_type", TypeRegistry_register_type, -1);
+}
+
@@ -0,0 +1,65 @@
+/*
+ * CBOR for Ruby
+ *
+ * Copyright (C) 2013 Carsten Bormann
+ *
+ *    Licensed under the Apache License, Version 2.0 (the "License").
+ */
+#ifndef MSGPACK_RUBY_TYPE_REGISTRY_H__
+#define MSGPACK_RUBY_TYPE_REGISTRY_H__
+
+#include "compat.h"
+#include "sysdep.h"
+
+/* how instances of a registered class are written */
+enum msgpack_type_packer_t {
+    MSGPACK_TYPE_PACKER_CALL,           /* what handler.call(obj) returns */
+    MSGPACK_TYPE_PACKER_METHOD,         /* what obj.method returns */
+    MSGPACK_TYPE_PACKER_MEMBERS_ARRAY,  /* Struct or Data members as an array */
+    MSGPACK_TYPE_PACKER_MEMBERS_MAP,    /* Struct or Data members as a map */
+};
+
+typedef struct {
+    VALUE klass;
+    int packer;                 /* msgpack_type_packer_t */
+    VALUE handler;              /* for MSGPACK_TYPE_PACKER_CALL */
+    ID method;                  /* for MSGPACK_TYPE_PACKER_METHOD */
+    bool tagged;
+    uint64_t tag;
+    /* for the MSGPACK_TYPE_PACKER_MEMBERS_* packers: the member names
+     * of _klass_ as frozen Strings (members is -1 if they differ between
+     * subclasses), and the member indexes in the order of their encoding,
+     * for deterministic encoding */
+    long members;
+    VALUE member_names;
+    const long* member_order;
+    bool frozen;                /* Data objects are frozen when rebuilt */
+} msgpack_type_entry_t;
+
+typedef struct {
+    size_t length;
+    msgpack_type_entry_t entries[1];    /* sorted by klass */
+} msgpack_type_table_t;
+
+/*
+ * Like tag registry tables, type tables are never modified once
+ * published.  The generation changes with every registration, so
+ * packers know when to drop their lookup caches.
+ */
+extern const msgpack_type_table_t* msgpack_type_registry_table;
+extern size_t msgpack_type_registry_generation;
+
+/* the entry for _klass_ or its nearest registered superclass, or NULL;
+ * the search ends at classes with a built-in encoder */
+const msgpack_type_entry_t* msgpack_type_registry_lookup(VALUE klass);
+
+/* makes lookups stop at _klass_, which must stay alive */
+void msgpack_type_registry_add_builtin(VALUE klass);
+
+/* raises unless _e_ may be used in the current Ractor */
+void msgpack_type_registry_check(const msgpack_type_entry_t* e);
+
+void MessagePack_TypeRegistry_module_init(VALUE mMessagePack);
+
+#endif
+
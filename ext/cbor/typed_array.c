@@ -0,0 +1,566 @@
+/*
+ * CBOR for Ruby
+ *
+ * Copyright (C) 2013 Carsten Bormann
+ *
+ *    Licensed under the Apache License, Version 2.0 (the "License").
+ */
+
+#include "typed_array.h"
+#include "buffer.h"
+#include <math.h>               /* for ldexp */
+
+VALUE cMessagePack_TypedArray;
+
+/*
+ * Element types, indexed by tag - TAG_TYPED_ARRAY_FIRST.  The tag encodes
+ * the type in its low 5 bits as 0b f s e ll (RFC 8746 section 2.1):
+ * float, signed, little endian, and log2 of the size (for floats, of the
+ * size in units of 2 bytes).
+ */
+static const char* const s_type_names[] = {
+    "uint8", "uint16_be", "uint32_be", "uint64_be",
+    "uint8_clamped", "uint16_le", "uint32_le", "uint64_le",
+    "int8", "int16_be", "int32_be", "int64_be",
+    NULL, "int16_le", "int32_le", "int64_le",
+    "float16_be", "float32_be", "float64_be", "float128_be",
+    "float16_le", "float32_le", "float64_le", "float128_le",
+};
+
+#define TYPED_ARRAY_TYPES (TAG_TYPED_ARRAY_LAST - TAG_TYPED_ARRAY_FIRST + 1)
+
+static ID s_type_ids[TYPED_ARRAY_TYPES];
+
+#define TYPE_IS_FLOAT(t) (((t) >> 4) & 1)
+#define TYPE_IS_SIGNED(t) (((t) >> 3) & 1)
+#define TYPE_IS_LE(t) (((t) >> 2) & 1)
+#define TYPE_SIZE(t) (TYPE_IS_FLOAT(t) ? 2 << ((t) & 3) : 1 << ((t) & 3))
+#define TYPE_IS_RESERVED(t) (s_type_names[t] == NULL)
+#define TYPE_IS_FLOAT128(t) (TYPE_IS_FLOAT(t) && ((t) & 3) == 3)
+
+static inline uint16_t load16(const unsigned char* p, bool le)
+{
+    return le ? (uint16_t)(p[0] | p[1] << 8) : (uint16_t)(p[0] << 8 | p[1]);
+}
+
+static inline uint32_t load32(const unsigned char* p, bool le)
+{
+    return le ?
+        (uint32_t)p[0] | (uint32_t)p[1] << 8 | (uint32_t)p[2] << 16 | (uint32_t)p[3] << 24 :
+        (uint32_t)p[0] << 24 | (uint32_t)p[1] << 16 | (uint32_t)p[2] << 8 | (uint32_t)p[3];
+}
+
+static inline uint64_t load64(const unsigned char* p, bool le)
+{
+    return le ?
+        (uint64_t)load32(p + 4, true) << 32 | load32(p, true) :
+        (uint64_t)load32(p, false) << 32 | load32(p + 4, false);
+}
+
+static inline VALUE half_value(uint16_t val)
+{
+    int exp = (val >> 10) & 0x1f;
+    int mant = val & 0x3ff; /* 10 bits */
+    double res;
+    if (exp == 0) res = ldexp(mant, -24);
+    else if (exp != 31) res = ldexp(mant + 1024, exp - 25);
+    else if (mant == 0) res = INFINITY;
+    else { /* NAN */
+        union {
+            uint64_t u64;
+            double d;
+        } castbuf = { (uint64_t)(val & 0x8000) << 48 | 0x7ff0000000000000UL | (uint64_t)mant << 42 };
+        return rb_float_new(castbuf.d);
+    }
+    return rb_float_new(val & 0x8000 ? -res : res);
+}
+
+static inline VALUE float_value(uint32_t val)
+{
+    union {
+        uint32_t u32;
+        float f;
+    } castbuf = { val };
+    return rb_float_new(castbuf.f);
+}
+
+static inline VALUE double_value(uint64_t val)
+{
+    union {
+        uint64_t u64;
+        double d;
+    } castbuf = { val };
+    return rb_float_new(castbuf.d);
+}
+
+#define UINT16_VALUE(x) INT2FIX(x)
+#define UINT32_VALUE(x) UINT2NUM(x)
+#define UINT64_VALUE(x) ULL2NUM(x)
+#define INT16_VALUE(x) INT2FIX((int16_t)(x))
+#define INT32_VALUE(x) INT2NUM((int32_t)(x))
+#define INT64_VALUE(x) LL2NUM((int64_t)(x))
+
+#define EACH_ELEMENT(expr) \
+    for(; p < end; p += size) { \
+        rb_ary_push(ary, (expr)); \
+    }
+
+/* hoists the byte order out of the loop */
+#define EACH_ELEMENT_LOAD(bits, conv) \
+    if(le) { \
+        EACH_ELEMENT(conv(load##bits(p, true))); \
+    } else { \
+        EACH_ELEMENT(conv(load##bits(p, false))); \
+    }
+
+/* type must not be reserved or float128 */
+static VALUE typed_array_to_ary(int type, const char* data, size_t length)
+{
+    const unsigned char* p = (const unsigned char*) data;
+    const unsigned char* const end = p + length;
+    const size_t size = TYPE_SIZE(type);
+    const bool le = TYPE_IS_LE(type);
+    VALUE ary = rb_ary_new2(length / size);
+
+    if(TYPE_IS_FLOAT(type)) {
+        switch(size) {
+        case 2:
+            EACH_ELEMENT_LOAD(16, half_value);
+            break;
+        case 4:
+            EACH_ELEMENT_LOAD(32, float_value);
+            break;
+        case 8:
+            EACH_ELEMENT_LOAD(64, double_value);
+            break;
+        }
+    } else if(TYPE_IS_SIGNED(type)) {
+        switch(size) {
+        case 1:
+            EACH_ELEMENT(INT2FIX((int8_t)*p));
+            break;
+        case 2:
+            EACH_ELEMENT_LOAD(16, INT16_VALUE);
+            break;
+        case 4:
+            EACH_ELEMENT_LOAD(32, INT32_VALUE);
+            break;
+        case 8:
+            EACH_ELEMENT_LOAD(64, INT64_VALUE);
+            break;
+        }
+    } else {
+        switch(size) {
+        case 1:
+            EACH_ELEMENT(INT2FIX(*p));
+            break;
+        case 2:
+            EACH_ELEMENT_LOAD(16, UINT16_VALUE);
+            break;
+        case 4:
+            EACH_ELEMENT_LOAD(32, UINT32_VALUE);
+            break;
+        case 8:
+            EACH_ELEMENT_LOAD(64, UINT64_VALUE);
+            break;
+        }
+    }
+
+    return ary;
+}
+
+static inline void store16(unsigned char* p, uint16_t v, bool le)
+{
+    p[le ? 0 : 1] = (unsigned char) v;
+    p[le ? 1 : 0] = (unsigned char) (v >> 8);
+}
+
+static inline void store32(unsigned char* p, uint32_t v, bool le)
+{
+    store16(p + (le ? 0 : 2), (uint16_t) v, le);
+    store16(p + (le ? 2 : 0), (uint16_t) (v >> 16), le);
+}
+
+static inline void store64(unsigned char* p, uint64_t v, bool le)
+{
+    store32(p + (le ? 0 : 4), (uint32_t) v, le);
+    store32(p + (le ? 4 : 0), (uint32_t) (v >> 32), le);
+}
+
+/* rounds to nearest even, by way of float */
+static uint16_t double_to_half(double d)
+{
+    union {
+        float f;
+        uint32_t u32;
+    } castbuf = { (float) d };
+    uint32_t x = castbuf.u32;
+    uint16_t sign = (x >> 16) & 0x8000;
+    int exp = (x >> 23) & 0xff;
+    uint32_t mant = x & 0x7fffff;
+    uint32_t h, rem, halfway;
+
+    if(exp == 255) { /* Inf, NaN */
+        return sign | 0x7c00 | (mant ? 0x200 | mant >> 13 : 0);
+    }
+    exp -= 127 - 15;
+    if(exp >= 31) {
+        return sign | 0x7c00;
+    }
+    if(exp <= 0) { /* denorm */
+        if(exp < -10) {
+            return sign;
+        }
+        mant |= 0x800000;
+        int shift = 14 - exp;
+        h = mant >> shift;
+        rem = mant & ((1U << shift) - 1);
+        halfway = 1U << (shift - 1);
+    } else {
+        h = (uint32_t) exp << 10 | mant >> 13;
+        rem = mant & 0x1fff;
+        halfway = 0x1000;
+    }
+    if(rem > halfway || (rem == halfway && (h & 1))) {
+        h++;  /* may carry into the exponent, up to Inf */
+    }
+    return sign | (uint16_t) h;
+}
+
+static inline float float_of(VALUE e)
+{
+    return (float) (RB_FLOAT_TYPE_P(e) ? RFLOAT_VALUE(e) : NUM2DBL(e));
+}
+
+static inline double double_of(VALUE e)
+{
+    return RB_FLOAT_TYPE_P(e) ? RFLOAT_VALUE(e) : NUM2DBL(e);
+}
+
+static inline uint32_t float_bits(VALUE e)
+{
+    union {
+        float f;
+        uint32_t u32;
+    } castbuf = { float_of(e) };
+    return castbuf.u32;
+}
+
+static inline uint64_t double_bits(VALUE e)
+{
+    union {
+        double d;
+        uint64_t u64;
+    } castbuf = { double_of(e) };
+    return castbuf.u64;
+}
+
+static void out_of_range(VALUE e, int type)
+{
+    rb_raise(rb_eRangeError, "integer %"PRIsVALUE" out of range for %s",
+            rb_inspect(e), s_type_names[type]);
+}
+
+/* Integer elements as int64_t (uint64 elements go through here only if
+ * below 2**63); checks the range of the element type */
+static inline int64_t integer_of(VALUE e, int type, int64_t min, int64_t max)
+{
+    if(RB_LIKELY(FIXNUM_P(e))) {
+        long v = FIX2LONG(e);
+        if(v < min || v > max) {
+            out_of_range(e, type);
+        }
+        return v;
+    }
+    if(!RB_INTEGER_TYPE_P(e)) {
+        rb_raise(rb_eTypeError, "no implicit conversion of %s into Integer for %s element",
+                rb_obj_classname(e), s_type_names[type]);
+    }
+    if(max == INT64_MAX) {
+        return NUM2LL(e);  /* raises RangeError */
+    }
+    out_of_range(e, type);
+    return 0;
+}
+
+static inline uint64_t uint64_of(VALUE e, int type)
+{
+    if(RB_LIKELY(FIXNUM_P(e)) && FIX2LONG(e) >= 0) {
+        return FIX2LONG(e);
+    }
+    if(!RB_INTEGER_TYPE_P(e)) {
+        integer_of(e, type, 0, 0);  /* raises TypeError */
+    }
+    if(!RBIGNUM_POSITIVE_P(e)) {
+        out_of_range(e, type);
+    }
+    return NUM2ULL(e);  /* raises RangeError */
+}
+
+static inline unsigned char clamped_of(VALUE e, int type)
+{
+    if(RB_LIKELY(FIXNUM_P(e))) {
+        long v = FIX2LONG(e);
+        return v < 0 ? 0 : v > 255 ? 255 : (unsigned char) v;
+    }
+    if(!RB_INTEGER_TYPE_P(e)) {
+        integer_of(e, type, 0, 0);  /* raises TypeError */
+    }
+    return !RBIGNUM_POSITIVE_P(e) ? 0 : 255;
+}
+
+#define STORE_EACH_ELEMENT(store_expr) \
+    for(i = 0; i < n; i++, p += size) { \
+        VALUE e = rb_ary_entry(ary, i); /* ary may change in NUM2DBL */ \
+        store_expr; \
+    }
+
+#define STORE_EACH_ELEMENT_ENDIAN(bits, conv) \
+    if(le) { \
+        STORE_EACH_ELEMENT(store##bits(p, conv, true)); \
+    } else { \
+        STORE_EACH_ELEMENT(store##bits(p, conv, false)); \
+    }
+
+size_t MessagePack_TypedArray_element_size(int type)
+{
+    return TYPE_SIZE(type);
+}
+
+void MessagePack_TypedArray_store(int type, VALUE ary, char* out)
+{
+    unsigned char* p = (unsigned char*) out;
+    const long n = RARRAY_LEN(ary);
+    const size_t size = TYPE_SIZE(type);
+    const bool le = TYPE_IS_LE(type);
+    long i;
+
+    if(TYPE_IS_FLOAT(type)) {
+        switch(size) {
+        case 2:
+            STORE_EACH_ELEMENT_ENDIAN(16, double_to_half(double_of(e)));
+            break;
+        case 4:
+            STORE_EACH_ELEMENT_ENDIAN(32, float_bits(e));
+            break;
+        case 8:
+            STORE_EACH_ELEMENT_ENDIAN(64, double_bits(e));
+            break;
+        default:
+            rb_raise(rb_eArgError, "float128 elements are not supported");
+        }
+    } else if(TYPE_IS_SIGNED(type)) {
+        switch(size) {
+        case 1:
+            STORE_EACH_ELEMENT(*p = (unsigned char) integer_of(e, type, INT8_MIN, INT8_MAX));
+            break;
+        case 2:
+            STORE_EACH_ELEMENT_ENDIAN(16, (uint16_t) integer_of(e, type, INT16_MIN, INT16_MAX));
+            break;
+        case 4:
+            STORE_EACH_ELEMENT_ENDIAN(32, (uint32_t) integer_of(e, type, INT32_MIN, INT32_MAX));
+            break;
+        case 8:
+            STORE_EACH_ELEMENT_ENDIAN(64, (uint64_t) integer_of(e, type, INT64_MIN, INT64_MAX));
+            break;
+        }
+    } else {
+        switch(size) {
+        case 1:
+            if(le) {  /* uint8_clamped */
+                STORE_EACH_ELEMENT(*p = clamped_of(e, type));
+            } else {
+                STORE_EACH_ELEMENT(*p = (unsigned char) integer_of(e, type, 0, UINT8_MAX));
+            }
+            break;
+        case 2:
+            STORE_EACH_ELEMENT_ENDIAN(16, (uint16_t) integer_of(e, type, 0, UINT16_MAX));
+            break;
+        case 4:
+            STORE_EACH_ELEMENT_ENDIAN(32, (uint32_t) integer_of(e, type, 0, UINT32_MAX));
+            break;
+        case 8:
+            STORE_EACH_ELEMENT_ENDIAN(64, uint64_of(e, type));
+            break;
+        }
+    }
+}
+
+int MessagePack_TypedArray_detect(VALUE ary)
+{
+    const long n = RARRAY_LEN(ary);
+    long i;
+
+    if(n == 0) {
+        return -1;
+    }
+
+    VALUE first = RARRAY_AREF(ary, 0);
+    if(FIXNUM_P(first)) {
+        long min = FIX2LONG(first);
+        long max = min;
+        for(i = 1; i < n; i++) {
+            VALUE e = RARRAY_AREF(ary, i);
+            if(!FIXNUM_P(e)) {
+                return -1;
+            }
+            long v = FIX2LONG(e);
+            if(v < min) {
+                min = v;
+            } else if(v > max) {
+                max = v;
+            }
+        }
+        /* little endian, as most hosts */
+        if(min >= 0) {
+            return max <= UINT8_MAX ? 0 : max <= UINT16_MAX ? 5 : max <= UINT32_MAX ? 6 : 7;
+        }
+        if(min >= INT8_MIN && max <= INT8_MAX) {
+            return 8;
+        }
+        if(min >= INT16_MIN && max <= INT16_MAX) {
+            return 13;
+        }
+        if(min >= INT32_MIN && max <= INT32_MAX) {
+            return 14;
+        }
+        return 15;
+    }
+
+    if(RB_FLOAT_TYPE_P(first)) {
+        bool fits_float = true;
+        for(i = 0; i < n; i++) {
+            VALUE e = RARRAY_AREF(ary, i);
+            if(!RB_FLOAT_TYPE_P(e)) {
+                return -1;
+            }
+            double d = RFLOAT_VALUE(e);
+            if(fits_float && (double)(float)d != d && d == d) {
+                fits_float = false;
+            }
+        }
+        return fits_float ? 21 : 22;  /* float32_le, float64_le */
+    }
+
+    return -1;
+}
+
+static inline bool is_byte_string(VALUE data)
+{
+    if(rb_type(data) != T_STRING) {
+        return false;
+    }
+#ifdef COMPAT_HAVE_ENCODING
+    if(ENCODING_GET(data) != s_enc_ascii8bit) {
+        return false;
+    }
+#endif
+    return true;
+}
+
+VALUE MessagePack_TypedArray_decode(uint64_t tag, VALUE data, int mode)
+{
+    int type = (int)(tag - TAG_TYPED_ARRAY_FIRST);
+
+    if(TYPE_IS_RESERVED(type) || !is_byte_string(data) ||
+            RSTRING_LEN(data) % TYPE_SIZE(type) != 0) {
+        return Qundef;
+    }
+
+    switch(mode) {
+    case MSGPACK_TYPED_ARRAYS_PACKED:
+        return rb_struct_new(cMessagePack_TypedArray, ID2SYM(s_type_ids[type]), data);
+    case MSGPACK_TYPED_ARRAYS_ARRAY:
+        if(TYPE_IS_FLOAT128(type)) {
+            return Qundef;
+        }
+        return typed_array_to_ary(type, RSTRING_PTR(data), RSTRING_LEN(data));
+    default:
+        return Qundef;
+    }
+}
+
+int MessagePack_TypedArray_type(VALUE self)
+{
+    VALUE type = rb_struct_aref(self, INT2FIX(0));
+    if(SYMBOL_P(type)) {
+        ID id = SYM2ID(type);
+        int i;
+        for(i = 0; i < TYPED_ARRAY_TYPES; i++) {
+            if(s_type_ids[i] == id && !TYPE_IS_RESERVED(i)) {
+                return i;
+            }
+        }
+    }
+    rb_raise(rb_eArgError, "unknown typed array type %"PRIsVALUE, rb_inspect(type));
+}
+
+VALUE MessagePack_TypedArray_data(VALUE self, int type)
+{
+    VALUE data = rb_struct_aref(self, INT2FIX(1));
+    StringValue(data);
+    if(RSTRING_LEN(data) % TYPE_SIZE(type) != 0) {
+        rb_raise(rb_eArgError, "data size %ld is not a multiple of the %d byte element size",
+                RSTRING_LEN(data), TYPE_SIZE(type));
+    }
+    return data;
+}
+
+static VALUE TypedArray_tag(VALUE self)
+{
+    return INT2FIX(TAG_TYPED_ARRAY_FIRST + MessagePack_TypedArray_type(self));
+}
+
+static VALUE TypedArray_size(VALUE self)
+{
+    int type = MessagePack_TypedArray_type(self);
+    VALUE data = MessagePack_TypedArray_data(self, type);
+    return LONG2NUM(RSTRING_LEN(data) / TYPE_SIZE(type));
+}
+
+static VALUE TypedArray_to_a(VALUE self)
+{
+    int type = MessagePack_TypedArray_type(self);
+    VALUE data = MessagePack_TypedArray_data(self, type);
+    if(TYPE_IS_FLOAT128(type)) {
+        rb_raise(rb_eArgError, "float128 elements are not supported");
+    }
+    VALUE ary = typed_array_to_ary(type, RSTRING_PTR(data), RSTRING_LEN(data));
+    RB_GC_GUARD(data);
+    return ary;
+}
+
+static VALUE TypedArray_initialize(int argc, VALUE* argv, VALUE self)
+{
+    if(argc == 2 && rb_type(argv[1]) == T_ARRAY) {
+        VALUE args[2];
+        args[0] = argv[0];
+        rb_struct_aset(self, INT2FIX(0), argv[0]);
+        int type = MessagePack_TypedArray_type(self);
+        VALUE ary = argv[1];
+        args[1] = rb_str_new(NULL, RARRAY_LEN(ary) * TYPE_SIZE(type));
+        MessagePack_TypedArray_store(type, ary, RSTRING_PTR(args[1]));
+        return rb_call_super(2, args);
+    }
+    return rb_call_super(argc, argv);
+}
+
+void MessagePack_TypedArray_module_init(VALUE mMessagePack)
+{
+    int i;
+    for(i = 0; i < TYPED_ARRAY_TYPES; i++) {
+        if(!TYPE_IS_RESERVED(i)) {
+            s_type_ids[i] = rb_intern(s_type_names[i]);
+        }
+    }
+
+    cMessagePack_TypedArray = rb_struct_define(NULL, "type", "data", NULL);
+    rb_define_const(mMessagePack, "TypedArray", cMessagePack_TypedArray);
+
+    rb_define_method(cMessagePack_TypedArray, "initialize", TypedArray_initialize, -1);
+    rb_define_method(cMessagePack_TypedArray, "tag", TypedArray_tag, 0);
+    rb_define_method(cMessagePack_TypedArray, "size", TypedArray_size, 0);
+    rb_define_method(cMessagePack_TypedArray, "length", TypedArray_size, 0);
+    rb_define_method(cMessagePack_TypedArray, "to_a", TypedArray_to_a, 0);
+}
+
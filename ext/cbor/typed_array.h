@@ -0,0 +1,60 @@
+/*
+ * CBOR for Ruby
+ *
+ * Copyright (C) 2013 Carsten Bormann
+ *
+ *    Licensed under the Apache License, Version 2.0 (the "License").
+ */
+#ifndef MSGPACK_RUBY_TYPED_ARRAY_H__
+#define MSGPACK_RUBY_TYPED_ARRAY_H__
+
+#include "compat.h"
+#include "sysdep.h"
+
+/* RFC 8746 typed arrays */
+#define TAG_TYPED_ARRAY_FIRST 64
+#define TAG_TYPED_ARRAY_LAST 87
+#define TAG_IS_TYPED_ARRAY(tag) \
+    ((tag) >= TAG_TYPED_ARRAY_FIRST && (tag) <= TAG_TYPED_ARRAY_LAST)
+
+/* what the unpacker makes of a typed array */
+#define MSGPACK_TYPED_ARRAYS_TAGGED 0   /* CBOR::Tagged, as any other tag */
+#define MSGPACK_TYPED_ARRAYS_PACKED 1   /* CBOR::TypedArray */
+#define MSGPACK_TYPED_ARRAYS_ARRAY 2    /* Array of Integer or Float */
+
+extern VALUE cMessagePack_TypedArray;
+
+/*
+ * Converts the byte string _data_ of a typed array with tag _tag_ as
+ * asked for by _mode_.  Returns Qundef if it cannot be converted (not a
+ * byte string, length not a multiple of the element size, or an element
+ * type that is not supported by _mode_).
+ */
+VALUE MessagePack_TypedArray_decode(uint64_t tag, VALUE data, int mode);
+
+/* element type of a TypedArray, as tag - TAG_TYPED_ARRAY_FIRST; raises
+ * ArgumentError for unknown types */
+int MessagePack_TypedArray_type(VALUE self);
+
+/* data of a TypedArray; raises unless its size fits the element type */
+VALUE MessagePack_TypedArray_data(VALUE self, int type);
+
+size_t MessagePack_TypedArray_element_size(int type);
+
+/*
+ * Returns the smallest little-endian element type that holds all elements
+ * of _ary_ (all Fixnums, or all Floats), or -1 if there is none.
+ */
+int MessagePack_TypedArray_detect(VALUE ary);
+
+/*
+ * Writes the elements of _ary_ to _out_, which has room for
+ * RARRAY_LEN(ary) elements.  Raises TypeError or RangeError for elements
+ * that do not fit the element type.
+ */
+void MessagePack_TypedArray_store(int type, VALUE ary, char* out);
+
+void MessagePack_TypedArray_module_init(VALUE mMessagePack);
+
+#endif
+
@@ -27,6 +27,9 @@
 
 #include "unpacker.h"
 #include "rmem.h"
+#include "typed_array.h"
+#include "tag_registry.h"
+#include "packer_class.h"
 #include <math.h>               /* for ldexp */
 
 /* work around https://bugs.ruby-lang.org/issues/15779 for now
@@ -42,24 +45,36 @@
 #endif
 
 #ifdef UNPACKER_STACK_RMEM
-static msgpack_rmem_t s_stack_rmem;
+static msgpack_rmem_pools_t s_stack_rmem;
 #endif
 
+static void ib_table_init(void);
+
+/* for keys that have to be encoded again to check their order */
+static VALUE s_deterministic_options;
+
 void msgpack_unpacker_static_init()
 {
 #ifdef UNPACKER_STACK_RMEM
-    msgpack_rmem_init(&s_stack_rmem);
+    msgpack_rmem_pools_init(&s_stack_rmem);
 #endif
 
 #ifdef COMPAT_HAVE_ENCODING
     s_enc_utf8 = rb_utf8_encindex();
 #endif
+
+    ib_table_init();
+
+    s_deterministic_options = rb_hash_new();
+    rb_hash_aset(s_deterministic_options, ID2SYM(rb_intern("deterministic")), Qtrue);
+    rb_obj_freeze(s_deterministic_options);
+    rb_gc_register_address(&s_deterministic_options);
 }
 
 void msgpack_unpacker_static_destroy()
 {
 #ifdef UNPACKER_STACK_RMEM
-    msgpack_rmem_destroy(&s_stack_rmem);
+    msgpack_rmem_pools_destroy(&s_stack_rmem);
 #endif
 }
 
@@ -77,7 +92,8 @@ void msgpack_unpacker_init(msgpack_unpacker_t* uk)
     uk->reading_raw = Qnil;
 
 #ifdef UNPACKER_STACK_RMEM
-    uk->stack = msgpack_rmem_alloc(&s_stack_rmem);
+    uk->stack_pool = msgpack_rmem_pools_current(&s_stack_rmem);
+    uk->stack = msgpack_rmem_pool_alloc(uk->stack_pool);
     /*memset(uk->stack, 0, MSGPACK_UNPACKER_STACK_CAPACITY);*/
 #else
     /*uk->stack = calloc(MSGPACK_UNPACKER_STACK_CAPACITY, sizeof(msgpack_unpacker_stack_t));*/
@@ -89,11 +105,16 @@ void msgpack_unpacker_init(msgpack_unpacker_t* uk)
 void msgpack_unpacker_destroy(msgpack_unpacker_t* uk)
 {
 #ifdef UNPACKER_STACK_RMEM
-    msgpack_rmem_free(&s_stack_rmem, uk->stack);
+    msgpack_rmem_pool_free(uk->stack_pool, uk->stack);
 #else
     free(uk->stack);
 #endif
 
+    xfree(uk->values);
+    xfree(uk->key_cache.entries);
+    xfree(uk->key_ranges);
+    xfree(uk->key_bytes);
+
     msgpack_buffer_destroy(UNPACKER_BUFFER_(uk));
 }
 
@@ -106,7 +127,15 @@ void msgpack_unpacker_mark(msgpack_unpacker_t* uk)
     msgpack_unpacker_stack_t* send = uk->stack + uk->stack_depth;
     for(; s < send; s++) {
         rb_gc_mark(s->object);
-        rb_gc_mark(s->key);
+    }
+
+    if(uk->values_length > 0) {
+        rb_gc_mark_locations(uk->values, uk->values + uk->values_length);
+    }
+
+    if(uk->key_cache.entries != NULL) {
+        rb_gc_mark_locations(uk->key_cache.entries,
+                uk->key_cache.entries + uk->key_cache.mask + 1);
     }
 
     /* See MessagePack_Buffer_wrap */
@@ -122,12 +151,59 @@ void msgpack_unpacker_reset(msgpack_unpacker_t* uk)
 
     /*memset(uk->stack, 0, sizeof(msgpack_unpacker_t) * uk->stack_depth);*/
     uk->stack_depth = 0;
+    uk->values_length = 0;
+    uk->key_bytes_length = 0;
+    /* give back what a large document made the staging area grow to */
+    if(uk->values_capacity > MSGPACK_UNPACKER_VALUES_INITIAL_CAPACITY) {
+        REALLOC_N(uk->values, VALUE, MSGPACK_UNPACKER_VALUES_INITIAL_CAPACITY);
+        uk->values_capacity = MSGPACK_UNPACKER_VALUES_INITIAL_CAPACITY;
+    }
 
     uk->last_object = Qnil;
     uk->reading_raw = Qnil;
     uk->reading_raw_remaining = 0;
 }
 
+bool msgpack_unpacker_is_between_items(msgpack_unpacker_t* uk)
+{
+    return uk->head_byte == HEAD_BYTE_REQUIRED && uk->stack_depth == 0;
+}
+
+void msgpack_unpacker_set_key_cache_size(msgpack_unpacker_t* uk, size_t size)
+{
+    size_t n = 1;
+
+    xfree(uk->key_cache.entries);
+    uk->key_cache.entries = NULL;
+    uk->key_cache.mask = 0;
+
+    if(size == 0) {
+        return;
+    }
+    if(size > MSGPACK_UNPACKER_KEY_CACHE_MAX_SIZE) {
+        size = MSGPACK_UNPACKER_KEY_CACHE_MAX_SIZE;
+    }
+    while(n < size) {
+        n <<= 1;
+    }
+
+    VALUE* entries = ALLOC_N(VALUE, n);
+    size_t i;
+    for(i = 0; i < n; i++) {
+        entries[i] = Qnil;
+    }
+    uk->key_cache.entries = entries;
+    uk->key_cache.mask = n - 1;
+}
+
+void msgpack_unpacker_set_deterministic(msgpack_unpacker_t* uk, bool deterministic)
+{
+    if(deterministic && uk->key_ranges == NULL) {
+        uk->key_ranges = ALLOC_N(msgpack_unpacker_key_range_t, uk->stack_capacity);
+    }
+    uk->deterministic = deterministic;
+}
+
 
 /* head byte functions */
 static int read_head_byte(msgpack_unpacker_t* uk)
@@ -168,11 +244,36 @@ static inline VALUE object_string_encoding_set(VALUE str, int textflag) {
   return str;
 }
 
+static inline VALUE new_frozen_string(const char* p, size_t length, int textflag)
+{
+#ifdef HAVE_RB_ENC_INTERNED_STR
+    /* deduplicated; rb_hash_aset will not copy it again */
+    return rb_enc_interned_str(p, length, textflag ? rb_utf8_encoding() : rb_ascii8bit_encoding());
+#else
+    VALUE str = rb_str_new(p, length);
+    object_string_encoding_set(str, textflag);
+    return rb_obj_freeze(str);
+#endif
+}
+
 static inline int object_complete_string(msgpack_unpacker_t* uk, VALUE str, int textflag)
 {
+  if(uk->freeze) {
+    return object_complete(uk, new_frozen_string(RSTRING_PTR(str), RSTRING_LEN(str), textflag));
+  }
   return object_complete(uk, object_string_encoding_set(str, textflag));
 }
 
+/* with the freeze option, containers, tagged objects and simple values
+ * are frozen once complete; their contents already are */
+static inline VALUE object_frozen_if_asked(msgpack_unpacker_t* uk, VALUE object)
+{
+    if(uk->freeze) {
+        rb_obj_freeze(object);
+    }
+    return object;
+}
+
 /* stack funcs */
 static inline msgpack_unpacker_stack_t* _msgpack_unpacker_stack_top(msgpack_unpacker_t* uk)
 {
@@ -191,8 +292,11 @@ static inline int _msgpack_unpacker_stack_push_tag(msgpack_unpacker_t* uk, enum
     next->count = count;
     next->type = type;
     next->object = object;
-    next->key = Qnil;
+    next->values_base = uk->values_length;
     next->tag = tag;
+    if(uk->deterministic) {
+        uk->key_ranges[uk->stack_depth].prev_key = uk->key_bytes_length;
+    }
 
     uk->stack_depth++;
     return PRIMITIVE_CONTAINER_START;
@@ -203,6 +307,64 @@ static inline int _msgpack_unpacker_stack_push(msgpack_unpacker_t* uk, enum stac
   return _msgpack_unpacker_stack_push_tag(uk, type, count, object, 0);
 }
 
+/* staging area for the items of arrays and maps */
+static inline void _msgpack_unpacker_values_push(msgpack_unpacker_t* uk, VALUE v)
+{
+    if(uk->values_length == uk->values_capacity) {
+        size_t capacity = uk->values_capacity == 0 ?
+            MSGPACK_UNPACKER_VALUES_INITIAL_CAPACITY : uk->values_capacity * 2;
+        REALLOC_N(uk->values, VALUE, capacity);
+        uk->values_capacity = capacity;
+    }
+    uk->values[uk->values_length++] = v;
+}
+
+/* String keys must be frozen, as rb_hash_bulk_insert does not copy them
+ * like rb_hash_aset does.  Keys read as such usually already are; others
+ * (e.g. from tag decoders) may be shared, so they are copied rather than
+ * frozen in place. */
+static inline void _msgpack_unpacker_values_push_key(msgpack_unpacker_t* uk, VALUE key)
+{
+    if(RB_TYPE_P(key, T_STRING) && !OBJ_FROZEN(key)) {
+        key = rb_str_new_frozen(key);
+    }
+    _msgpack_unpacker_values_push(uk, key);
+}
+
+/* Creates an Array of the items staged since _base_ and removes them from
+ * the staging area. */
+static inline VALUE _msgpack_unpacker_values_to_array(msgpack_unpacker_t* uk, size_t base)
+{
+    VALUE ary = rb_ary_new_from_values((long)(uk->values_length - base), uk->values + base);
+    uk->values_length = base;
+    return ary;
+}
+
+/* Creates a Hash of the keys and values staged since _base_ and removes
+ * them from the staging area. */
+static VALUE _msgpack_unpacker_values_to_hash(msgpack_unpacker_t* uk, size_t base)
+{
+    const VALUE* pairs = uk->values + base;
+    long n = (long)(uk->values_length - base);
+
+#ifdef HAVE_RB_HASH_NEW_CAPA
+    VALUE hash = rb_hash_new_capa(n / 2);
+#else
+    VALUE hash = rb_hash_new();
+#endif
+#ifdef HAVE_RB_HASH_BULK_INSERT
+    rb_hash_bulk_insert(n, pairs, hash);
+#else
+    long i;
+    for(i = 0; i < n; i += 2) {
+        rb_hash_aset(hash, pairs[i], pairs[i+1]);
+    }
+#endif
+
+    uk->values_length = base;
+    return hash;
+}
+
 static inline VALUE msgpack_unpacker_stack_pop(msgpack_unpacker_t* uk)
 {
     return --uk->stack_depth;
@@ -270,6 +432,78 @@ static int read_raw_body_cont(msgpack_unpacker_t* uk, int textflag)
     return PRIMITIVE_OBJECT_COMPLETE;
 }
 
+static inline bool key_textflag_matches(VALUE str, int textflag)
+{
+#ifdef COMPAT_HAVE_ENCODING
+    return (ENCODING_GET(str) == s_enc_utf8) == (textflag != 0);
+#else
+    return true;
+#endif
+}
+
+/* FNV-1a; keys are short */
+static inline uint32_t key_cache_hash(const unsigned char* p, size_t length, int textflag)
+{
+    uint32_t h = 2166136261U ^ (uint32_t) textflag;
+    const unsigned char* const pend = p + length;
+    for(; p < pend; p++) {
+        h = (h ^ *p) * 16777619U;
+    }
+    return h;
+}
+
+/* Returns a frozen String for the key at the read position and consumes it.
+ * The caller ensures that +length+ bytes are readable from the top chunk. */
+static VALUE key_cache_fetch(msgpack_unpacker_t* uk, size_t length, int textflag)
+{
+    msgpack_buffer_t* b = UNPACKER_BUFFER_(uk);
+    msgpack_unpacker_key_cache_t* kc = &uk->key_cache;
+    const char* p = b->read_buffer;
+
+    VALUE* slot = &kc->entries[key_cache_hash((const unsigned char*) p, length, textflag) & kc->mask];
+    VALUE str = *slot;
+    if(RB_TYPE_P(str, T_STRING) && (size_t) RSTRING_LEN(str) == length &&
+            memcmp(RSTRING_PTR(str), p, length) == 0 &&
+            key_textflag_matches(str, textflag)) {
+        kc->hits++;
+    } else {
+        kc->misses++;
+        *slot = str = new_frozen_string(p, length, textflag);
+    }
+
+    _msgpack_buffer_consumed(b, length);
+    return str;
+}
+
+#ifdef HAVE_RB_SYM2STR
+#define KEY_CACHE_SYMBOLS
+/* same as key_cache_fetch but for symbolize_keys; text keys only */
+static VALUE key_cache_fetch_symbol(msgpack_unpacker_t* uk, size_t length)
+{
+    msgpack_buffer_t* b = UNPACKER_BUFFER_(uk);
+    msgpack_unpacker_key_cache_t* kc = &uk->key_cache;
+    const char* p = b->read_buffer;
+
+    /* seeded apart from the String entries */
+    VALUE* slot = &kc->entries[key_cache_hash((const unsigned char*) p, length, 2) & kc->mask];
+    VALUE sym = *slot;
+    if(SYMBOL_P(sym)) {
+        VALUE name = rb_sym2str(sym);
+        if((size_t) RSTRING_LEN(name) == length &&
+                memcmp(RSTRING_PTR(name), p, length) == 0) {
+            kc->hits++;
+            _msgpack_buffer_consumed(b, length);
+            return sym;
+        }
+    }
+
+    kc->misses++;
+    *slot = sym = _msgpack_buffer_top_as_symbol(b, length);
+    _msgpack_buffer_consumed(b, length);
+    return sym;
+}
+#endif
+
 static inline int read_raw_body_begin(msgpack_unpacker_t* uk, int textflag)
 {
     /* assuming uk->reading_raw == Qnil */
@@ -283,6 +517,26 @@ static inline int read_raw_body_begin(msgpack_unpacker_t* uk, int textflag)
         bool will_freeze = is_reading_map_key(uk);
         VALUE string;
         bool as_symbol = will_freeze && textflag && uk->keys_as_symbols;
+        if(will_freeze && uk->key_cache.entries != NULL &&
+                length <= MSGPACK_UNPACKER_KEY_CACHE_MAX_LENGTH) {
+            if(!as_symbol) {
+                object_complete(uk, key_cache_fetch(uk, length, textflag));
+                uk->reading_raw_remaining = 0;
+                return PRIMITIVE_OBJECT_COMPLETE;
+            }
+#ifdef KEY_CACHE_SYMBOLS
+            object_complete(uk, key_cache_fetch_symbol(uk, length));
+            uk->reading_raw_remaining = 0;
+            return PRIMITIVE_OBJECT_COMPLETE;
+#endif
+        }
+        if(uk->freeze && !as_symbol) {
+            msgpack_buffer_t* b = UNPACKER_BUFFER_(uk);
+            object_complete(uk, new_frozen_string(b->read_buffer, length, textflag));
+            _msgpack_buffer_consumed(b, length);
+            uk->reading_raw_remaining = 0;
+            return PRIMITIVE_OBJECT_COMPLETE;
+        }
         string = msgpack_buffer_read_top_as_string(UNPACKER_BUFFER_(uk), length, will_freeze, as_symbol);
         if (as_symbol)
           object_complete(uk, string);
@@ -338,393 +592,1793 @@ static inline double ldexp11(int mant, int exp) {
   }
 
 
-/* All the cases with an immediate value in the AI */
-#define CASE_IMM(n) case ((n*8)): case ((n*8) + 1): case ((n*8) + 2): case ((n*8) + 3): case ((n*8) + 4): case ((n*8) + 5)
-/* The case with additional information */
-#define CASE_AI(n) case ((n*8) + 6)
-/* The case with the reserved and indefinite ai values */
-#define CASE_INDEF(n) case ((n*8) + 7)
+/*
+ * Initial byte dispatch
+ *
+ * Every one of the 256 possible initial bytes gets a precomputed entry
+ * holding its kind (major type, refined for simple values, floats and
+ * indefinite lengths), the number of argument bytes that follow it, and
+ * the handler that turns the head into an object or a stack push.  Each
+ * item then costs a table lookup and one indirect call instead of a chain
+ * of range tests.
+ */
+typedef int (*read_primitive_handler_t)(msgpack_unpacker_t* uk, int ib, uint64_t val);
+
+enum ib_kind_t {
+    IB_KIND_UNSIGNED,
+    IB_KIND_NEGATIVE,
+    IB_KIND_STRING,
+    IB_KIND_ARRAY,
+    IB_KIND_MAP,
+    IB_KIND_TAG,
+    IB_KIND_SIMPLE,
+    IB_KIND_FLOAT,
+    IB_KIND_STRING_INDEF,
+    IB_KIND_ARRAY_INDEF,
+    IB_KIND_MAP_INDEF,
+    IB_KIND_BREAK,
+    IB_KIND_INVALID,
+};
 
-static int read_primitive(msgpack_unpacker_t* uk)
+typedef struct {
+    read_primitive_handler_t handler;
+    unsigned char kind;         /* enum ib_kind_t */
+    unsigned char arg_len;      /* bytes of argument after the initial byte */
+} msgpack_unpacker_ib_entry_t;
+
+static int read_unsigned_imm(msgpack_unpacker_t* uk, int ib, uint64_t val)
 {
-    if(uk->reading_raw_remaining > 0) {
-      return read_raw_body_cont(uk, uk->textflag);
-    }
+    UNUSED(ib);
+    return object_complete(uk, INT2FIX(val));
+}
 
-    int ib = get_head_byte(uk);
-    if (ib < 0) {
-        return ib;
-    }
+static int read_unsigned(msgpack_unpacker_t* uk, int ib, uint64_t val)
+{
+    UNUSED(ib);
+    return object_complete(uk, rb_ull2inum(val));
+}
 
-    int ai = IB_AI(ib);
-    uint64_t val = ai;
-
-    switch (ib >> 2) {
-    CASE_IMM(MT_UNSIGNED): // Positive Fixnum
-      return object_complete(uk, INT2FIX(ai));
-    CASE_AI(MT_UNSIGNED):
-      READ_VAL(uk, ai, val);
-      return object_complete(uk, rb_ull2inum(val));
-    CASE_IMM(MT_NEGATIVE): // Negative Fixnum
-      return object_complete(uk, INT2FIX(~ai));
-    CASE_AI(MT_NEGATIVE):
-      READ_VAL(uk, ai, val);
-      return object_complete(uk,
-                             (val & 0x8000000000000000
-                              ? rb_funcall(rb_ull2inum(val), rb_intern("~"), 0)
-                              : rb_ll2inum(~val)));
-    CASE_AI(MT_BYTES): CASE_AI(MT_TEXT):
-      READ_VAL(uk, ai, val);
-    CASE_IMM(MT_BYTES): // byte string
-    CASE_IMM(MT_TEXT): // text string
-        if (val == 0) {
-          return object_complete_string(uk, rb_str_buf_new(0), ib & IB_TEXTFLAG);
-        }
-        uk->reading_raw_remaining = val; /* TODO: range checks on val here and below */
-        return read_raw_body_begin(uk, ib & IB_TEXTFLAG);
-    CASE_AI(MT_ARRAY):
-      READ_VAL(uk, ai, val);
-    CASE_IMM(MT_ARRAY): // array
-        if (val == 0) {
-            return object_complete(uk, rb_ary_new());
-        }
-        return _msgpack_unpacker_stack_push(uk, STACK_TYPE_ARRAY, val, rb_ary_new2(SANE_PREALLOCATE(val)));
-    CASE_AI(MT_MAP):
-      READ_VAL(uk, ai, val);
-    CASE_IMM(MT_MAP): // map
-        if (val == 0) {
-            return object_complete(uk, rb_hash_new());
-        }
-        return _msgpack_unpacker_stack_push(uk, STACK_TYPE_MAP_KEY, val*2, rb_hash_new());
-    CASE_AI(MT_TAG):
-      READ_VAL(uk, ai, val);
-    CASE_IMM(MT_TAG): // tag
-      return _msgpack_unpacker_stack_push_tag(uk, STACK_TYPE_TAG, 1, Qnil, val);
-    case MT_PRIM*8+5:
-        switch(ai) {
-        case VAL_NIL:  // nil
-            return object_complete(uk, Qnil);
-        case VAL_FALSE:  // false
-            return object_complete(uk, Qfalse);
-        case VAL_TRUE:  // true
-            return object_complete(uk, Qtrue);
-        }
-        /* fall through */
-    case MT_PRIM*8: case MT_PRIM*8+1: case MT_PRIM*8+2: case MT_PRIM*8+3: case MT_PRIM*8+4:
-      return object_complete(uk, rb_struct_new(rb_cCBOR_Simple, INT2FIX(val)));
-    CASE_AI(MT_PRIM):
-      READ_VAL(uk, ai, val);
-      switch (ai) {
-        case AI_2: {  // half
-          int exp = (val >> 10) & 0x1f;
-          int mant = val & 0x3ff; /* 10 bits */
-          double res;
-          if (exp == 0) res = ldexp(mant, -24);
-          else if (exp != 31) res = ldexp11(mant + 1024, exp - 25);
-          else {
-            if (mant == 0)
-              res = INFINITY;
-            else { /* NAN */
-              union {
-                uint64_t u64;
-                double d;
-              } castbuf = { (val & 0x8000) << 48 | 0x7ff0000000000000UL | (uint64_t)mant << 42 };
-              return object_complete(uk, rb_float_new(castbuf.d));
-            }
-          }
-          return object_complete(uk, rb_float_new(val & 0x8000 ? -res : res));
-        }
-        case AI_4:  // float
-            {
-              union {
-                uint32_t u32;
-                float f;
-              } castbuf = { (uint32_t)val }; /* sets Q to 1 for NAN */
-              if (castbuf.f == castbuf.f) {
-                return object_complete(uk, rb_float_new(castbuf.f));
-              } else { /* NAN */
-                uint64_t mant = val & 0x7fffff; /* 23 bits */
-                union {
-                  uint64_t u64;
-                  double d;
-                } castbuf1 = { (val & 0x80000000UL) << 32 | 0x7ff0000000000000UL | mant << 29 };
-                return object_complete(uk, rb_float_new(castbuf1.d));
-              }
-            }
-        case AI_8:  // double
-            {
-              union {
-                uint64_t u64;
-                double d;
-              } castbuf = { val };
-              return object_complete(uk, rb_float_new(castbuf.d));
-            }
-        default:
-          return object_complete(uk, rb_struct_new(rb_cCBOR_Simple, INT2FIX(val)));
-      }
-    CASE_INDEF(MT_BYTES): CASE_INDEF(MT_TEXT):           /* handle string */
-      if (ai == AI_INDEF)
-        return _msgpack_unpacker_stack_push(uk, STACK_TYPE_STRING_INDEF, ib & IB_TEXTFLAG,
-                                            object_string_encoding_set(rb_str_buf_new(0),
-                                                                       ib & IB_TEXTFLAG));
-      /* fall through */
-    CASE_INDEF(MT_ARRAY):
-      if (ai == AI_INDEF)
-        return _msgpack_unpacker_stack_push(uk, STACK_TYPE_ARRAY_INDEF, 0, rb_ary_new2(0));
-      /* fall through */
-    CASE_INDEF(MT_MAP):
-      if (ai == AI_INDEF)
-        return _msgpack_unpacker_stack_push(uk, STACK_TYPE_MAP_KEY_INDEF, 0, rb_hash_new());
-      /* fall through */
-    CASE_INDEF(MT_PRIM):
-      if (ai == AI_INDEF)
-        return PRIMITIVE_BREAK;
-      /* fall through */
-    }
-    return PRIMITIVE_INVALID_BYTE;
+static int read_negative_imm(msgpack_unpacker_t* uk, int ib, uint64_t val)
+{
+    UNUSED(ib);
+    return object_complete(uk, INT2FIX(~(long)val));
 }
 
+static int read_negative(msgpack_unpacker_t* uk, int ib, uint64_t val)
+{
+    UNUSED(ib);
+    return object_complete(uk,
+                           (val & 0x8000000000000000
+                            ? rb_funcall(rb_ull2inum(val), rb_intern("~"), 0)
+                            : rb_ll2inum(~val)));
+}
 
-int msgpack_unpacker_read_container_header(msgpack_unpacker_t* uk, uint64_t* result_size, int ib)
+static int read_string(msgpack_unpacker_t* uk, int ib, uint64_t val)
 {
-    int b = get_head_byte(uk);
-    if(b < 0) {
-        return b;
+    if (val == 0) {
+        return object_complete_string(uk, rb_str_buf_new(0), ib & IB_TEXTFLAG);
     }
+    uk->reading_raw_remaining = val; /* TODO: range checks on val here and below */
+    return read_raw_body_begin(uk, ib & IB_TEXTFLAG);
+}
 
-    if(ib <= b && b < (ib + AI_1)) {
-      *result_size = IB_AI(b);
-    } else if((b & ~0x3) == (ib + AI_1)) {
-      uint64_t val;
-      READ_VAL(uk, b, val);
-      *result_size = val;
-    } else {
-        return PRIMITIVE_UNEXPECTED_TYPE; /* including INDEF! */
+static int read_array(msgpack_unpacker_t* uk, int ib, uint64_t val)
+{
+    UNUSED(ib);
+    if (val == 0) {
+        return object_complete(uk, object_frozen_if_asked(uk, rb_ary_new()));
     }
+    return _msgpack_unpacker_stack_push(uk, STACK_TYPE_ARRAY, val, Qnil);
+}
 
-    reset_head_byte(uk);
-    return 0;
+static int read_map(msgpack_unpacker_t* uk, int ib, uint64_t val)
+{
+    UNUSED(ib);
+    if (val == 0) {
+        return object_complete(uk, object_frozen_if_asked(uk, rb_hash_new()));
+    }
+    return _msgpack_unpacker_stack_push(uk, STACK_TYPE_MAP_KEY, val*2, Qnil);
 }
 
+#ifdef HAVE_RB_INTEGER_UNPACK
+/* Integer for the big-endian magnitude _p_ of a tag 2 bignum, or of a
+ * tag 3 one if _negative_ */
+static VALUE bignum_from_bytes(const unsigned char* p, size_t length, bool negative)
+{
+    if(!negative) {
+        return rb_integer_unpack(p, length, 1, 0, INTEGER_PACK_BIG_ENDIAN);
+    }
+    if(length == 0) {
+        return INT2FIX(-1);
+    }
 
-int msgpack_unpacker_read_array_header(msgpack_unpacker_t* uk, uint64_t* result_size) {
-  return msgpack_unpacker_read_container_header(uk, result_size, IB_ARRAY);
+    /* -1 - n is the negative number whose two's complement is the one's
+     * complement of n */
+    VALUE tmp;
+    unsigned char* w = ALLOCV(tmp, length);
+    size_t i;
+    for(i = 0; i < length; i++) {
+        w[i] = ~p[i];
+    }
+    VALUE v = rb_integer_unpack(w, length, 1, 0,
+            INTEGER_PACK_BIG_ENDIAN | INTEGER_PACK_2COMP | INTEGER_PACK_NEGATIVE);
+    ALLOCV_END(tmp);
+    return v;
 }
 
-int msgpack_unpacker_read_map_header(msgpack_unpacker_t* uk, uint64_t* result_size) {
-  return msgpack_unpacker_read_container_header(uk, result_size, IB_MAP);
-}
+static inline uint64_t read_arg_direct(const unsigned char* p, int n, int ib);
 
-static VALUE msgpack_unpacker_process_tag(uint64_t tag, VALUE v) {
-  VALUE res = v;
-  switch (tag) {
-  case TAG_TIME_EPOCH: {
-    return rb_funcall(rb_cTime, rb_intern("at"), 1, v);
-  }
-  case TAG_RE: {
-    return rb_funcall(rb_cRegexp, rb_intern("new"), 1, v);
-  }
-  case TAG_URI: {
-    if (!rb_const_defined(rb_cObject, rb_intern("URI")))
-      goto unknown_tag;
-    return rb_funcall(rb_const_get(rb_cObject, rb_intern("URI")),
-                      rb_intern("parse"), 1, v);
-  }
-  case TAG_BIGNUM_NEG:
-  case TAG_BIGNUM:
-    /* check object is a byte string */
-    if (rb_type(v) != T_STRING)
-      break;                    /* XXX: really should error out here */
-#ifdef COMPAT_HAVE_ENCODING
-    if (ENCODING_GET(v) != s_enc_ascii8bit)
-      break;                    /* XXX: really should error out here */
+/* Reads the byte string of a bignum tag straight from the buffer if it
+ * is all in the top chunk; returns false if it is not. */
+static bool read_bignum_direct(msgpack_unpacker_t* uk, uint64_t tag)
+{
+    msgpack_buffer_t* b = UNPACKER_BUFFER_(uk);
+    size_t readable = msgpack_buffer_top_readable_size(b);
+    const unsigned char* p = (const unsigned char*) b->read_buffer;
+    if(readable == 0 || IB_MT(p[0]) != MT_BYTES || IB_AI(p[0]) > AI_8) {
+        return false;
+    }
+    int n = IB_AI(p[0]) < AI_1 ? 0 : 1 << (IB_AI(p[0]) - AI_1);
+    if(readable < (size_t) (1 + n)) {
+        return false;
+    }
+    uint64_t length = read_arg_direct(p + 1, n, p[0]);
+    if(length > readable - 1 - n) {
+        return false;
+    }
+
+    VALUE v = bignum_from_bytes(p + 1 + n, (size_t) length, tag == TAG_BIGNUM_NEG);
+    _msgpack_buffer_consumed(b, 1 + n + (size_t) length);
+    object_complete(uk, v);
+    return true;
+}
 #endif
-    {
-      char *sp = RSTRING_PTR(v);
-      size_t slen = RSTRING_LEN(v);
-      while (slen && *sp == 0) {
-        slen--;
-        sp++;
-      }
 
+static int read_tag(msgpack_unpacker_t* uk, int ib, uint64_t val)
+{
+    UNUSED(ib);
 #ifdef HAVE_RB_INTEGER_UNPACK
-
-      res = rb_integer_unpack(sp, slen, 1, 0, INTEGER_PACK_BIG_ENDIAN);
-      /* (const void *words, size_t numwords, size_t wordsize, size_t nails, int flags); */
-
-#else
-
-#ifndef CANT_DO_BIGNUMS_FAST_ON_THIS_PLATFORM
-      int ndig = (slen + SIZEOF_BDIGITS - 1)/SIZEOF_BDIGITS;
-      res = rb_big_new(ndig, 1);
-    /* compute number RSTRING_PTR(v) */
-      if (ndig) {
-        BDIGIT *ds = RBIGNUM_DIGITS(res);
-        int missbytes = ndig*SIZEOF_BDIGITS - slen; /* 0..SIZEOF_BDIGITS - 1 */
-        union {
-          char msdig_str[SIZEOF_BDIGITS];
-          BDIGIT msdig_bd;
-        } u;
-        u.msdig_bd = 0;
-        memcpy(u.msdig_str + missbytes, sp, SIZEOF_BDIGITS - missbytes);
-        ds[ndig-1] = NTOHBDIGIT(u.msdig_bd);
-        sp += SIZEOF_BDIGITS - missbytes;
-        while (--ndig > 0) {
-          memcpy(u.msdig_str, sp, SIZEOF_BDIGITS);
-          ds[ndig-1] = NTOHBDIGIT(u.msdig_bd);
-          sp += SIZEOF_BDIGITS;
-        }
-      }
-#else
-      {
-        /* This is a slow workaround only... But a working one. */
-        char *hex = ALLOC_N(char, 2 * slen + 1);
-        char *p = hex;
-        while (slen) {
-          sprintf(p, "%02x", *sp++ & 0xFF);
-          p += 2;
-          slen--;
+    /* with strict: :deterministic, the content head is checked by
+     * read_primitive instead */
+    if((val == TAG_BIGNUM || val == TAG_BIGNUM_NEG) && !uk->deterministic &&
+            msgpack_tag_registry_lookup(val) == NULL) {
+        if(read_bignum_direct(uk, val)) {
+            return PRIMITIVE_OBJECT_COMPLETE;
         }
-        *p = 0;
-        res = rb_cstr2inum(hex, 16);
-        xfree(hex);
-      }
-#endif
-#endif
-      if (tag == TAG_BIGNUM)    /* non-negative */
-#ifndef CANT_DO_BIGNUMS_FAST_ON_THIS_PLATFORM
-        return rb_big_norm(res);
-#else
-        return res;
-#endif
-      else
-        return rb_funcall(res, rb_intern("~"), 0);  /* should be rb_big_neg(), but that is static. */
     }
-  }
-unknown_tag:
-  /* common return for unknown tags */
-  return rb_struct_new(rb_cCBOR_Tagged, rb_ull2inum(tag), v);
+#endif
+    return _msgpack_unpacker_stack_push_tag(uk, STACK_TYPE_TAG, 1, Qnil, val);
 }
 
-int msgpack_unpacker_read(msgpack_unpacker_t* uk, size_t target_stack_depth)
+static int read_false(msgpack_unpacker_t* uk, int ib, uint64_t val)
 {
-    while(true) {
-        int r = read_primitive(uk);
-        if(r < 0) {
-            return r;
-        }
-        if(r == PRIMITIVE_CONTAINER_START) {
-            continue;
-        }
-        /* PRIMITIVE_OBJECT_COMPLETE */
+    UNUSED(ib);
+    UNUSED(val);
+    return object_complete(uk, Qfalse);
+}
 
-        if(msgpack_unpacker_stack_is_empty(uk)) {
-            if (r == PRIMITIVE_BREAK)
-              return PRIMITIVE_INVALID_BYTE;
-            return PRIMITIVE_OBJECT_COMPLETE;
-        }
+static int read_true(msgpack_unpacker_t* uk, int ib, uint64_t val)
+{
+    UNUSED(ib);
+    UNUSED(val);
+    return object_complete(uk, Qtrue);
+}
+
+static int read_nil(msgpack_unpacker_t* uk, int ib, uint64_t val)
+{
+    UNUSED(ib);
+    UNUSED(val);
+    return object_complete(uk, Qnil);
+}
+
+/* two-byte simple values below 32 are not well-formed (RFC 8949, 3.3) */
+static inline bool simple_is_well_formed(int ib, uint64_t val)
+{
+    return IB_AI(ib) != AI_1 || val >= 32;
+}
+
+static int read_simple(msgpack_unpacker_t* uk, int ib, uint64_t val)
+{
+    if(!simple_is_well_formed(ib, val)) {
+        return PRIMITIVE_INVALID_BYTE;
+    }
+    return object_complete(uk, object_frozen_if_asked(uk,
+                rb_struct_new(rb_cCBOR_Simple, INT2FIX(val))));
+}
+
+static int read_half(msgpack_unpacker_t* uk, int ib, uint64_t val)
+{
+    UNUSED(ib);
+    int exp = (val >> 10) & 0x1f;
+    int mant = val & 0x3ff; /* 10 bits */
+    double res;
+    if (exp == 0) res = ldexp(mant, -24);
+    else if (exp != 31) res = ldexp11(mant + 1024, exp - 25);
+    else {
+        if (mant == 0)
+            res = INFINITY;
+        else { /* NAN */
+            union {
+                uint64_t u64;
+                double d;
+            } castbuf = { (val & 0x8000) << 48 | 0x7ff0000000000000UL | (uint64_t)mant << 42 };
+            return object_complete(uk, rb_float_new(castbuf.d));
+        }
+    }
+    return object_complete(uk, rb_float_new(val & 0x8000 ? -res : res));
+}
+
+static int read_float(msgpack_unpacker_t* uk, int ib, uint64_t val)
+{
+    UNUSED(ib);
+    union {
+        uint32_t u32;
+        float f;
+    } castbuf = { (uint32_t)val }; /* sets Q to 1 for NAN */
+    if (castbuf.f == castbuf.f) {
+        return object_complete(uk, rb_float_new(castbuf.f));
+    } else { /* NAN */
+        uint64_t mant = val & 0x7fffff; /* 23 bits */
+        union {
+            uint64_t u64;
+            double d;
+        } castbuf1 = { (val & 0x80000000UL) << 32 | 0x7ff0000000000000UL | mant << 29 };
+        return object_complete(uk, rb_float_new(castbuf1.d));
+    }
+}
+
+static int read_double(msgpack_unpacker_t* uk, int ib, uint64_t val)
+{
+    UNUSED(ib);
+    union {
+        uint64_t u64;
+        double d;
+    } castbuf = { val };
+    return object_complete(uk, rb_float_new(castbuf.d));
+}
+
+static int read_string_indef(msgpack_unpacker_t* uk, int ib, uint64_t val)
+{
+    UNUSED(val);
+    return _msgpack_unpacker_stack_push(uk, STACK_TYPE_STRING_INDEF, ib & IB_TEXTFLAG,
+                                        object_string_encoding_set(rb_str_buf_new(0),
+                                                                   ib & IB_TEXTFLAG));
+}
+
+static int read_array_indef(msgpack_unpacker_t* uk, int ib, uint64_t val)
+{
+    UNUSED(ib);
+    UNUSED(val);
+    return _msgpack_unpacker_stack_push(uk, STACK_TYPE_ARRAY_INDEF, 0, Qnil);
+}
+
+static int read_map_indef(msgpack_unpacker_t* uk, int ib, uint64_t val)
+{
+    UNUSED(ib);
+    UNUSED(val);
+    return _msgpack_unpacker_stack_push(uk, STACK_TYPE_MAP_KEY_INDEF, 0, Qnil);
+}
+
+static int read_break(msgpack_unpacker_t* uk, int ib, uint64_t val)
+{
+    UNUSED(uk);
+    UNUSED(ib);
+    UNUSED(val);
+    return PRIMITIVE_BREAK;
+}
+
+static int read_invalid(msgpack_unpacker_t* uk, int ib, uint64_t val)
+{
+    UNUSED(uk);
+    UNUSED(ib);
+    UNUSED(val);
+    return PRIMITIVE_INVALID_BYTE;
+}
+
+#define IB_ENTRY(h, k, n) { msgpack_unpacker_ib_entry_t e = { h, k, n }; return e; }
+
+static msgpack_unpacker_ib_entry_t ib_classify(int ib)
+{
+    int ai = IB_AI(ib);
+    int n = 0;
+
+    if (ai >= AI_1 && ai <= AI_8) {
+        n = 1 << (ai - AI_1);
+    } else if (ai > AI_8 && ai < AI_INDEF) {
+        IB_ENTRY(read_invalid, IB_KIND_INVALID, 0);
+    }
+
+    switch (IB_MT(ib)) {
+    case MT_UNSIGNED:
+        if (ai == AI_INDEF) break;
+        if (n) IB_ENTRY(read_unsigned, IB_KIND_UNSIGNED, n);
+        IB_ENTRY(read_unsigned_imm, IB_KIND_UNSIGNED, 0);
+    case MT_NEGATIVE:
+        if (ai == AI_INDEF) break;
+        if (n) IB_ENTRY(read_negative, IB_KIND_NEGATIVE, n);
+        IB_ENTRY(read_negative_imm, IB_KIND_NEGATIVE, 0);
+    case MT_BYTES:
+    case MT_TEXT:
+        if (ai == AI_INDEF) IB_ENTRY(read_string_indef, IB_KIND_STRING_INDEF, 0);
+        IB_ENTRY(read_string, IB_KIND_STRING, n);
+    case MT_ARRAY:
+        if (ai == AI_INDEF) IB_ENTRY(read_array_indef, IB_KIND_ARRAY_INDEF, 0);
+        IB_ENTRY(read_array, IB_KIND_ARRAY, n);
+    case MT_MAP:
+        if (ai == AI_INDEF) IB_ENTRY(read_map_indef, IB_KIND_MAP_INDEF, 0);
+        IB_ENTRY(read_map, IB_KIND_MAP, n);
+    case MT_TAG:
+        if (ai == AI_INDEF) break;
+        IB_ENTRY(read_tag, IB_KIND_TAG, n);
+    case MT_PRIM:
+        switch (ai) {
+        case VAL_FALSE:
+            IB_ENTRY(read_false, IB_KIND_SIMPLE, 0);
+        case VAL_TRUE:
+            IB_ENTRY(read_true, IB_KIND_SIMPLE, 0);
+        case VAL_NIL:
+            IB_ENTRY(read_nil, IB_KIND_SIMPLE, 0);
+        case AI_2:
+            IB_ENTRY(read_half, IB_KIND_FLOAT, n);
+        case AI_4:
+            IB_ENTRY(read_float, IB_KIND_FLOAT, n);
+        case AI_8:
+            IB_ENTRY(read_double, IB_KIND_FLOAT, n);
+        case AI_INDEF:
+            IB_ENTRY(read_break, IB_KIND_BREAK, 0);
+        }
+        IB_ENTRY(read_simple, IB_KIND_SIMPLE, n);
+    }
+    IB_ENTRY(read_invalid, IB_KIND_INVALID, 0);
+}
+
+#undef IB_ENTRY
+
+static msgpack_unpacker_ib_entry_t s_ib_table[256];
+#define IB_TABLE_ENTRY(ib) (s_ib_table[ib])
+
+static void ib_table_init(void)
+{
+    int ib;
+    for (ib = 0; ib < 256; ib++) {
+        s_ib_table[ib] = ib_classify(ib);
+    }
+}
+
+#define READ_ARG(uk, n, val)  {                 \
+    READ_CAST_BLOCK_OR_RETURN_EOF(cb, uk, n);   \
+    switch (n) {                                \
+    case 1:                                     \
+      val = cb->u8;                             \
+      break;                                    \
+    case 2:                                     \
+      val = _msgpack_be16(cb->u16);             \
+      break;                                    \
+    case 4:                                     \
+      val = _msgpack_be32(cb->u32);             \
+      break;                                    \
+    default:                                    \
+      val = _msgpack_be64(cb->u64);             \
+      break;                                    \
+    }                                           \
+  }
+
+/* longest head: initial byte plus an 8-byte argument */
+#define HEAD_LENGTH_MAX 9
+
+static inline uint64_t read_arg_direct(const unsigned char* p, int n, int ib)
+{
+    switch (n) {
+    case 0:
+        return IB_AI(ib);
+    case 1:
+        return p[0];
+    case 2: {
+        uint16_t v;
+        memcpy(&v, p, 2);
+        return _msgpack_be16(v);
+    }
+    case 4: {
+        uint32_t v;
+        memcpy(&v, p, 4);
+        return _msgpack_be32(v);
+    }
+    default: {
+        uint64_t v;
+        memcpy(&v, p, 8);
+        return _msgpack_be64(v);
+    }
+    }
+}
+
+/* Reads the initial byte (unless already read) and its argument.
+ * Returns the initial byte or PRIMITIVE_EOF; on EOF the initial byte
+ * is kept so the head can be read again once more data arrives. */
+static inline int read_head(msgpack_unpacker_t* uk, msgpack_unpacker_ib_entry_t* e, uint64_t* val)
+{
+    msgpack_buffer_t* b = UNPACKER_BUFFER_(uk);
+    int ib = uk->head_byte;
+
+    if (ib == HEAD_BYTE_REQUIRED) {
+        if (msgpack_buffer_top_readable_size(b) > HEAD_LENGTH_MAX) {
+            /* Fast path: the whole head is in the top chunk, which is
+             * always the case for in-memory input except near its end.
+             * One bounds check covers initial byte and argument, and
+             * the chunk can't run out, so no shift check either. */
+            const unsigned char* p = (const unsigned char*) b->read_buffer;
+            uk->head_byte = ib = p[0];
+            *e = IB_TABLE_ENTRY(ib);
+            *val = read_arg_direct(p + 1, e->arg_len, ib);
+            b->read_buffer += 1 + e->arg_len;
+            return ib;
+        }
+        ib = read_head_byte(uk);
+        if (ib < 0) {
+            return ib;
+        }
+    }
+
+    *e = IB_TABLE_ENTRY(ib);
+    *val = IB_AI(ib);
+    if (e->arg_len) {
+        uint64_t v;
+        READ_ARG(uk, e->arg_len, v);
+        *val = v;
+    }
+    return ib;
+}
+
+/*
+ * Strict deterministic decoding: checks heads for preferred serialization
+ * (RFC 8949, section 4.2.1) as they are read, and the encoded bytes of map
+ * keys for their order.
+ */
+
+/* true if the float32 _b32_ is exactly representable as a float16, as
+ * msgpack_packer_write_double would write it */
+static bool float32_fits_half(uint32_t b32)
+{
+    int exp = (b32 >> 23) & 0xff;
+    uint32_t mant = b32 & 0x7fffff;
+    if ((b32 & 0x1fff) != 0)
+        return false;
+    if (exp == 0)
+        return mant == 0;
+    if (exp >= 113 && exp <= 142)
+        return true;
+    if (exp >= 103 && exp < 113)
+        return (mant & ((1U << (126 - exp)) - 1)) == 0;
+    return exp == 255;          /* Inf, or NaN with a short payload */
+}
+
+static bool head_is_deterministic(msgpack_unpacker_ib_entry_t e, uint64_t val)
+{
+    switch (e.kind) {
+    case IB_KIND_UNSIGNED:
+    case IB_KIND_NEGATIVE:
+    case IB_KIND_STRING:
+    case IB_KIND_ARRAY:
+    case IB_KIND_MAP:
+    case IB_KIND_TAG:
+        switch (e.arg_len) {
+        case 0:
+            return true;
+        case 1:
+            return val >= 24;
+        case 2:
+            return val > 0xff;
+        case 4:
+            return val > 0xffff;
+        default:
+            return val > 0xffffffffULL;
+        }
+    case IB_KIND_SIMPLE:
+        /* the rest are not well-formed, which read_simple reports */
+        return true;
+    case IB_KIND_FLOAT:
+        switch (e.arg_len) {
+        case 2:
+            return true;
+        case 4:
+            return !float32_fits_half((uint32_t) val);
+        default: {
+            union {
+                uint64_t u64;
+                double d;
+            } castbuf = { val };
+            if (castbuf.d != castbuf.d)     /* NaN: could the payload be narrowed? */
+                return (val & 0x1fffffffULL) != 0;
+            return (double)(float) castbuf.d != castbuf.d;
+        }
+        }
+    case IB_KIND_STRING_INDEF:
+    case IB_KIND_ARRAY_INDEF:
+    case IB_KIND_MAP_INDEF:
+    case IB_KIND_BREAK:
+        return false;
+    default:
+        return true;            /* left to the handler */
+    }
+}
+
+/* bignums (tags 2 and 3) only for integers that major types 0 and 1 can
+ * not hold, and without leading zero bytes */
+static bool tag_content_is_deterministic(uint64_t tag, VALUE v)
+{
+    if ((tag != TAG_BIGNUM && tag != TAG_BIGNUM_NEG) || !RB_TYPE_P(v, T_STRING)) {
+        return true;
+    }
+    return RSTRING_LEN(v) > 8 && RSTRING_PTR(v)[0] != 0;
+}
+
+static inline void key_range_start(msgpack_unpacker_t* uk)
+{
+    msgpack_unpacker_key_range_t* kr = &uk->key_ranges[uk->stack_depth - 1];
+    msgpack_buffer_t* b = UNPACKER_BUFFER_(uk);
+    kr->key_start = b->read_buffer;
+    kr->key_chunk = b->head;
+}
+
+/* keys that started before more data was read can't be looked up in the
+ * buffer any more */
+static void key_ranges_forget(msgpack_unpacker_t* uk)
+{
+    size_t i;
+    for (i = 0; i < uk->stack_depth; i++) {
+        uk->key_ranges[i].key_start = NULL;
+    }
+}
+
+/*
+ * Checks that the key just read sorts after the previous one in its map,
+ * comparing their encoded bytes, and keeps it for the next comparison.
+ * The key is normally still in the buffer chunk it started in; if not
+ * (it was split over fed chunks or IO reads), it is encoded again, which
+ * gives the same bytes for everything a deterministic encoding decodes
+ * to, except tags turned into other objects.
+ */
+static int key_range_check(msgpack_unpacker_t* uk)
+{
+    msgpack_unpacker_key_range_t* kr = &uk->key_ranges[uk->stack_depth - 1];
+    msgpack_buffer_t* b = UNPACKER_BUFFER_(uk);
+    const char* p;
+    size_t length;
+    VALUE encoded = Qnil;
+
+    if (kr->key_start != NULL && b->io == Qnil && b->head == kr->key_chunk &&
+            b->read_buffer != NULL && kr->key_start >= b->head->first &&
+            kr->key_start <= b->read_buffer) {
+        p = kr->key_start;
+        length = b->read_buffer - kr->key_start;
+    } else {
+        VALUE argv[2] = { uk->last_object, s_deterministic_options };
+        encoded = MessagePack_pack(2, argv);
+        p = RSTRING_PTR(encoded);
+        length = RSTRING_LEN(encoded);
+    }
+
+    const char* prev = uk->key_bytes + kr->prev_key;
+    size_t prev_length = uk->key_bytes_length - kr->prev_key;
+    if (prev_length > 0) {
+        size_t n = prev_length < length ? prev_length : length;
+        int c = memcmp(prev, p, n);
+        if (c > 0 || (c == 0 && prev_length >= length)) {
+            return PRIMITIVE_NOT_DETERMINISTIC;
+        }
+    }
+
+    size_t needed = kr->prev_key + length;
+    if (needed > uk->key_bytes_capacity) {
+        size_t capacity = uk->key_bytes_capacity == 0 ? 256 : uk->key_bytes_capacity;
+        while (capacity < needed) {
+            capacity *= 2;
+        }
+        REALLOC_N(uk->key_bytes, char, capacity);
+        uk->key_bytes_capacity = capacity;
+    }
+    memcpy(uk->key_bytes + kr->prev_key, p, length);
+    uk->key_bytes_length = needed;
+
+    RB_GC_GUARD(encoded);
+    return PRIMITIVE_OBJECT_COMPLETE;
+}
+
+static int read_primitive(msgpack_unpacker_t* uk)
+{
+    msgpack_unpacker_ib_entry_t e;
+    uint64_t val;
+
+    if (uk->head_byte != HEAD_BYTE_REQUIRED && uk->reading_raw_remaining > 0) {
+        /* resuming a string body that hit the end of the buffer;
+         * head_byte stays set until the string is complete */
+        return read_raw_body_cont(uk, uk->textflag);
+    }
+
+    int ib = read_head(uk, &e, &val);
+    if (ib < 0) {
+        return ib;
+    }
+    if (uk->deterministic && !head_is_deterministic(e, val)) {
+        return PRIMITIVE_NOT_DETERMINISTIC;
+    }
+    return e.handler(uk, ib, val);
+}
+
+
+int msgpack_unpacker_read_container_header(msgpack_unpacker_t* uk, uint64_t* result_size, int ib)
+{
+    int b = get_head_byte(uk);
+    if(b < 0) {
+        return b;
+    }
+
+    if(ib <= b && b < (ib + AI_1)) {
+      *result_size = IB_AI(b);
+    } else if((b & ~0x3) == (ib + AI_1)) {
+      uint64_t val;
+      READ_VAL(uk, b, val);
+      *result_size = val;
+    } else {
+        return PRIMITIVE_UNEXPECTED_TYPE; /* including INDEF! */
+    }
+
+    reset_head_byte(uk);
+    return 0;
+}
+
+
+int msgpack_unpacker_read_array_header(msgpack_unpacker_t* uk, uint64_t* result_size) {
+  return msgpack_unpacker_read_container_header(uk, result_size, IB_ARRAY);
+}
+
+int msgpack_unpacker_read_map_header(msgpack_unpacker_t* uk, uint64_t* result_size) {
+  return msgpack_unpacker_read_container_header(uk, result_size, IB_MAP);
+}
+
+/* RFC 3339 date/time strings (tag 0) */
+
+static inline bool read_digits(const char** pp, const char* pend, int n, int* result)
+{
+    const char* p = *pp;
+    int v = 0;
+    if(pend - p < n) {
+        return false;
+    }
+    for(; n > 0; n--, p++) {
+        if(*p < '0' || *p > '9') {
+            return false;
+        }
+        v = v * 10 + (*p - '0');
+    }
+    *pp = p;
+    *result = v;
+    return true;
+}
+
+static inline bool read_char(const char** pp, const char* pend, char c1, char c2)
+{
+    if(*pp < pend && (**pp == c1 || **pp == c2)) {
+        (*pp)++;
+        return true;
+    }
+    return false;
+}
+
+/* days since 1970-01-01 of a proleptic Gregorian date */
+static int64_t days_from_civil(int64_t y, int m, int d)
+{
+    y -= m <= 2;
+    int64_t era = (y >= 0 ? y : y - 399) / 400;
+    int64_t yoe = y - era * 400;
+    int64_t doy = (153 * (m + (m > 2 ? -3 : 9)) + 2) / 5 + d - 1;
+    int64_t doe = yoe * 365 + yoe / 4 - yoe / 100 + doy;
+    return era * 146097 + doe - 719468;
+}
+
+static inline int days_in_month(int year, int month)
+{
+    static const int days[] = { 31, 28, 31, 30, 31, 30, 31, 31, 30, 31, 30, 31 };
+    if(month == 2 && year % 4 == 0 && (year % 100 != 0 || year % 400 == 0)) {
+        return 29;
+    }
+    return days[month - 1];
+}
+
+/* Returns a Time for an RFC 3339 date-time, or Qundef if _str_ is not one.
+ * Fractions of a second beyond nanoseconds are truncated. */
+static VALUE time_from_rfc3339(VALUE str)
+{
+    if(!RB_TYPE_P(str, T_STRING)) {
+        return Qundef;
+    }
+    const char* p = RSTRING_PTR(str);
+    const char* const pend = p + RSTRING_LEN(str);
+    int year, month, day, hour, min, sec;
+    if(!(read_digits(&p, pend, 4, &year) && read_char(&p, pend, '-', '-') &&
+                read_digits(&p, pend, 2, &month) && read_char(&p, pend, '-', '-') &&
+                read_digits(&p, pend, 2, &day) && read_char(&p, pend, 'T', 't') &&
+                read_digits(&p, pend, 2, &hour) && read_char(&p, pend, ':', ':') &&
+                read_digits(&p, pend, 2, &min) && read_char(&p, pend, ':', ':') &&
+                read_digits(&p, pend, 2, &sec))) {
+        return Qundef;
+    }
+
+    long nsec = 0;
+    if(read_char(&p, pend, '.', '.')) {
+        int digits = 0;
+        if(p == pend || *p < '0' || *p > '9') {
+            return Qundef;
+        }
+        for(; p < pend && *p >= '0' && *p <= '9'; p++) {
+            if(digits < 9) {
+                nsec = nsec * 10 + (*p - '0');
+                digits++;
+            }
+        }
+        for(; digits < 9; digits++) {
+            nsec *= 10;
+        }
+    }
+
+    int offset;                 /* as for rb_time_timespec_new */
+    if(read_char(&p, pend, 'Z', 'z')) {
+        offset = INT_MAX - 1;   /* UTC */
+    } else if(p < pend && (*p == '+' || *p == '-')) {
+        int sign = *p++ == '-' ? -1 : 1;
+        int off_hour, off_min;
+        if(!(read_digits(&p, pend, 2, &off_hour) && read_char(&p, pend, ':', ':') &&
+                    read_digits(&p, pend, 2, &off_min)) ||
+                off_hour > 23 || off_min > 59) {
+            return Qundef;
+        }
+        offset = sign * (off_hour * 3600 + off_min * 60);
+        if(offset == 0 && sign < 0) {
+            offset = INT_MAX - 1;   /* -00:00: UTC, local offset unknown */
+        }
+    } else {
+        return Qundef;
+    }
+
+    if(p != pend || month < 1 || month > 12 || day < 1 ||
+            day > days_in_month(year, month) ||
+            hour > 23 || min > 59 || sec > 60) {
+        return Qundef;
+    }
+
+    struct timespec ts;
+    ts.tv_sec = (time_t) (days_from_civil(year, month, day) * 86400 +
+            hour * 3600 + min * 60 + sec);
+    if(offset != INT_MAX - 1) {
+        ts.tv_sec -= offset;
+    }
+    ts.tv_nsec = nsec;
+    return rb_time_timespec_new(&ts, offset);
+}
+
+static VALUE msgpack_unpacker_process_tag(msgpack_unpacker_t* uk, uint64_t tag, VALUE v) {
+  VALUE res = v;
+  const msgpack_tag_entry_t* e = msgpack_tag_registry_lookup(tag);
+  if (e != NULL) {
+    res = e->decoder(tag, v, e->data);
+    if (res != Qundef)
+      return res;
+    res = v;
+  }
+  if (TAG_IS_TYPED_ARRAY(tag) && uk->typed_arrays != MSGPACK_TYPED_ARRAYS_TAGGED) {
+    res = MessagePack_TypedArray_decode(tag, v, uk->typed_arrays);
+    if (res == Qundef)
+      goto unknown_tag;
+    return res;
+  }
+  switch (tag) {
+  case TAG_TIME_STRING:
+    res = time_from_rfc3339(v);
+    if (res == Qundef)
+      goto unknown_tag;
+    return res;
+  case TAG_TIME_EPOCH:
+    if (FIXNUM_P(v))
+      return rb_time_new(FIX2LONG(v), 0);
+    if (RB_FLOAT_TYPE_P(v) || RB_TYPE_P(v, T_BIGNUM))
+      return rb_time_num_new(v, Qnil);
+    return rb_funcall(rb_cTime, rb_intern("at"), 1, v);
+  case TAG_RE: {
+    return rb_funcall(rb_cRegexp, rb_intern("new"), 1, v);
+  }
+  case TAG_URI: {
+    if (!rb_const_defined(rb_cObject, rb_intern("URI")))
+      goto unknown_tag;
+    return rb_funcall(rb_const_get(rb_cObject, rb_intern("URI")),
+                      rb_intern("parse"), 1, v);
+  }
+  case TAG_BIGNUM_NEG:
+  case TAG_BIGNUM:
+    /* check object is a byte string */
+    if (rb_type(v) != T_STRING)
+      break;                    /* XXX: really should error out here */
+#ifdef COMPAT_HAVE_ENCODING
+    if (ENCODING_GET(v) != s_enc_ascii8bit)
+      break;                    /* XXX: really should error out here */
+#endif
+    {
+#ifdef HAVE_RB_INTEGER_UNPACK
+
+      return bignum_from_bytes((const unsigned char*) RSTRING_PTR(v), RSTRING_LEN(v),
+                               tag == TAG_BIGNUM_NEG);
+
+#else
+      char *sp = RSTRING_PTR(v);
+      size_t slen = RSTRING_LEN(v);
+      while (slen && *sp == 0) {
+        slen--;
+        sp++;
+      }
+
+
+#ifndef CANT_DO_BIGNUMS_FAST_ON_THIS_PLATFORM
+      int ndig = (slen + SIZEOF_BDIGITS - 1)/SIZEOF_BDIGITS;
+      res = rb_big_new(ndig, 1);
+    /* compute number RSTRING_PTR(v) */
+      if (ndig) {
+        BDIGIT *ds = RBIGNUM_DIGITS(res);
+        int missbytes = ndig*SIZEOF_BDIGITS - slen; /* 0..SIZEOF_BDIGITS - 1 */
+        union {
+          char msdig_str[SIZEOF_BDIGITS];
+          BDIGIT msdig_bd;
+        } u;
+        u.msdig_bd = 0;
+        memcpy(u.msdig_str + missbytes, sp, SIZEOF_BDIGITS - missbytes);
+        ds[ndig-1] = NTOHBDIGIT(u.msdig_bd);
+        sp += SIZEOF_BDIGITS - missbytes;
+        while (--ndig > 0) {
+          memcpy(u.msdig_str, sp, SIZEOF_BDIGITS);
+          ds[ndig-1] = NTOHBDIGIT(u.msdig_bd);
+          sp += SIZEOF_BDIGITS;
+        }
+      }
+#else
+      {
+        /* This is a slow workaround only... But a working one. */
+        char *hex = ALLOC_N(char, 2 * slen + 1);
+        char *p = hex;
+        while (slen) {
+          sprintf(p, "%02x", *sp++ & 0xFF);
+          p += 2;
+          slen--;
+        }
+        *p = 0;
+        res = rb_cstr2inum(hex, 16);
+        xfree(hex);
+      }
+#endif
+      if (tag == TAG_BIGNUM)    /* non-negative */
+#ifndef CANT_DO_BIGNUMS_FAST_ON_THIS_PLATFORM
+        return rb_big_norm(res);
+#else
+        return res;
+#endif
+      else
+        return rb_funcall(res, rb_intern("~"), 0);  /* should be rb_big_neg(), but that is static. */
+#endif
+    }
+  }
+unknown_tag:
+  /* common return for unknown tags */
+  return rb_struct_new(rb_cCBOR_Tagged, rb_ull2inum(tag), v);
+}
+
+int msgpack_unpacker_read(msgpack_unpacker_t* uk, size_t target_stack_depth)
+{
+    while(true) {
+        int r = read_primitive(uk);
+        if(r < 0) {
+            if(r == PRIMITIVE_EOF && uk->deterministic) {
+                key_ranges_forget(uk);
+            }
+            return r;
+        }
+        if(r == PRIMITIVE_CONTAINER_START) {
+            if(uk->deterministic &&
+                    _msgpack_unpacker_stack_top(uk)->type == STACK_TYPE_MAP_KEY) {
+                key_range_start(uk);
+            }
+            continue;
+        }
+        /* PRIMITIVE_OBJECT_COMPLETE */
+
+        if(uk->stack_depth <= target_stack_depth) {
+            if (r == PRIMITIVE_BREAK)
+              return PRIMITIVE_INVALID_BYTE;
+            return PRIMITIVE_OBJECT_COMPLETE;
+        }
+
+        container_completed:
+        {
+            msgpack_unpacker_stack_t* top = _msgpack_unpacker_stack_top(uk);
+            if (top->type <= STACK_TYPE_MAP_VALUE_INDEF && r == PRIMITIVE_BREAK)
+              return PRIMITIVE_INVALID_BYTE;
+            switch(top->type) {
+            case STACK_TYPE_ARRAY:
+                _msgpack_unpacker_values_push(uk, uk->last_object);
+                break;
+            case STACK_TYPE_MAP_KEY:
+                if(uk->deterministic) {
+                    int kr = key_range_check(uk);
+                    if(kr < 0) {
+                        return kr;
+                    }
+                }
+                _msgpack_unpacker_values_push_key(uk, uk->last_object);
+                top->type = STACK_TYPE_MAP_VALUE;
+                break;
+            case STACK_TYPE_MAP_VALUE:
+                _msgpack_unpacker_values_push(uk, uk->last_object);
+                top->type = STACK_TYPE_MAP_KEY;
+                if(uk->deterministic) {
+                    key_range_start(uk);
+                }
+                break;
+            case STACK_TYPE_TAG:
+              if(uk->deterministic && !tag_content_is_deterministic(top->tag, uk->last_object)) {
+                  return PRIMITIVE_NOT_DETERMINISTIC;
+              }
+              object_complete(uk, object_frozen_if_asked(uk,
+                      msgpack_unpacker_process_tag(uk, top->tag, uk->last_object)));
+              goto done;
+              
+            case STACK_TYPE_ARRAY_INDEF:
+              if (r == PRIMITIVE_BREAK)
+                goto complete;
+              _msgpack_unpacker_values_push(uk, uk->last_object);
+              continue;
+            case STACK_TYPE_MAP_KEY_INDEF:
+              if (r == PRIMITIVE_BREAK)
+                goto complete;
+              _msgpack_unpacker_values_push_key(uk, uk->last_object);
+              top->type = STACK_TYPE_MAP_VALUE_INDEF;
+              continue;
+            case STACK_TYPE_MAP_VALUE_INDEF:
+              _msgpack_unpacker_values_push(uk, uk->last_object);
+              top->type = STACK_TYPE_MAP_KEY_INDEF;
+              continue;
+            case STACK_TYPE_STRING_INDEF:
+              if (r == PRIMITIVE_BREAK) {
+                object_complete_string(uk, top->object, (int)top->count); /* use count as textflag */
+                goto done;
+              }
+              if (!RB_TYPE_P(uk->last_object, T_STRING))
+                return PRIMITIVE_INVALID_BYTE;
+#ifdef COMPAT_HAVE_ENCODING     /* XXX */
+              if (ENCODING_GET(top->object) != ENCODING_GET(uk->last_object))
+                return PRIMITIVE_INVALID_BYTE;
+#endif
+              rb_str_append(top->object, uk->last_object);
+              continue;
+            }
+            size_t count = --top->count;
+
+            if(count == 0) {
+            complete:;
+              if(top->type == STACK_TYPE_ARRAY || top->type == STACK_TYPE_ARRAY_INDEF) {
+                  top->object = _msgpack_unpacker_values_to_array(uk, top->values_base);
+              } else if(top->type == STACK_TYPE_MAP_KEY || top->type == STACK_TYPE_MAP_KEY_INDEF) {
+                  top->object = _msgpack_unpacker_values_to_hash(uk, top->values_base);
+              }
+              object_complete(uk, object_frozen_if_asked(uk, top->object));
+            done:;
+                if(uk->deterministic) {
+                    uk->key_bytes_length = uk->key_ranges[uk->stack_depth - 1].prev_key;
+                }
+                if(msgpack_unpacker_stack_pop(uk) <= target_stack_depth) {
+                    return PRIMITIVE_OBJECT_COMPLETE;
+                }
+                r = PRIMITIVE_OBJECT_COMPLETE;
+                goto container_completed;
+            }
+        }
+    }
+}
+
+/* skip engine: same heads and stack as read, but no Ruby objects */
+
+static int skip_raw_body(msgpack_unpacker_t* uk)
+{
+    size_t length = uk->reading_raw_remaining;
+    do {
+        size_t n = msgpack_buffer_skip(UNPACKER_BUFFER_(uk), length);
+        if(n == 0) {
+            return PRIMITIVE_EOF;
+        }
+        uk->reading_raw_remaining = length = length - n;
+    } while(length > 0);
+
+    return object_complete(uk, Qnil);
+}
+
+static int skip_from_head(msgpack_unpacker_t* uk, int ib, msgpack_unpacker_ib_entry_t e, uint64_t val)
+{
+    /* chunks of an indefinite length string must be definite
+     * strings of the same major type */
+    if(uk->stack_depth > 0 && e.kind != IB_KIND_BREAK) {
+        msgpack_unpacker_stack_t* top = _msgpack_unpacker_stack_top(uk);
+        if(top->type == STACK_TYPE_STRING_INDEF &&
+                (e.kind != IB_KIND_STRING || (size_t)(ib & IB_TEXTFLAG) != top->count)) {
+            return PRIMITIVE_INVALID_BYTE;
+        }
+    }
+
+    switch(e.kind) {
+    case IB_KIND_SIMPLE:
+        if(!simple_is_well_formed(ib, val)) {
+            return PRIMITIVE_INVALID_BYTE;
+        }
+        return object_complete(uk, Qnil);
+    case IB_KIND_UNSIGNED:
+    case IB_KIND_NEGATIVE:
+    case IB_KIND_FLOAT:
+        return object_complete(uk, Qnil);
+    case IB_KIND_STRING:
+        if(val == 0) {
+            return object_complete(uk, Qnil);
+        }
+        uk->reading_raw_remaining = val;
+        return skip_raw_body(uk);
+    case IB_KIND_ARRAY:
+        if(val == 0) {
+            return object_complete(uk, Qnil);
+        }
+        return _msgpack_unpacker_stack_push(uk, STACK_TYPE_ARRAY, val, Qnil);
+    case IB_KIND_MAP:
+        if(val == 0) {
+            return object_complete(uk, Qnil);
+        }
+        if(val > SIZE_MAX / 2) {
+            return PRIMITIVE_EOF; /* can't be complete anyway */
+        }
+        return _msgpack_unpacker_stack_push(uk, STACK_TYPE_MAP_KEY, val*2, Qnil);
+    case IB_KIND_TAG:
+        /* one item must follow, so a break can't */
+        return _msgpack_unpacker_stack_push_tag(uk, STACK_TYPE_TAG, 1, Qnil, val);
+    case IB_KIND_STRING_INDEF:
+        return _msgpack_unpacker_stack_push(uk, STACK_TYPE_STRING_INDEF, ib & IB_TEXTFLAG, Qnil);
+    case IB_KIND_ARRAY_INDEF:
+        return _msgpack_unpacker_stack_push(uk, STACK_TYPE_ARRAY_INDEF, 0, Qnil);
+    case IB_KIND_MAP_INDEF:
+        return _msgpack_unpacker_stack_push(uk, STACK_TYPE_MAP_KEY_INDEF, 0, Qnil);
+    case IB_KIND_BREAK:
+        reset_head_byte(uk);
+        return PRIMITIVE_BREAK;
+    default:
+        return PRIMITIVE_INVALID_BYTE;
+    }
+}
+
+static int skip_primitive(msgpack_unpacker_t* uk)
+{
+    msgpack_unpacker_ib_entry_t e;
+    uint64_t val;
+
+    if(uk->head_byte != HEAD_BYTE_REQUIRED && uk->reading_raw_remaining > 0) {
+        return skip_raw_body(uk);
+    }
+
+    int ib = read_head(uk, &e, &val);
+    if(ib < 0) {
+        return ib;
+    }
+    return skip_from_head(uk, ib, e, val);
+}
+
+int msgpack_unpacker_skip(msgpack_unpacker_t* uk, size_t target_stack_depth)
+{
+    while(true) {
+        int r = skip_primitive(uk);
+        if(r < 0) {
+            return r;
+        }
+        if(r == PRIMITIVE_CONTAINER_START) {
+            continue;
+        }
+        /* PRIMITIVE_OBJECT_COMPLETE or PRIMITIVE_BREAK */
+
+        if(uk->stack_depth <= target_stack_depth) {
+            if(r == PRIMITIVE_BREAK) {
+                return PRIMITIVE_INVALID_BYTE;
+            }
+            return PRIMITIVE_OBJECT_COMPLETE;
+        }
 
         container_completed:
         {
             msgpack_unpacker_stack_t* top = _msgpack_unpacker_stack_top(uk);
-            if (top->type <= STACK_TYPE_MAP_VALUE_INDEF && r == PRIMITIVE_BREAK)
-              return PRIMITIVE_INVALID_BYTE;
+            if(top->type <= STACK_TYPE_MAP_VALUE_INDEF && r == PRIMITIVE_BREAK) {
+                return PRIMITIVE_INVALID_BYTE;
+            }
+
             switch(top->type) {
-            case STACK_TYPE_ARRAY:
-                rb_ary_push(top->object, uk->last_object);
-                break;
-            case STACK_TYPE_MAP_KEY:
-                top->key = uk->last_object;
-                top->type = STACK_TYPE_MAP_VALUE;
-                break;
-            case STACK_TYPE_MAP_VALUE:
-                rb_hash_aset(top->object, top->key, uk->last_object);
-                top->type = STACK_TYPE_MAP_KEY;
-                break;
-            case STACK_TYPE_TAG:
-              object_complete(uk, msgpack_unpacker_process_tag(top->tag, uk->last_object));
-              goto done;
-              
             case STACK_TYPE_ARRAY_INDEF:
-              if (r == PRIMITIVE_BREAK)
-                goto complete;
-              rb_ary_push(top->object, uk->last_object);
-              continue;
+            case STACK_TYPE_STRING_INDEF:
+                if(r == PRIMITIVE_BREAK) {
+                    goto complete;
+                }
+                continue;
             case STACK_TYPE_MAP_KEY_INDEF:
-              if (r == PRIMITIVE_BREAK)
-                goto complete;
-              top->key = uk->last_object;
-              top->type = STACK_TYPE_MAP_VALUE_INDEF;
-              continue;
+                if(r == PRIMITIVE_BREAK) {
+                    goto complete;
+                }
+                top->type = STACK_TYPE_MAP_VALUE_INDEF;
+                continue;
             case STACK_TYPE_MAP_VALUE_INDEF:
-              rb_hash_aset(top->object, top->key, uk->last_object);
-              top->type = STACK_TYPE_MAP_KEY_INDEF;
-              continue;
-            case STACK_TYPE_STRING_INDEF:
-              if (r == PRIMITIVE_BREAK) {
-                object_complete_string(uk, top->object, (int)top->count); /* use count as textflag */
-                goto done;
-              }
-              if (!RB_TYPE_P(uk->last_object, T_STRING))
-                return PRIMITIVE_INVALID_BYTE;
-#ifdef COMPAT_HAVE_ENCODING     /* XXX */
-              if (ENCODING_GET(top->object) != ENCODING_GET(uk->last_object))
-                return PRIMITIVE_INVALID_BYTE;
+                top->type = STACK_TYPE_MAP_KEY_INDEF;
+                continue;
+            case STACK_TYPE_TAG:
+                /* the tagged item is done */
+                goto complete;
+            default:
+                /* definite array or map: count holds the remaining items */
+                if(--top->count > 0) {
+                    continue;
+                }
+            }
+
+        complete:
+            object_complete(uk, Qnil);
+            if(msgpack_unpacker_stack_pop(uk) <= target_stack_depth) {
+                return PRIMITIVE_OBJECT_COMPLETE;
+            }
+            r = PRIMITIVE_OBJECT_COMPLETE;
+            goto container_completed;
+        }
+    }
+}
+
+/* dig: walk down a path skipping everything off the path */
+
+/* Consumes a break if one is next.  Returns 1 for a break, 0 otherwise
+ * (the initial byte is then kept for the next read), or an error. */
+static int dig_read_break(msgpack_unpacker_t* uk)
+{
+    int ib = get_head_byte(uk);
+    if(ib < 0) {
+        return ib;
+    }
+    if(ib == IB_BREAK) {
+        reset_head_byte(uk);
+        return 1;
+    }
+    return 0;
+}
+
+/* Whether the container on top of the stack has another item.  Closed
+ * indefinite containers are marked by a count of 1. */
+static int dig_has_next(msgpack_unpacker_t* uk)
+{
+    msgpack_unpacker_stack_t* top = _msgpack_unpacker_stack_top(uk);
+    if(top->type == STACK_TYPE_ARRAY || top->type == STACK_TYPE_MAP_KEY ||
+            top->type == STACK_TYPE_MAP_VALUE) {
+        return top->count > 0;
+    }
+    if(top->count > 0) {
+        return 0;
+    }
+    int r = dig_read_break(uk);
+    if(r < 0) {
+        return r;
+    }
+    if(r) {
+        top->count = 1;
+        return 0;
+    }
+    return 1;
+}
+
+/* An item of the container on top of the stack is complete.  Maps
+ * switch between keys and values, so values are not read as keys. */
+static inline void stack_item_done(msgpack_unpacker_t* uk)
+{
+    msgpack_unpacker_stack_t* top = _msgpack_unpacker_stack_top(uk);
+    switch(top->type) {
+    case STACK_TYPE_ARRAY:
+        top->count--;
+        break;
+    case STACK_TYPE_MAP_KEY:
+        top->count--;
+        top->type = STACK_TYPE_MAP_VALUE;
+        break;
+    case STACK_TYPE_MAP_VALUE:
+        top->count--;
+        top->type = STACK_TYPE_MAP_KEY;
+        break;
+    case STACK_TYPE_MAP_KEY_INDEF:
+        top->type = STACK_TYPE_MAP_VALUE_INDEF;
+        break;
+    case STACK_TYPE_MAP_VALUE_INDEF:
+        top->type = STACK_TYPE_MAP_KEY_INDEF;
+        break;
+    default:
+        break;
+    }
+}
+
+static int dig_skip_item(msgpack_unpacker_t* uk)
+{
+    int r = msgpack_unpacker_skip(uk, uk->stack_depth);
+    if(r < 0) {
+        return r;
+    }
+    stack_item_done(uk);
+    return PRIMITIVE_OBJECT_COMPLETE;
+}
+
+/* IB_TEXTFLAG for the text strings (UTF-8 or US-ASCII) that dig paths
+ * match text string keys with, 0 for the binary ones that match byte
+ * strings, -1 for the others */
+static int dig_string_textflag(VALUE str)
+{
+#ifdef COMPAT_HAVE_ENCODING
+    int enc = ENCODING_GET(str);
+    if(enc == s_enc_ascii8bit) {
+        return 0;
+    }
+    if(enc == s_enc_utf8 || enc == s_enc_usascii) {
+        return IB_TEXTFLAG;
+    }
+    return -1;
+#else
+    UNUSED(str);
+    return IB_TEXTFLAG;
 #endif
-              rb_str_append(top->object, uk->last_object);
-              continue;
+}
+
+/* Reads the next map key and compares it with +name+.  Text and byte
+ * string keys in the top chunk are compared in place; other keys are
+ * decoded, unless they can't be equal to +name+. */
+static int dig_match_key(msgpack_unpacker_t* uk, VALUE name, bool* match)
+{
+    msgpack_buffer_t* b = UNPACKER_BUFFER_(uk);
+    size_t depth = uk->stack_depth;
+    msgpack_unpacker_ib_entry_t e;
+    uint64_t val;
+    int r;
+
+    int ib = read_head(uk, &e, &val);
+    if(ib < 0) {
+        return ib;
+    }
+
+    if(e.kind == IB_KIND_BREAK) {
+        return PRIMITIVE_INVALID_BYTE;
+    }
+
+    bool name_is_string = RB_TYPE_P(name, T_STRING);
+    int name_textflag = name_is_string ? dig_string_textflag(name) : -1;
+    *match = false;
+    if(e.kind == IB_KIND_STRING && name_is_string &&
+            val <= msgpack_buffer_top_readable_size(b)) {
+        *match = (ib & IB_TEXTFLAG) == name_textflag &&
+            val == (uint64_t) RSTRING_LEN(name) &&
+            memcmp(b->read_buffer, RSTRING_PTR(name), val) == 0;
+        _msgpack_buffer_consumed(b, val);
+        r = object_complete(uk, Qnil);
+    } else if((e.kind == IB_KIND_STRING || e.kind == IB_KIND_STRING_INDEF) != name_is_string) {
+        r = skip_from_head(uk, ib, e, val);
+        if(r == PRIMITIVE_CONTAINER_START) {
+            r = msgpack_unpacker_skip(uk, depth);
+        }
+    } else {
+        r = e.handler(uk, ib, val);
+        if(r == PRIMITIVE_CONTAINER_START) {
+            r = msgpack_unpacker_read(uk, depth);
+        }
+        if(r >= 0) {
+            VALUE key = uk->last_object;
+#ifdef HAVE_RB_SYM2STR
+            if(SYMBOL_P(key)) {
+                key = rb_sym2str(key);
             }
-            size_t count = --top->count;
+#endif
+            /* byte and text strings are different keys */
+            *match = (!RB_TYPE_P(key, T_STRING) || dig_string_textflag(key) == name_textflag) &&
+                rb_equal(key, name);
+        }
+    }
+    if(r < 0) {
+        return r;
+    }
+    stack_item_done(uk);
+    return PRIMITIVE_OBJECT_COMPLETE;
+}
 
-            if(count == 0) {
-            complete:;
-              object_complete(uk, top->object);
-            done:;
-                if(msgpack_unpacker_stack_pop(uk) <= target_stack_depth) {
-                    return PRIMITIVE_OBJECT_COMPLETE;
-                }
-                r = PRIMITIVE_OBJECT_COMPLETE;
-                goto container_completed;
+/* Positions the unpacker at the item addressed by +name+ inside the
+ * item whose head is ib/e/val.  Sets *found to false (and skips the
+ * item) if it isn't a container or doesn't have that member.  The item
+ * found is left pending: its container is told when it is done. */
+static int dig_enter(msgpack_unpacker_t* uk, VALUE name, int ib,
+        msgpack_unpacker_ib_entry_t e, uint64_t val, bool* found)
+{
+    size_t depth = uk->stack_depth;
+    int r;
+    *found = false;
+
+    switch(e.kind) {
+    case IB_KIND_ARRAY:
+    case IB_KIND_ARRAY_INDEF:
+        if(!FIXNUM_P(name) || FIX2LONG(name) < 0) {
+            break;
+        }
+        if(e.kind == IB_KIND_ARRAY) {
+            if(val == 0) {
+                return object_complete(uk, Qnil);
+            }
+            r = _msgpack_unpacker_stack_push(uk, STACK_TYPE_ARRAY, val, Qnil);
+        } else {
+            r = _msgpack_unpacker_stack_push(uk, STACK_TYPE_ARRAY_INDEF, 0, Qnil);
+        }
+        if(r < 0) {
+            return r;
+        }
+        long i;
+        for(i = FIX2LONG(name); ; i--) {
+            r = dig_has_next(uk);
+            if(r <= 0) {
+                return r;
+            }
+            if(i == 0) {
+                break;
+            }
+            r = dig_skip_item(uk);
+            if(r < 0) {
+                return r;
+            }
+        }
+        *found = true;
+        return PRIMITIVE_OBJECT_COMPLETE;
+
+    case IB_KIND_MAP:
+    case IB_KIND_MAP_INDEF:
+        if(e.kind == IB_KIND_MAP) {
+            if(val == 0) {
+                return object_complete(uk, Qnil);
+            }
+            if(val > SIZE_MAX / 2) {
+                return PRIMITIVE_EOF;
+            }
+            r = _msgpack_unpacker_stack_push(uk, STACK_TYPE_MAP_KEY, val*2, Qnil);
+        } else {
+            r = _msgpack_unpacker_stack_push(uk, STACK_TYPE_MAP_KEY_INDEF, 0, Qnil);
+        }
+        if(r < 0) {
+            return r;
+        }
+        while(true) {
+            bool match;
+            r = dig_has_next(uk);
+            if(r <= 0) {
+                return r;
+            }
+            r = dig_match_key(uk, name, &match);
+            if(r < 0) {
+                return r;
+            }
+            if(match) {
+                *found = true;
+                return PRIMITIVE_OBJECT_COMPLETE;
+            }
+            r = dig_skip_item(uk);
+            if(r < 0) {
+                return r;
+            }
+        }
+
+    case IB_KIND_BREAK:
+        return PRIMITIVE_INVALID_BYTE;
+
+    default:
+        break;
+    }
+
+    /* not a container of the right kind */
+    r = skip_from_head(uk, ib, e, val);
+    if(r == PRIMITIVE_CONTAINER_START) {
+        r = msgpack_unpacker_skip(uk, depth);
+    }
+    return r < 0 ? r : PRIMITIVE_OBJECT_COMPLETE;
+}
+
+/* Skips what is left of the containers entered by dig. */
+static int dig_leave(msgpack_unpacker_t* uk, size_t target_stack_depth)
+{
+    while(uk->stack_depth > target_stack_depth) {
+        while(true) {
+            int r = dig_has_next(uk);
+            if(r < 0) {
+                return r;
+            }
+            if(r == 0) {
+                break;
             }
+            r = dig_skip_item(uk);
+            if(r < 0) {
+                return r;
+            }
+        }
+        if(msgpack_unpacker_stack_pop(uk) > target_stack_depth) {
+            stack_item_done(uk);
         }
     }
+    return PRIMITIVE_OBJECT_COMPLETE;
 }
 
-int msgpack_unpacker_skip(msgpack_unpacker_t* uk, size_t target_stack_depth)
+int msgpack_unpacker_dig(msgpack_unpacker_t* uk, const VALUE* path, long path_length, bool* found)
 {
-    while(true) {
-        int r = read_primitive(uk);
+    size_t base = uk->stack_depth;
+    VALUE result = Qnil;
+    msgpack_unpacker_ib_entry_t e;
+    uint64_t val;
+    int r;
+    long i;
+
+    *found = true;
+    for(i = 0; i < path_length && *found; i++) {
+        int ib;
+        while((ib = read_head(uk, &e, &val)) >= 0 && e.kind == IB_KIND_TAG) {
+            /* tags are transparent on the way down */
+            reset_head_byte(uk);
+        }
+        if(ib < 0) {
+            return ib;
+        }
+        size_t depth = uk->stack_depth;
+        r = dig_enter(uk, path[i], ib, e, val, found);
         if(r < 0) {
             return r;
         }
-        if(r == PRIMITIVE_CONTAINER_START) {
-            continue;
+        if(uk->stack_depth == depth && depth > base) {
+            /* skipped without entering it */
+            stack_item_done(uk);
         }
-        /* PRIMITIVE_OBJECT_COMPLETE */
+    }
+
+    if(*found) {
+        r = msgpack_unpacker_read(uk, uk->stack_depth);
+        if(r < 0) {
+            return r;
+        }
+        result = uk->last_object;
+        if(uk->stack_depth > base) {
+            stack_item_done(uk);
+        }
+    }
+
+    r = dig_leave(uk, base);
+    if(r < 0) {
+        return r;
+    }
+    object_complete(uk, result);
+    return PRIMITIVE_OBJECT_COMPLETE;
+}
+
+/* pull parser: one event per call, containers stay on the stack */
+
+/* an item inside the container on top of the stack is complete; so
+ * are the tags around it */
+static void event_item_done(msgpack_unpacker_t* uk)
+{
+    while(uk->stack_depth > 0 && _msgpack_unpacker_stack_top(uk)->type == STACK_TYPE_TAG) {
+        msgpack_unpacker_stack_pop(uk);
+    }
+    if(uk->stack_depth == 0) {
+        return;
+    }
+    stack_item_done(uk);
+}
+
+int msgpack_unpacker_next_event(msgpack_unpacker_t* uk, int* event, VALUE* arg)
+{
+    msgpack_unpacker_ib_entry_t e;
+    uint64_t val;
+    int r;
+
+    /* resume a string that ran out of data */
+    size_t target = uk->stack_depth;
+    while(target > 0 && uk->stack[target-1].type == STACK_TYPE_STRING_INDEF) {
+        target--;
+    }
+    if(target < uk->stack_depth ||
+            (uk->head_byte != HEAD_BYTE_REQUIRED && uk->reading_raw_remaining > 0)) {
+        goto value;
+    }
 
-        if(msgpack_unpacker_stack_is_empty(uk)) {
+    if(uk->stack_depth > 0) {
+        msgpack_unpacker_stack_t* top = _msgpack_unpacker_stack_top(uk);
+        bool end = false;
+        switch(top->type) {
+        case STACK_TYPE_ARRAY:
+        case STACK_TYPE_MAP_KEY:
+        case STACK_TYPE_MAP_VALUE:
+            end = top->count == 0;
+            break;
+        case STACK_TYPE_ARRAY_INDEF:
+        case STACK_TYPE_MAP_KEY_INDEF:
+            r = get_head_byte(uk);
+            if(r < 0) {
+                return r;
+            }
+            end = r == IB_BREAK;
+            break;
+        default:
+            /* a break in STACK_TYPE_MAP_VALUE_INDEF is invalid */
+            break;
+        }
+        if(end) {
+            reset_head_byte(uk);
+            msgpack_unpacker_stack_pop(uk);
+            event_item_done(uk);
+            *event = MSGPACK_UNPACKER_EVENT_END;
+            *arg = Qnil;
             return PRIMITIVE_OBJECT_COMPLETE;
         }
+    }
 
-        container_completed:
-        {
-            msgpack_unpacker_stack_t* top = _msgpack_unpacker_stack_top(uk);
+    r = get_head_byte(uk);
+    if(r < 0) {
+        return r;
+    }
+    switch(IB_TABLE_ENTRY(r).kind) {
+    case IB_KIND_ARRAY:
+    case IB_KIND_ARRAY_INDEF:
+    case IB_KIND_MAP:
+    case IB_KIND_MAP_INDEF:
+    case IB_KIND_TAG:
+        break;
+    case IB_KIND_BREAK:
+        return PRIMITIVE_INVALID_BYTE;
+    default:
+        goto value;
+    }
 
-            /* this section optimized out */
-            // TODO object_complete still creates objects which should be optimized out
-            /* XXX: check INDEF! */
+    r = read_head(uk, &e, &val);
+    if(r < 0) {
+        return r;
+    }
+    switch(e.kind) {
+    case IB_KIND_ARRAY:
+        *event = MSGPACK_UNPACKER_EVENT_ARRAY_START;
+        *arg = rb_ull2inum(val);
+        return _msgpack_unpacker_stack_push(uk, STACK_TYPE_ARRAY, val, Qnil) < 0 ?
+            PRIMITIVE_STACK_TOO_DEEP : PRIMITIVE_OBJECT_COMPLETE;
+    case IB_KIND_MAP:
+        if(val > SIZE_MAX / 2) {
+            return PRIMITIVE_EOF;
+        }
+        *event = MSGPACK_UNPACKER_EVENT_MAP_START;
+        *arg = rb_ull2inum(val);
+        return _msgpack_unpacker_stack_push(uk, STACK_TYPE_MAP_KEY, val*2, Qnil) < 0 ?
+            PRIMITIVE_STACK_TOO_DEEP : PRIMITIVE_OBJECT_COMPLETE;
+    case IB_KIND_ARRAY_INDEF:
+        *event = MSGPACK_UNPACKER_EVENT_ARRAY_START;
+        *arg = Qnil;
+        return _msgpack_unpacker_stack_push(uk, STACK_TYPE_ARRAY_INDEF, 0, Qnil) < 0 ?
+            PRIMITIVE_STACK_TOO_DEEP : PRIMITIVE_OBJECT_COMPLETE;
+    case IB_KIND_MAP_INDEF:
+        *event = MSGPACK_UNPACKER_EVENT_MAP_START;
+        *arg = Qnil;
+        return _msgpack_unpacker_stack_push(uk, STACK_TYPE_MAP_KEY_INDEF, 0, Qnil) < 0 ?
+            PRIMITIVE_STACK_TOO_DEEP : PRIMITIVE_OBJECT_COMPLETE;
+    default: /* IB_KIND_TAG */
+        /* the tagged item must follow, and counts in place of the tag */
+        *event = MSGPACK_UNPACKER_EVENT_TAG;
+        *arg = rb_ull2inum(val);
+        return _msgpack_unpacker_stack_push_tag(uk, STACK_TYPE_TAG, 1, Qnil, val) < 0 ?
+            PRIMITIVE_STACK_TOO_DEEP : PRIMITIVE_OBJECT_COMPLETE;
+    }
 
-            size_t count = --top->count;
+value:
+    r = msgpack_unpacker_read(uk, target);
+    if(r < 0) {
+        return r;
+    }
+    event_item_done(uk);
+    *event = MSGPACK_UNPACKER_EVENT_VALUE;
+    *arg = uk->last_object;
+    return PRIMITIVE_OBJECT_COMPLETE;
+}
 
-            if(count == 0) {
-                object_complete(uk, Qnil);
-                if(msgpack_unpacker_stack_pop(uk) <= target_stack_depth) {
-                    return PRIMITIVE_OBJECT_COMPLETE;
-                }
-                goto container_completed;
+/* well-formedness check on bytes only; must not touch Ruby objects
+ * as it runs without the GVL */
+
+static bool validate_utf8(const unsigned char* p, size_t length)
+{
+    const unsigned char* const pend = p + length;
+    while(p < pend) {
+        unsigned char c = *p;
+        if(c < 0x80) {
+            p++;
+            continue;
+        }
+        size_t n;
+        unsigned int min;
+        unsigned int cp;
+        if(c >= 0xc2 && c <= 0xdf) {
+            n = 1; min = 0x80; cp = c & 0x1f;
+        } else if(c >= 0xe0 && c <= 0xef) {
+            n = 2; min = 0x800; cp = c & 0x0f;
+        } else if(c >= 0xf0 && c <= 0xf4) {
+            n = 3; min = 0x10000; cp = c & 0x07;
+        } else {
+            return false;
+        }
+        if((size_t)(pend - p) <= n) {
+            return false;
+        }
+        size_t i;
+        for(i = 1; i <= n; i++) {
+            if((p[i] & 0xc0) != 0x80) {
+                return false;
+            }
+            cp = (cp << 6) | (p[i] & 0x3f);
+        }
+        if(cp < min || cp > 0x10ffff || (cp >= 0xd800 && cp <= 0xdfff)) {
+            return false;
+        }
+        p += n + 1;
+    }
+    return true;
+}
+
+enum validate_frame_type_t {
+    VALIDATE_DEFINITE,          /* array, map or tag, remaining counts items */
+    VALIDATE_ARRAY_INDEF,
+    VALIDATE_MAP_INDEF,         /* remaining counts items for parity */
+    VALIDATE_STRING_INDEF,      /* mt holds the chunk major type */
+};
+
+typedef struct {
+    uint64_t remaining;
+    unsigned char type;
+    unsigned char mt;
+} validate_frame_t;
+
+int msgpack_unpacker_validate(const char* data, size_t length, int flags, size_t* offset)
+{
+    const unsigned char* const p = (const unsigned char*) data;
+    validate_frame_t stack[MSGPACK_UNPACKER_STACK_CAPACITY];
+    size_t depth = 0;
+    size_t pos = 0;
+    int r = PRIMITIVE_OBJECT_COMPLETE;
+
+    while(true) {
+        if(pos >= length) {
+            if(depth == 0 && (flags & MSGPACK_UNPACKER_VALIDATE_SEQUENCE)) {
+                break;          /* end of a sequence of complete items */
+            }
+            r = PRIMITIVE_EOF;
+            goto out;
+        }
+
+        int ib = p[pos];
+        msgpack_unpacker_ib_entry_t e = IB_TABLE_ENTRY(ib);
+        validate_frame_t* top = depth > 0 ? &stack[depth-1] : NULL;
+
+        if(e.kind == IB_KIND_BREAK) {
+            if(top == NULL || top->type == VALIDATE_DEFINITE ||
+                    (top->type == VALIDATE_MAP_INDEF && (top->remaining & 1))) {
+                r = PRIMITIVE_INVALID_BYTE;
+                goto out;
+            }
+            pos++;
+            depth--;
+            goto item_done;
+        }
+        if(top != NULL && top->type == VALIDATE_STRING_INDEF &&
+                (e.kind != IB_KIND_STRING || IB_MT(ib) != top->mt)) {
+            r = PRIMITIVE_INVALID_BYTE;
+            goto out;
+        }
+        if(e.kind == IB_KIND_INVALID) {
+            r = PRIMITIVE_INVALID_BYTE;
+            goto out;
+        }
+        if(length - pos <= e.arg_len) {
+            r = PRIMITIVE_EOF;
+            goto out;
+        }
+
+        uint64_t val = read_arg_direct(p + pos + 1, e.arg_len, ib);
+        size_t head = pos;
+        pos += 1 + e.arg_len;
+
+        switch(e.kind) {
+        case IB_KIND_SIMPLE:
+            if(!simple_is_well_formed(ib, val)) {
+                pos = head;
+                r = PRIMITIVE_INVALID_BYTE;
+                goto out;
+            }
+            break;
+        case IB_KIND_STRING:
+            if(val > length - pos) {
+                r = PRIMITIVE_EOF;
+                goto out;
+            }
+            if((flags & MSGPACK_UNPACKER_VALIDATE_UTF8) && IB_MT(ib) == MT_TEXT &&
+                    !validate_utf8(p + pos, (size_t) val)) {
+                pos = head;
+                r = PRIMITIVE_INVALID_UTF8;
+                goto out;
+            }
+            pos += (size_t) val;
+            break;
+        case IB_KIND_ARRAY:
+        case IB_KIND_MAP:
+            if(val == 0) {
+                break;
+            }
+            /* every item takes at least one byte */
+            if(val > length - pos || (e.kind == IB_KIND_MAP && val > (length - pos) / 2)) {
+                r = PRIMITIVE_EOF;
+                goto out;
+            }
+            /* fall through */
+        case IB_KIND_STRING_INDEF:
+        case IB_KIND_ARRAY_INDEF:
+        case IB_KIND_MAP_INDEF:
+        case IB_KIND_TAG:
+            /* tags take a stack level, as when decoding */
+            if(depth >= MSGPACK_UNPACKER_STACK_CAPACITY) {
+                pos = head;
+                r = PRIMITIVE_STACK_TOO_DEEP;
+                goto out;
+            }
+            top = &stack[depth++];
+            top->mt = IB_MT(ib);
+            top->remaining = 0;
+            if(e.kind == IB_KIND_ARRAY) {
+                top->type = VALIDATE_DEFINITE;
+                top->remaining = val;
+            } else if(e.kind == IB_KIND_MAP) {
+                top->type = VALIDATE_DEFINITE;
+                top->remaining = val * 2;
+            } else if(e.kind == IB_KIND_TAG) {
+                top->type = VALIDATE_DEFINITE;
+                top->remaining = 1;
+            } else if(e.kind == IB_KIND_STRING_INDEF) {
+                top->type = VALIDATE_STRING_INDEF;
+            } else if(e.kind == IB_KIND_ARRAY_INDEF) {
+                top->type = VALIDATE_ARRAY_INDEF;
+            } else {
+                top->type = VALIDATE_MAP_INDEF;
+            }
+            continue;
+        default:
+            /* numbers */
+            break;
+        }
+
+    item_done:
+        while(depth > 0) {
+            validate_frame_t* f = &stack[depth-1];
+            if(f->type != VALIDATE_DEFINITE) {
+                f->remaining++;
+                break;
+            }
+            if(--f->remaining > 0) {
+                break;
             }
+            depth--;
         }
+        if(depth == 0 && !(flags & MSGPACK_UNPACKER_VALIDATE_SEQUENCE)) {
+            break;
+        }
+    }
+
+    if(pos < length) {
+        r = PRIMITIVE_EXTRA_BYTES;
     }
+
+out:
+    *offset = pos;
+    return r;
 }
 
 /* dead code, but keep it for comparison purposes */
@@ -51,21 +51,73 @@ typedef struct {
     size_t count;
     enum stack_type_t type;
     VALUE object;
-    VALUE key;
+    size_t values_base;         /* first staged item in uk->values */
     uint64_t tag;               /* could be union... */
 } msgpack_unpacker_stack_t;
 
 #define MSGPACK_UNPACKER_STACK_SIZE (8+4+8+8+8)  /* assumes size_t <= 64bit, enum <= 32bit, VALUE <= 64bit */
 
+/* initial number of entries of the staging area for container items */
+#ifndef MSGPACK_UNPACKER_VALUES_INITIAL_CAPACITY
+#define MSGPACK_UNPACKER_VALUES_INITIAL_CAPACITY 64
+#endif
+
+/* read_all(limit:) preallocates its result for at most this many items */
+#ifndef MSGPACK_UNPACKER_READ_ALL_PREALLOCATE_MAX
+#define MSGPACK_UNPACKER_READ_ALL_PREALLOCATE_MAX 65536
+#endif
+
+#ifndef MSGPACK_UNPACKER_KEY_CACHE_DEFAULT_SIZE
+#define MSGPACK_UNPACKER_KEY_CACHE_DEFAULT_SIZE 256
+#endif
+
+#ifndef MSGPACK_UNPACKER_KEY_CACHE_MAX_SIZE
+#define MSGPACK_UNPACKER_KEY_CACHE_MAX_SIZE 65536
+#endif
+
+/* longer keys are never looked up in the key cache */
+#ifndef MSGPACK_UNPACKER_KEY_CACHE_MAX_LENGTH
+#define MSGPACK_UNPACKER_KEY_CACHE_MAX_LENGTH 64
+#endif
+
+/*
+ * With strict: :deterministic, the encoded bytes of the last key read in
+ * each map being read, kept to check that the next key sorts after it.
+ * Indexed like the stack.
+ */
+typedef struct {
+    size_t prev_key;            /* start in uk->key_bytes; empty if none */
+    const char* key_start;      /* of the key being read, NULL if unknown */
+    msgpack_buffer_chunk_t* key_chunk;
+} msgpack_unpacker_key_range_t;
+
+/*
+ * Direct-mapped cache of frozen map key Strings, indexed by a hash of
+ * the key bytes.  A colliding key simply replaces the previous entry.
+ */
+typedef struct {
+    VALUE* entries;             /* NULL if the cache is disabled */
+    size_t mask;                /* number of entries - 1 */
+    size_t hits;
+    size_t misses;
+} msgpack_unpacker_key_cache_t;
+
 struct msgpack_unpacker_t {
     msgpack_buffer_t buffer;
 
     unsigned int head_byte;
 
     msgpack_unpacker_stack_t* stack;
+    struct msgpack_rmem_pool_t* stack_pool;
     size_t stack_depth;
     size_t stack_capacity;
 
+    /* items of the arrays and maps being read, made into an Array or
+     * Hash of the right size once the container is complete */
+    VALUE* values;
+    size_t values_length;
+    size_t values_capacity;
+
     VALUE last_object;
 
     VALUE reading_raw;
@@ -73,7 +125,17 @@ struct msgpack_unpacker_t {
     int textflag;
 
   bool keys_as_symbols;         /* Experimental */
+    bool freeze;                  /* interned Strings, frozen containers */
+    int typed_arrays;             /* MSGPACK_TYPED_ARRAYS_* */
+    bool deterministic;           /* strict: :deterministic */
+
+    msgpack_unpacker_key_range_t* key_ranges;
+    char* key_bytes;
+    size_t key_bytes_length;
+    size_t key_bytes_capacity;
   
+    msgpack_unpacker_key_cache_t key_cache;
+
     VALUE buffer_ref;
 };
 
@@ -101,6 +163,15 @@ void msgpack_unpacker_mark(msgpack_unpacker_t* uk);
 
 void msgpack_unpacker_reset(msgpack_unpacker_t* uk);
 
+/* true unless an item has been partially read */
+bool msgpack_unpacker_is_between_items(msgpack_unpacker_t* uk);
+
+/* size 0 disables the cache; other sizes are rounded up to a power of 2 */
+void msgpack_unpacker_set_key_cache_size(msgpack_unpacker_t* uk, size_t size);
+
+/* checks core deterministic encoding (RFC 8949, section 4.2.1) while reading */
+void msgpack_unpacker_set_deterministic(msgpack_unpacker_t* uk, bool deterministic);
+
 
 /* error codes */
 #define PRIMITIVE_CONTAINER_START 1
@@ -110,17 +181,49 @@ void msgpack_unpacker_reset(msgpack_unpacker_t* uk);
 #define PRIMITIVE_STACK_TOO_DEEP -3
 #define PRIMITIVE_UNEXPECTED_TYPE -4
 #define PRIMITIVE_BREAK 2
+#define PRIMITIVE_INVALID_UTF8 -5
+#define PRIMITIVE_EXTRA_BYTES -6
+#define PRIMITIVE_NOT_DETERMINISTIC -7
 
 int msgpack_unpacker_read(msgpack_unpacker_t* uk, size_t target_stack_depth);
 
 int msgpack_unpacker_skip(msgpack_unpacker_t* uk, size_t target_stack_depth);
 
+/* Reads the item at +path+ (Integer array indexes and map keys) inside
+ * the next item into last_object, skipping the rest of that item.  If
+ * there is no such item, *found is false and last_object is nil. */
+int msgpack_unpacker_dig(msgpack_unpacker_t* uk, const VALUE* path, long path_length, bool* found);
+
+/* pull parser events */
+#define MSGPACK_UNPACKER_EVENT_VALUE 0
+#define MSGPACK_UNPACKER_EVENT_ARRAY_START 1
+#define MSGPACK_UNPACKER_EVENT_MAP_START 2
+#define MSGPACK_UNPACKER_EVENT_TAG 3
+#define MSGPACK_UNPACKER_EVENT_END 4
+#define MSGPACK_UNPACKER_EVENT_COUNT 5
+
+/* Reads the next event: the start of an array or map (arg: number of
+ * items or pairs, nil if indefinite), a tag (arg: tag number), a
+ * complete scalar or string (arg: the value) or the end of the
+ * innermost container (arg: nil).  Containers are tracked on the
+ * unpacker stack, so memory use does not depend on their size. */
+int msgpack_unpacker_next_event(msgpack_unpacker_t* uk, int* event, VALUE* arg);
+
 static inline VALUE msgpack_unpacker_get_last_object(msgpack_unpacker_t* uk)
 {
     return uk->last_object;
 }
 
 
+#define MSGPACK_UNPACKER_VALIDATE_UTF8 1      /* check text strings */
+#define MSGPACK_UNPACKER_VALIDATE_SEQUENCE 2  /* any number of items */
+
+/* Checks that +data+ is one well-formed CBOR item (or a sequence of
+ * them).  Returns PRIMITIVE_OBJECT_COMPLETE or an error code, with the
+ * offset of the offending head in *offset.  Does not use the Ruby API,
+ * so it can run without the GVL. */
+int msgpack_unpacker_validate(const char* data, size_t length, int flags, size_t* offset);
+
 int msgpack_unpacker_peek_next_object_type(msgpack_unpacker_t* uk);
 
 int msgpack_unpacker_skip_nil(msgpack_unpacker_t* uk);
@@ -27,7 +27,16 @@
 
 #include "unpacker.h"
 #include "unpacker_class.h"
+#include "typed_array.h"
 #include "buffer_class.h"
+#ifdef HAVE_RB_THREAD_CALL_WITHOUT_GVL
+#include "ruby/thread.h"
+#endif
+
+/* inputs at least this long are validated without the GVL */
+#ifndef MSGPACK_UNPACKER_VALIDATE_NOGVL_THRESHOLD
+#define MSGPACK_UNPACKER_VALIDATE_NOGVL_THRESHOLD (16*1024)
+#endif
 
 VALUE cMessagePack_Unpacker;
 
@@ -39,6 +48,8 @@ static VALUE eMalformedFormatError;
 static VALUE eStackError;
 static VALUE eTypeError;
 
+static VALUE s_event_symbols[MSGPACK_UNPACKER_EVENT_COUNT];
+
 #define UNPACKER(from, name) \
     msgpack_unpacker_t *name = NULL; \
     Data_Get_Struct(from, msgpack_unpacker_t, name); \
@@ -67,6 +78,53 @@ static VALUE Unpacker_alloc(VALUE klass)
     return self;
 }
 
+static void Unpacker_set_options(msgpack_unpacker_t* uk, VALUE options)
+{
+    VALUE v;
+
+    v = rb_hash_aref(options, ID2SYM(rb_intern("symbolize_keys")));
+    uk->keys_as_symbols = RTEST(v);
+
+    v = rb_hash_aref(options, ID2SYM(rb_intern("freeze")));
+    uk->freeze = RTEST(v);
+
+    /* symbolized keys are cached unless asked otherwise */
+    v = rb_hash_lookup2(options, ID2SYM(rb_intern("key_cache")),
+            uk->keys_as_symbols ? Qtrue : Qnil);
+    if(v == Qtrue) {
+        msgpack_unpacker_set_key_cache_size(uk, MSGPACK_UNPACKER_KEY_CACHE_DEFAULT_SIZE);
+    } else if(RTEST(v)) {
+        long size = NUM2LONG(v);
+        if(size < 0) {
+            rb_raise(rb_eArgError, "key_cache size must not be negative");
+        }
+        msgpack_unpacker_set_key_cache_size(uk, (size_t) size);
+    } else {
+        msgpack_unpacker_set_key_cache_size(uk, 0);
+    }
+
+    v = rb_hash_aref(options, ID2SYM(rb_intern("typed_arrays")));
+    if(!RTEST(v)) {
+        uk->typed_arrays = MSGPACK_TYPED_ARRAYS_TAGGED;
+    } else if(v == ID2SYM(rb_intern("packed"))) {
+        uk->typed_arrays = MSGPACK_TYPED_ARRAYS_PACKED;
+    } else if(v == ID2SYM(rb_intern("array")) || v == Qtrue) {
+        /* true as for the packer: typed arrays come back as Arrays */
+        uk->typed_arrays = MSGPACK_TYPED_ARRAYS_ARRAY;
+    } else {
+        rb_raise(rb_eArgError, "typed_arrays must be :packed, :array, true or nil");
+    }
+
+    v = rb_hash_aref(options, ID2SYM(rb_intern("strict")));
+    if(!RTEST(v)) {
+        msgpack_unpacker_set_deterministic(uk, false);
+    } else if(v == ID2SYM(rb_intern("deterministic"))) {
+        msgpack_unpacker_set_deterministic(uk, true);
+    } else {
+        rb_raise(rb_eArgError, "strict must be :deterministic or nil");
+    }
+}
+
 static VALUE Unpacker_initialize(int argc, VALUE* argv, VALUE self)
 {
     VALUE io = Qnil;
@@ -98,14 +156,10 @@ static VALUE Unpacker_initialize(int argc, VALUE* argv, VALUE self)
     if(io != Qnil || options != Qnil) {
         MessagePack_Buffer_initialize(UNPACKER_BUFFER_(uk), io, options);
         if (options != Qnil) {
-          VALUE v;
-          v = rb_hash_aref(options, ID2SYM(rb_intern("symbolize_keys")));
-          uk->keys_as_symbols = RTEST(v);
+            Unpacker_set_options(uk, options);
         }
     }
 
-    // TODO options
-
     return self;
 }
 
@@ -120,6 +174,12 @@ static void raise_unpacker_error(int r)
         rb_raise(eStackError, "stack level too deep");
     case PRIMITIVE_UNEXPECTED_TYPE:
         rb_raise(eTypeError, "unexpected type");
+    case PRIMITIVE_INVALID_UTF8:
+        rb_raise(eMalformedFormatError, "invalid UTF-8 in text string");
+    case PRIMITIVE_EXTRA_BYTES:
+        rb_raise(eMalformedFormatError, "extra bytes follow after a deserialized object");
+    case PRIMITIVE_NOT_DETERMINISTIC:
+        rb_raise(eMalformedFormatError, "not in deterministic encoding");
     default:
         rb_raise(eUnpackError, "logically unknown error %d", r);
     }
@@ -155,6 +215,47 @@ static VALUE Unpacker_skip(VALUE self)
     return Qnil;
 }
 
+/* Symbols in the path stand for text string map keys */
+static VALUE dig_path_new(int argc, VALUE* argv)
+{
+    VALUE path = rb_ary_new2(argc);
+    int i;
+    for(i = 0; i < argc; i++) {
+        VALUE v = argv[i];
+        if(SYMBOL_P(v)) {
+            v = rb_sym2str(v);
+        }
+        rb_ary_push(path, v);
+    }
+    return path;
+}
+
+static VALUE Unpacker_dig_path(msgpack_unpacker_t* uk, VALUE path)
+{
+    bool found;
+    int r = msgpack_unpacker_dig(uk, RARRAY_PTR(path), RARRAY_LEN(path), &found);
+    if(r < 0) {
+        raise_unpacker_error(r);
+    }
+    RB_GC_GUARD(path);
+    return msgpack_unpacker_get_last_object(uk);
+}
+
+/* dig and next_event do not check map key order */
+static void raise_if_strict(msgpack_unpacker_t* uk, const char* method)
+{
+    if(uk->deterministic) {
+        rb_raise(rb_eArgError, "%s does not support strict: :deterministic", method);
+    }
+}
+
+static VALUE Unpacker_dig(int argc, VALUE* argv, VALUE self)
+{
+    UNPACKER(self, uk);
+    raise_if_strict(uk, "dig");
+    return Unpacker_dig_path(uk, dig_path_new(argc, argv));
+}
+
 static VALUE Unpacker_skip_nil(VALUE self)
 {
     UNPACKER(self, uk);
@@ -227,6 +328,63 @@ static VALUE Unpacker_peek_next_type(VALUE self)
 }
 #endif
 
+static VALUE Unpacker_next_event(VALUE self)
+{
+    UNPACKER(self, uk);
+    raise_if_strict(uk, "next_event");
+
+    int event;
+    VALUE arg;
+    int r = msgpack_unpacker_next_event(uk, &event, &arg);
+    if(r < 0) {
+        raise_unpacker_error(r);
+    }
+
+    if(event == MSGPACK_UNPACKER_EVENT_END) {
+        return rb_ary_new3(1, s_event_symbols[event]);
+    }
+    return rb_ary_new3(2, s_event_symbols[event], arg);
+}
+
+static VALUE Unpacker_next_events(int argc, VALUE* argv, VALUE self)
+{
+    VALUE events;
+    long limit = 1024;
+
+    switch(argc) {
+    case 2:
+        limit = NUM2LONG(argv[1]);
+        /* fall through */
+    case 1:
+        events = argv[0];
+        break;
+    default:
+        rb_raise(rb_eArgError, "wrong number of arguments (%d for 1..2)", argc);
+    }
+    Check_Type(events, T_ARRAY);
+
+    UNPACKER(self, uk);
+    raise_if_strict(uk, "next_events");
+
+    rb_ary_clear(events);
+    long n;
+    for(n = 0; n < limit; n++) {
+        int event;
+        VALUE arg;
+        int r = msgpack_unpacker_next_event(uk, &event, &arg);
+        if(r < 0) {
+            if(r == PRIMITIVE_EOF) {
+                break;
+            }
+            raise_unpacker_error(r);
+        }
+        rb_ary_push(events, s_event_symbols[event]);
+        rb_ary_push(events, arg);
+    }
+
+    return LONG2NUM(n);
+}
+
 static VALUE Unpacker_feed(VALUE self, VALUE data)
 {
     UNPACKER(self, uk);
@@ -293,6 +451,107 @@ static VALUE Unpacker_feed_each(VALUE self, VALUE data)
     return Unpacker_each(self);
 }
 
+static VALUE Unpacker_key_cache_stats(VALUE self)
+{
+    UNPACKER(self, uk);
+
+    msgpack_unpacker_key_cache_t* kc = &uk->key_cache;
+    VALUE stats = rb_hash_new();
+    rb_hash_aset(stats, ID2SYM(rb_intern("size")),
+            SIZET2NUM(kc->entries == NULL ? 0 : kc->mask + 1));
+    rb_hash_aset(stats, ID2SYM(rb_intern("hits")), SIZET2NUM(kc->hits));
+    rb_hash_aset(stats, ID2SYM(rb_intern("misses")), SIZET2NUM(kc->misses));
+    return stats;
+}
+
+struct read_all_args {
+    msgpack_unpacker_t* uk;
+    VALUE array;
+    long limit;                 /* negative for no limit */
+};
+
+static long read_all_limit(VALUE options)
+{
+    if(options == Qnil) {
+        return -1;
+    }
+    VALUE v = rb_hash_aref(options, ID2SYM(rb_intern("limit")));
+    if(v == Qnil) {
+        return -1;
+    }
+    long limit = NUM2LONG(v);
+    if(limit < 0) {
+        rb_raise(rb_eArgError, "limit must not be negative");
+    }
+    return limit;
+}
+
+static VALUE Unpacker_read_all_impl(VALUE arg)
+{
+    struct read_all_args* args = (struct read_all_args*) arg;
+    msgpack_unpacker_t* uk = args->uk;
+
+    while(args->limit < 0 || RARRAY_LEN(args->array) < args->limit) {
+        int r = msgpack_unpacker_read(uk, 0);
+        if(r < 0) {
+            if(r == PRIMITIVE_EOF) {
+                break;
+            }
+            raise_unpacker_error(r);
+        }
+        rb_ary_push(args->array, msgpack_unpacker_get_last_object(uk));
+    }
+    return args->array;
+}
+
+static VALUE Unpacker_read_all_rescue_EOFError(VALUE arg, VALUE error)
+{
+    UNUSED(error);
+    return ((struct read_all_args*) arg)->array;
+}
+
+/* room for the items read_all returns when the caller limits them;
+ * every item takes at least one byte of the buffer, unless more is read
+ * from the IO */
+static long read_all_capacity(msgpack_unpacker_t* uk, long limit)
+{
+    msgpack_buffer_t* b = UNPACKER_BUFFER_(uk);
+    if(limit <= 0) {
+        return 0;
+    }
+    if(limit > MSGPACK_UNPACKER_READ_ALL_PREALLOCATE_MAX) {
+        limit = MSGPACK_UNPACKER_READ_ALL_PREALLOCATE_MAX;
+    }
+    if(!msgpack_buffer_has_io(b) && (size_t) limit > msgpack_buffer_all_readable_size(b)) {
+        limit = (long) msgpack_buffer_all_readable_size(b);
+    }
+    return limit;
+}
+
+static VALUE Unpacker_read_all_array(msgpack_unpacker_t* uk, long limit)
+{
+    struct read_all_args args = { uk, rb_ary_new_capa(read_all_capacity(uk, limit)), limit };
+
+    if(msgpack_buffer_has_io(UNPACKER_BUFFER_(uk))) {
+        /* rescue EOFError only if io is set */
+        rb_rescue2(Unpacker_read_all_impl, (VALUE) &args,
+                Unpacker_read_all_rescue_EOFError, (VALUE) &args,
+                rb_eEOFError, NULL);
+    } else {
+        Unpacker_read_all_impl((VALUE) &args);
+    }
+    return args.array;
+}
+
+static VALUE Unpacker_read_all(int argc, VALUE* argv, VALUE self)
+{
+    VALUE options = Qnil;
+    rb_scan_args(argc, argv, "0:", &options);
+
+    UNPACKER(self, uk);
+    return Unpacker_read_all_array(uk, read_all_limit(options));
+}
+
 static VALUE Unpacker_reset(VALUE self)
 {
     UNPACKER(self, uk);
@@ -311,15 +570,13 @@ VALUE MessagePack_unpack(int argc, VALUE* argv)
     switch(argc) {
     case 2:
       options = argv[1];        /* Experimental! */
-      if (options == ID2SYM(rb_intern("keys_as_symbols"))) /* backward compat */
+      if (options == ID2SYM(rb_intern("keys_as_symbols"))) { /* backward compat */
         keys_as_symbols = true;
-      else if (options != Qnil) {
-        VALUE v;
+        options = Qnil;
+      } else if (options != Qnil) {
         if (!RB_TYPE_P(options, T_HASH)) {
           rb_raise(rb_eArgError, "expected Hash but found %s.", rb_obj_classname(options));
         }
-        v = rb_hash_aref(options, ID2SYM(rb_intern("symbolize_keys")));
-        keys_as_symbols = RTEST(v);
       }
       /* fall through */
     case 1:
@@ -344,7 +601,13 @@ VALUE MessagePack_unpack(int argc, VALUE* argv)
     msgpack_buffer_set_write_reference_threshold(UNPACKER_BUFFER_(uk), 0);
 
     uk->keys_as_symbols = keys_as_symbols;
-    
+    if(keys_as_symbols) {
+        msgpack_unpacker_set_key_cache_size(uk, MSGPACK_UNPACKER_KEY_CACHE_DEFAULT_SIZE);
+    }
+    if(options != Qnil) {
+        Unpacker_set_options(uk, options);
+    }
+
     if(io != Qnil) {
         MessagePack_Buffer_initialize(UNPACKER_BUFFER_(uk), io, Qnil);
     }
@@ -373,6 +636,156 @@ VALUE MessagePack_unpack(int argc, VALUE* argv)
     return msgpack_unpacker_get_last_object(uk);
 }
 
+static VALUE MessagePack_dig_module_method(int argc, VALUE* argv, VALUE mod)
+{
+    UNUSED(mod);
+
+    if(argc < 1) {
+        rb_raise(rb_eArgError, "wrong number of arguments (%d for 1+)", argc);
+    }
+    VALUE src = argv[0];
+    StringValue(src);
+
+    VALUE path = dig_path_new(argc - 1, argv + 1);
+    VALUE self = Unpacker_alloc(cMessagePack_Unpacker);
+    UNPACKER(self, uk);
+
+    msgpack_buffer_set_write_reference_threshold(UNPACKER_BUFFER_(uk), 0);
+    msgpack_buffer_append_string(UNPACKER_BUFFER_(uk), src);
+
+    VALUE v = Unpacker_dig_path(uk, path);
+
+    /* raise if extra bytes follow */
+    if(msgpack_buffer_top_readable_size(UNPACKER_BUFFER_(uk)) > 0) {
+        rb_raise(eMalformedFormatError, "extra bytes follow after a deserialized object");
+    }
+
+    RB_GC_GUARD(self);
+    return v;
+}
+
+static VALUE MessagePack_decode_sequence_module_method(int argc, VALUE* argv, VALUE mod)
+{
+    UNUSED(mod);
+
+    VALUE src;
+    VALUE options = Qnil;
+    rb_scan_args(argc, argv, "1:", &src, &options);
+    StringValue(src);
+
+    long limit = read_all_limit(options);
+
+    VALUE self = Unpacker_alloc(cMessagePack_Unpacker);
+    UNPACKER(self, uk);
+    if(options != Qnil) {
+        Unpacker_set_options(uk, options);
+    }
+
+    /* prefer reference than copying */
+    msgpack_buffer_set_write_reference_threshold(UNPACKER_BUFFER_(uk), 0);
+    msgpack_buffer_append_string(UNPACKER_BUFFER_(uk), src);
+
+    VALUE array = Unpacker_read_all_array(uk, limit);
+
+    /* a sequence must not end in the middle of an item */
+    if(!msgpack_unpacker_is_between_items(uk)) {
+        raise_unpacker_error(PRIMITIVE_EOF);
+    }
+
+    RB_GC_GUARD(self);
+    return array;
+}
+
+void MessagePack_raise_validate_error(int r, size_t offset)
+{
+    switch(r) {
+    case PRIMITIVE_EOF:
+        rb_raise(rb_eEOFError, "end of buffer reached at offset %zu", offset);
+    case PRIMITIVE_STACK_TOO_DEEP:
+        rb_raise(eStackError, "stack level too deep at offset %zu", offset);
+    case PRIMITIVE_INVALID_UTF8:
+        rb_raise(eMalformedFormatError, "invalid UTF-8 in text string at offset %zu", offset);
+    case PRIMITIVE_EXTRA_BYTES:
+        rb_raise(eMalformedFormatError, "extra bytes follow after a deserialized object at offset %zu", offset);
+    default:
+        rb_raise(eMalformedFormatError, "invalid byte at offset %zu", offset);
+    }
+}
+
+struct validate_args {
+    VALUE src;
+    const char* ptr;            /* of src, taken while holding the GVL */
+    size_t length;
+    int flags;
+    size_t offset;
+    int result;
+};
+
+static void* validate_nogvl(void* arg)
+{
+    struct validate_args* args = (struct validate_args*) arg;
+    args->result = msgpack_unpacker_validate(args->ptr, args->length, args->flags, &args->offset);
+    return NULL;
+}
+
+
+static void validate_string(int argc, VALUE* argv, struct validate_args* args)
+{
+    VALUE options = Qnil;
+    rb_scan_args(argc, argv, "1:", &args->src, &options);
+    StringValue(args->src);
+
+    args->flags = 0;
+    args->offset = 0;
+    if(options != Qnil) {
+        if(RTEST(rb_hash_aref(options, ID2SYM(rb_intern("utf8"))))) {
+            args->flags |= MSGPACK_UNPACKER_VALIDATE_UTF8;
+        }
+        if(RTEST(rb_hash_aref(options, ID2SYM(rb_intern("sequence"))))) {
+            args->flags |= MSGPACK_UNPACKER_VALIDATE_SEQUENCE;
+        }
+    }
+
+    args->ptr = RSTRING_PTR(args->src);
+    args->length = RSTRING_LEN(args->src);
+
+#ifdef HAVE_RB_THREAD_CALL_WITHOUT_GVL
+    if(args->length >= MSGPACK_UNPACKER_VALIDATE_NOGVL_THRESHOLD) {
+        /* other threads may modify the string meanwhile: validate a
+         * frozen copy, which shares the bytes until then */
+        args->src = rb_str_new_frozen(args->src);
+        args->ptr = RSTRING_PTR(args->src);
+        /* a CPU-bound loop that can't be interrupted, so no unblocking
+         * function; it is linear in the length */
+        rb_thread_call_without_gvl(validate_nogvl, args, NULL, NULL);
+        RB_GC_GUARD(args->src);
+        return;
+    }
+#endif
+    validate_nogvl(args);
+}
+
+static VALUE MessagePack_valid_p_module_method(int argc, VALUE* argv, VALUE mod)
+{
+    UNUSED(mod);
+
+    struct validate_args args;
+    validate_string(argc, argv, &args);
+    return args.result == PRIMITIVE_OBJECT_COMPLETE ? Qtrue : Qfalse;
+}
+
+static VALUE MessagePack_validate_bang_module_method(int argc, VALUE* argv, VALUE mod)
+{
+    UNUSED(mod);
+
+    struct validate_args args;
+    validate_string(argc, argv, &args);
+    if(args.result != PRIMITIVE_OBJECT_COMPLETE) {
+        MessagePack_raise_validate_error(args.result, args.offset);
+    }
+    return Qtrue;
+}
+
 static VALUE MessagePack_load_module_method(int argc, VALUE* argv, VALUE mod)
 {
     UNUSED(mod);
@@ -401,19 +814,30 @@ void MessagePack_Unpacker_module_init(VALUE mMessagePack)
 
     rb_define_alloc_func(cMessagePack_Unpacker, Unpacker_alloc);
 
+    s_event_symbols[MSGPACK_UNPACKER_EVENT_VALUE] = ID2SYM(rb_intern("value"));
+    s_event_symbols[MSGPACK_UNPACKER_EVENT_ARRAY_START] = ID2SYM(rb_intern("array_start"));
+    s_event_symbols[MSGPACK_UNPACKER_EVENT_MAP_START] = ID2SYM(rb_intern("map_start"));
+    s_event_symbols[MSGPACK_UNPACKER_EVENT_TAG] = ID2SYM(rb_intern("tag"));
+    s_event_symbols[MSGPACK_UNPACKER_EVENT_END] = ID2SYM(rb_intern("end"));
+
     rb_define_method(cMessagePack_Unpacker, "initialize", Unpacker_initialize, -1);
     rb_define_method(cMessagePack_Unpacker, "buffer", Unpacker_buffer, 0);
     rb_define_method(cMessagePack_Unpacker, "read", Unpacker_read, 0);
     rb_define_alias(cMessagePack_Unpacker, "unpack", "read");
+    rb_define_method(cMessagePack_Unpacker, "read_all", Unpacker_read_all, -1);
     rb_define_method(cMessagePack_Unpacker, "skip", Unpacker_skip, 0);
     rb_define_method(cMessagePack_Unpacker, "skip_nil", Unpacker_skip_nil, 0);
+    rb_define_method(cMessagePack_Unpacker, "dig", Unpacker_dig, -1);
     rb_define_method(cMessagePack_Unpacker, "read_array_header", Unpacker_read_array_header, 0);
     rb_define_method(cMessagePack_Unpacker, "read_map_header", Unpacker_read_map_header, 0);
     //rb_define_method(cMessagePack_Unpacker, "peek_next_type", Unpacker_peek_next_type, 0);  // TODO
+    rb_define_method(cMessagePack_Unpacker, "next_event", Unpacker_next_event, 0);
+    rb_define_method(cMessagePack_Unpacker, "next_events", Unpacker_next_events, -1);
     rb_define_method(cMessagePack_Unpacker, "feed", Unpacker_feed, 1);
     rb_define_method(cMessagePack_Unpacker, "each", Unpacker_each, 0);
     rb_define_method(cMessagePack_Unpacker, "feed_each", Unpacker_feed_each, 1);
     rb_define_method(cMessagePack_Unpacker, "reset", Unpacker_reset, 0);
+    rb_define_method(cMessagePack_Unpacker, "key_cache_stats", Unpacker_key_cache_stats, 0);
 
     //s_unpacker_value = Unpacker_alloc(cMessagePack_Unpacker);
     //rb_gc_register_address(&s_unpacker_value);
@@ -425,5 +849,9 @@ void MessagePack_Unpacker_module_init(VALUE mMessagePack)
     rb_define_module_function(mMessagePack, "load", MessagePack_load_module_method, -1);
     rb_define_module_function(mMessagePack, "unpack", MessagePack_unpack_module_method, -1);
     rb_define_module_function(mMessagePack, "decode", MessagePack_unpack_module_method, -1);
+    rb_define_module_function(mMessagePack, "dig", MessagePack_dig_module_method, -1);
+    rb_define_module_function(mMessagePack, "decode_sequence", MessagePack_decode_sequence_module_method, -1);
+    rb_define_module_function(mMessagePack, "valid?", MessagePack_valid_p_module_method, -1);
+    rb_define_module_function(mMessagePack, "validate!", MessagePack_validate_bang_module_method, -1);
 }
 
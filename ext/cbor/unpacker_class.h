@@ -35,5 +35,8 @@ void MessagePack_Unpacker_module_init(VALUE mMessagePack);
 
 VALUE MessagePack_unpack(int argc, VALUE* argv);
 
+/* raises the error for a msgpack_unpacker_validate result */
+NORETURN(void MessagePack_raise_validate_error(int r, size_t offset));
+
 #endif
 
@@ -4,3 +4,4 @@ begin
 rescue LoadError
   require "cbor/cbor"
 end
+require "cbor/parallel"
@@ -0,0 +1,45 @@
+require "etc"
+
+module CBOR
+  # Inputs are not split into slices smaller than this (in bytes); for
+  # less data, starting a Ractor costs more than decoding in place.
+  PARALLEL_DECODE_MIN_SLICE = 64 * 1024
+
+  # Decodes a CBOR sequence like CBOR.decode_sequence, but splits _string_
+  # at item boundaries into up to _workers_ slices of about the same size
+  # and decodes them in parallel Ractors.  Falls back to decode_sequence
+  # where Ractors are not available or the input is small.
+  def self.parallel_decode_sequence(string, workers: Etc.nprocessors, **options)
+    workers = [workers, string.bytesize / PARALLEL_DECODE_MIN_SLICE].min
+    if workers <= 1 || !defined?(Ractor)
+      return decode_sequence(string, **options)
+    end
+
+    offsets = SequenceIndex.build(string).offsets
+    bounds = [0]
+    (1...workers).each do |k|
+      cut = k * string.bytesize / workers
+      i = offsets.bsearch_index { |o| o >= cut }
+      break unless i
+      bounds << offsets[i] if offsets[i] > bounds.last
+    end
+    bounds << string.bytesize
+
+    options = Ractor.make_shareable(options)
+    ractors = bounds.each_cons(2).map do |from, to|
+      slice = string.byteslice(from, to - from).freeze
+      Ractor.new(slice, options) do |s, opts|
+        CBOR.decode_sequence(s, **opts)
+      end
+    end
+
+    ractors.each_with_object([]) do |r, result|
+      begin
+        result.concat(r.take)
+      rescue Ractor::RemoteError => e
+        # the worker's own error, not one caused by it
+        raise e.cause, cause: nil
+      end
+    end
+  end
+end
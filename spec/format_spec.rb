@@ -268,6 +268,26 @@ describe MessagePack do
     check 3005, 256**3000+4711       # 3001 bignum, 3 string, 1 tag
   end
 
+  it "negative bignums at byte boundaries" do
+    (-2**64).to_cbor.should == "\x3b\xff\xff\xff\xff\xff\xff\xff\xff".b
+    (-(256**9)).to_cbor.should == "\xc3\x49".b + "\xff".b * 9
+    (-(256**9) - 1).to_cbor.should == "\xc3\x4a\x01".b + "\x00".b * 9
+    [-(2**4096), -(2**4096) - 1, -(2**4095) + 12345, 2**4096 - 1].each do |v|
+      CBOR.decode(v.to_cbor).should == v
+    end
+    CBOR.decode("\xc3\x40".b).should == -1
+    CBOR.decode("\xc3\x43\x00\x00\xff".b).should == -256
+    CBOR.decode("\xc3\x5f\x41\x01\x41\x00\xff".b).should == -257
+  end
+
+  it "bignums fed in pieces" do
+    values = [2**100, -(2**200), 2**64, -(2**64) - 1]
+    objects = []
+    unpacker = MessagePack::Unpacker.new
+    values.to_cbor.each_char { |c| unpacker.feed_each(c) { |o| objects << o } }
+    objects.should == [values]
+  end
+
   it "fixnum/bignum switch" do
     CBOR.encode(CBOR.decode("\xc2\x40")).should == "\x00".b
     CBOR.encode(CBOR.decode("\xc2\x41\x00")).should == "\x00".b
@@ -435,6 +455,21 @@ describe MessagePack do
     }.should raise_error(MessagePack::MalformedFormatError)
   end
 
+  it "reserved initial bytes" do
+    (0..7).each do |mt|
+      [28, 29, 30].each do |ai|
+        lambda {
+          check_decode (mt << 5 | ai).chr + "\x00" * 8, nil
+        }.should raise_error(MessagePack::MalformedFormatError)
+      end
+    end
+    [0x1f, 0x3f, 0xdf].each do |ib|
+      lambda {
+        check_decode ib.chr + "\x00", nil
+      }.should raise_error(MessagePack::MalformedFormatError)
+    end
+  end
+
   it "Tagged" do
     expect { check 10, CBOR::Tagged.new("foo", 2) }.to raise_error(TypeError)
     check 2, CBOR::Tagged.new(10, 2)
@@ -447,6 +482,29 @@ describe MessagePack do
   it "Time" do
     check_decode "\xc1\x19\x12\x67", Time.at(4711)
     check 6, Time.at(Time.now.to_i)
+    check_decode "\xc1\xf9\x3e\x00", Time.at(1.5)
+    check_decode "\xc1\x3a\x80\x00\x00\x00", Time.at(-2**31 - 1)
+    check 4, Time.at(-1.25)
+    Time.at(1_363_896_240, 500, :millisecond).to_cbor.should == "\xc1\xfb\x41\xd4\x52\xd9\xec\x20\x00\x00".b
+    # outside the range of time_t: a bignum epoch
+    Time.at(2**70).to_cbor.should == "\xc1\xc2\x49\x40\x00\x00\x00\x00\x00\x00\x00\x00".b
+    CBOR.encoded_size(Time.at(-2**70)).should == 12
+    expect { MessagePack.unpack("\xc1\x61x") }.to raise_error(TypeError)
+  end
+
+  it "Time from RFC 3339 strings (tag 0)" do
+    check_decode "\xc0\x74\x32\x30\x31\x33\x2d\x30\x33\x2d\x32\x31\x54\x32\x30\x3a\x30\x34\x3a\x30\x30\x5a",
+                 Time.utc(2013, 3, 21, 20, 4, 0)
+    t = CBOR.decode(CBOR::Tagged.new(0, "2024-02-29T23:59:59.25+05:30").to_cbor)
+    t.should == Time.new(2024, 2, 29, 23, 59, Rational(237, 4), "+05:30")
+    t.utc_offset.should == 19800
+    CBOR.decode(CBOR::Tagged.new(0, "1969-12-31t23:59:59.123456789z").to_cbor).should ==
+      Time.at(-1, 123456789, :nsec)
+    CBOR.decode(CBOR::Tagged.new(0, "2016-12-31T23:59:60-00:00").to_cbor).utc?.should == true
+    ["2013-02-29T00:00:00Z", "2013-03-21T20:04:00", "2013-03-21T24:00:00Z", "2013-03-21",
+     "2013-03-21T20:04:00.Z", 1363896240].each do |v|
+      CBOR.decode(CBOR::Tagged.new(0, v).to_cbor).should == CBOR::Tagged.new(0, v)
+    end
   end
 
   it "URI" do
@@ -473,6 +531,69 @@ describe MessagePack do
     check 11, CBOR::Tagged.new(4711, "Frotzel")
   end
 
+  it "register_tag converts registered tags while decoding" do
+    point = Struct.new(:xy)
+    begin
+      CBOR.register_tag(4711, point)
+      CBOR.register_tag(1_000_000, lambda { |v| v.upcase })
+      CBOR.register_tag(1, lambda { |v| "epoch #{v}" })
+      data = [CBOR::Tagged.new(4711, [1, 2]), CBOR::Tagged.new(1_000_000, "x"), Time.at(5)].to_cbor
+      CBOR.decode(data).should == [point.new([1, 2]), "X", "epoch 5"]
+      CBOR.register_tag(1_000_000, nil)
+      CBOR.register_tag(1, nil)
+      CBOR.decode(data).should == [point.new([1, 2]), CBOR::Tagged.new(1_000_000, "x"), Time.at(5)]
+    ensure
+      CBOR.register_tag(4711, nil)
+      CBOR.register_tag(1_000_000, nil)
+      CBOR.register_tag(1, nil)
+    end
+    CBOR.decode(CBOR::Tagged.new(4711, 0).to_cbor).should == CBOR::Tagged.new(4711, 0)
+    expect { CBOR.register_tag(-1, point) }.to raise_error(ArgumentError)
+    expect { CBOR.register_tag(5, "not callable") }.to raise_error(ArgumentError)
+  end
+
+  it "register_tag decoders may return shared Strings as map keys" do
+    key = +"shared"
+    begin
+      CBOR.register_tag(5001, lambda { |v| key })
+      CBOR.decode({CBOR::Tagged.new(5001, 0) => 1}.to_cbor).should == {"shared" => 1}
+      key.frozen?.should == false
+    ensure
+      CBOR.register_tag(5001, nil)
+    end
+  end
+
+  it "register_tag runs decoders that are not shareable in the main Ractor only" do
+    next unless defined?(Ractor)
+    begin
+      CBOR.register_tag(5002, lambda { |v| v + 1 })
+      CBOR.register_tag(5003, Ractor.make_shareable(nil.instance_exec { lambda { |v| v * 2 } }))
+      CBOR.decode(CBOR::Tagged.new(5002, 1).to_cbor).should == 2
+      r = Ractor.new(CBOR::Tagged.new(5002, 1).to_cbor, CBOR::Tagged.new(5003, 2).to_cbor) do |unshared, shared|
+        [(CBOR.decode(unshared) rescue $!.class), CBOR.decode(shared)]
+      end
+      r.take.should == [Ractor::IsolationError, 4]
+    ensure
+      CBOR.register_tag(5002, nil)
+      CBOR.register_tag(5003, nil)
+    end
+  end
+
+  it "register_tag keeps decoders in place across GC compaction" do
+    begin
+      CBOR.register_tag(5000, lambda { |v| v + 1 })
+      CBOR.register_tag(77, Struct.new(:v))
+      if GC.respond_to?(:verify_compaction_references)
+        GC.verify_compaction_references(expand_heap: true, toward: :empty)
+      end
+      CBOR.decode(CBOR::Tagged.new(5000, 1).to_cbor).should == 2
+      CBOR.decode(CBOR::Tagged.new(77, 2).to_cbor).v.should == 2
+    ensure
+      CBOR.register_tag(5000, nil)
+      CBOR.register_tag(77, nil)
+    end
+  end
+
   it "Keys as Symbols" do       # Experimental!
     CBOR.decode(CBOR.encode({:a => 1}), :keys_as_symbols).should == {:a => 1}
     CBOR.decode(CBOR.encode({:a => 1})).should == {"a" => 1}
@@ -484,12 +605,263 @@ describe MessagePack do
     CBOR.decode(CBOR.encode(symbolized_hash), :symbolize_keys => true).should == symbolized_hash
   end
 
+  it 'CBOR.decode symbolize_keys keeps keys that are not valid UTF-8 as binary Symbols' do
+    key = "\xff".b.to_sym
+    CBOR.decode("\xa1\x61\xff\x01".b, :symbolize_keys => true).should == {key => 1}
+    CBOR.decode("\x82\xa1\x61\xff\x01\xa1\x61\xff\x02".b, :symbolize_keys => true).should == [{key => 1}, {key => 2}]
+    CBOR.decode("\xa1\x62\xc3\xa9\x01".b, :symbolize_keys => true).keys.first.should == :"é"
+  end
+
   it 'Unpacker#read symbolize_keys' do
     unpacker = Unpacker.new(:symbolize_keys => true)
     symbolized_hash = {:a => 'b', :c => 'd'}
     unpacker.feed(CBOR.encode(symbolized_hash)).read.should == symbolized_hash
   end
 
+  it 'key_cache returns the same frozen key String for repeated keys' do
+    data = CBOR.encode([{"a" => 1, "bb" => 2}, {"a" => 3, "bb" => 4}, {"a" => 5}])
+    unpacker = Unpacker.new(:key_cache => 16)
+    unpacker.feed(data)
+    ary = unpacker.read
+    ary.should == [{"a" => 1, "bb" => 2}, {"a" => 3, "bb" => 4}, {"a" => 5}]
+    keys = ary.map(&:keys)
+    keys[0][0].frozen?.should == true
+    keys[1][0].equal?(keys[0][0]).should == true
+    keys[2][0].equal?(keys[0][0]).should == true
+    keys[1][1].equal?(keys[0][1]).should == true
+    unpacker.key_cache_stats.should == {:size => 16, :hits => 3, :misses => 2}
+  end
+
+  it 'key_cache keeps text and byte string keys apart' do
+    data = CBOR.encode([{"k" => 1}, {"k".b => 2}, {"k" => 3}])
+    ary = CBOR.decode(data, :key_cache => true)
+    ary.map { |h| h.keys[0].encoding }.should == [Encoding::UTF_8, Encoding::BINARY, Encoding::UTF_8]
+    ary.map { |h| h.values[0] }.should == [1, 2, 3]
+  end
+
+  it 'symbolize_keys caches symbols, including new and non-ASCII ones' do
+    name = "fresh_key_#{rand(1 << 30)}"
+    data = CBOR.encode([{"a" => 1, name => 2, "\u00e4" => 3}, {"a" => 4, name => 5, "\u00e4" => 6}])
+    unpacker = Unpacker.new(:symbolize_keys => true)
+    unpacker.feed(data).read.should ==
+      [{:a => 1, name.to_sym => 2, :"\u00e4" => 3}, {:a => 4, name.to_sym => 5, :"\u00e4" => 6}]
+    unpacker.key_cache_stats.should == {:size => 256, :hits => 3, :misses => 3}
+    CBOR.decode(data, :symbolize_keys => true, :key_cache => false)[1].keys.should ==
+      [:a, name.to_sym, :"\u00e4"]
+  end
+
+  it 'key_cache is off by default' do
+    unpacker = Unpacker.new
+    unpacker.feed(CBOR.encode({"a" => 1})).read.should == {"a" => 1}
+    unpacker.key_cache_stats.should == {:size => 0, :hits => 0, :misses => 0}
+    expect { Unpacker.new(:key_cache => -1) }.to raise_error(ArgumentError)
+  end
+
+  it 'freeze returns deduplicated Strings and deep frozen containers' do
+    obj = {"a" => ["ok", "ok" * 100, "ok".b, {1 => []}], "t" => CBOR::Tagged.new(99, ["ok"]), "e" => {}}
+    data = CBOR.encode(obj)
+    decoded = CBOR.decode(data, :freeze => true)
+    decoded.should == obj
+    decoded["a"][0].equal?(-"ok").should == true
+    decoded["t"].value[0].equal?(-"ok").should == true
+    decoded["a"][2].encoding.should == Encoding::BINARY
+    [decoded, decoded["a"], decoded["a"][1], decoded["a"][3][1], decoded["t"], decoded["e"]].all?(&:frozen?).should == true
+    Ractor.shareable?(decoded).should == true if defined?(Ractor)
+    CBOR.decode(data)["a"][0].frozen?.should == false
+  end
+
+  it 'freeze applies to simple values and tagged items' do
+    [CBOR::Simple.new(16), CBOR::Tagged.new(99, 1), [CBOR::Simple.new(255), CBOR::Tagged.new(99, [])]].each do |obj|
+      decoded = CBOR.decode(obj.to_cbor, :freeze => true)
+      decoded.should == obj
+      decoded.frozen?.should == true
+      Ractor.shareable?(decoded).should == true if defined?(Ractor)
+    end
+    CBOR.decode(CBOR::Simple.new(16).to_cbor).frozen?.should == false
+  end
+
+  it 'freeze applies to indefinite length and fed items' do
+    unpacker = Unpacker.new(:freeze => true)
+    items = []
+    "\x7f\x61a\x61b\xff\x9f\x61c\xff\x82\x61d\x61d".b.each_char { |c| unpacker.feed_each(c) { |o| items << o } }
+    items.should == ["ab", ["c"], ["d", "d"]]
+    items[0].equal?(-"ab").should == true
+    items[1].frozen?.should == true
+    items[2][0].equal?(items[2][1]).should == true
+  end
+
+  it 'strict: :deterministic accepts what deterministic: true encodes' do
+    obj = {"b" => [1, 1.5, -300, 2**40, nil], "a" => {10 => "x", -1 => {"z" => 0.1, "y" => 1.0e300}}, 100 => CBOR::Tagged.new(99, "t")}
+    data = CBOR.encode(obj, :deterministic => true)
+    CBOR.decode(data, :strict => :deterministic).should == obj
+    unpacker = Unpacker.new(:strict => :deterministic)
+    items = []
+    data.each_char { |c| unpacker.feed_each(c) { |o| items << o } }
+    items.should == [obj]
+    CBOR.decode("\xf9\x7e\x00".b, :strict => :deterministic).nan?.should == true
+    expect { Unpacker.new(:strict => :canonical) }.to raise_error(ArgumentError)
+  end
+
+  it 'strict: :deterministic rejects other encodings of the same item' do
+    ["\x18\x17", "\x19\x00\xff", "\x1a\x00\x00\xff\xff", "\x38\x00", "\x78\x01a", "\xd8\x01\x00",
+     "\x5f\x41a\xff", "\x9f\xff", "\xbf\xff",
+     "\xfa\x3f\x80\x00\x00", "\xfb\x3f\xf8\x00\x00\x00\x00\x00\x00", "\xfb\x7f\xf8\x00\x00\x00\x00\x00\x00",
+     "\xa2\x02\x00\x01\x00", "\xa2\x61b\x00\x61a\x00", "\xa2\x62aa\x00\x61b\x00", "\xa2\x01\x00\x01\x00",
+     "\x81\xa2\xa1\x02\x00\x00\xa1\x01\x00\x00",
+     "\xc2\x41\x01", "\xc3\x40", "\xc2\x48\xff\xff\xff\xff\xff\xff\xff\xff",
+     "\xc2\x49\x00\x01\x00\x00\x00\x00\x00\x00\x00"].each do |bad|
+      expect { CBOR.decode(bad.b, :strict => :deterministic) }.to raise_error(CBOR::MalformedFormatError)
+      CBOR.decode(bad.b)  # well-formed all the same
+    end
+    unpacker = Unpacker.new(:strict => :deterministic)
+    unpacker.feed("\xa2\x62aa\x00".b).feed("\x61b\x00".b)
+    expect { unpacker.read }.to raise_error(CBOR::MalformedFormatError)
+    [2**64, -2**64 - 1, 2**70].each do |big|
+      CBOR.decode(CBOR.encode(big), :strict => :deterministic).should == big
+    end
+    unpacker = Unpacker.new(:strict => :deterministic)
+    unpacker.feed("\xa2\x61b\x00\x61a\x00".b)
+    expect { unpacker.dig("a") }.to raise_error(ArgumentError)
+    expect { unpacker.next_event }.to raise_error(ArgumentError)
+    expect { unpacker.next_events([]) }.to raise_error(ArgumentError)
+  end
+
+  it 'rejects two-byte simple values below 32 as malformed, strict or not' do
+    (0..31).each do |v|
+      bad = [0xf8, v].pack("C*")
+      [{}, {:strict => :deterministic}].each do |opts|
+        expect { CBOR.decode(bad, **opts) }.to raise_error(CBOR::MalformedFormatError, /invalid byte/)
+      end
+      expect { Unpacker.new.feed(bad).skip }.to raise_error(CBOR::MalformedFormatError, /invalid byte/)
+      CBOR.valid?(bad).should == false
+    end
+    CBOR.decode("\xf8\x20".b, :strict => :deterministic).should == CBOR::Simple.new(32)
+  end
+
+  it 'decode_sequence decodes all items of a CBOR sequence' do
+    items = [1, "a", {"b" => [2, 3]}, nil, 1.5]
+    data = items.map(&:to_cbor).join
+    CBOR.decode_sequence(data).should == items
+    CBOR.decode_sequence(data, :limit => 2).should == [1, "a"]
+    CBOR.decode_sequence(data, :limit => 0).should == []
+    CBOR.decode_sequence("").should == []
+    CBOR.decode_sequence(data, :symbolize_keys => true)[2].should == {:b => [2, 3]}
+    expect { CBOR.decode_sequence(data + "\x82\x01".b) }.to raise_error(EOFError)
+    expect { CBOR.decode_sequence(data + "\xff".b) }.to raise_error(CBOR::MalformedFormatError)
+    expect { CBOR.decode_sequence(data, :limit => -1) }.to raise_error(ArgumentError)
+  end
+
+  it 'Unpacker#read_all reads the complete items in the buffer' do
+    unpacker = Unpacker.new
+    unpacker.feed([1, [2]].map(&:to_cbor).join + "\x82\x03".b)
+    unpacker.read_all.should == [1, [2]]
+    unpacker.feed("\x04\x05\x06")
+    unpacker.read_all(:limit => 2).should == [[3, 4], 5]
+    unpacker.read_all.should == [6]
+  end
+
+  it 'parallel_decode_sequence returns the same items as decode_sequence' do
+    items = (0...20000).map { |i| {"k" => [i, "x" * (i % 40), i * 0.5]} }
+    data = items.map(&:to_cbor).join.freeze
+    CBOR.parallel_decode_sequence(data, :workers => 4).should == items
+    CBOR.parallel_decode_sequence(data, :workers => 1).should == items
+    CBOR.parallel_decode_sequence(data, :workers => 3, :symbolize_keys => true)[7].should == {:k => [7, "x" * 7, 3.5]}
+    CBOR.parallel_decode_sequence("\x01\x02".b, :workers => 4).should == [1, 2]
+    expect { CBOR.parallel_decode_sequence(data[0..-2], :workers => 4) }.to raise_error(EOFError)
+  end
+
+  it 'parallel_decode_sequence raises the error of a worker' do
+    data = (0...20000).map { |i| [i, "x" * 20].to_cbor }.join
+    (data.bytesize / (64 * 1024)).should >= 2
+    # well-formed, but tag 1 can't hold a text string
+    bad = data + "\xc1\x61x".b
+    expect { CBOR.parallel_decode_sequence(bad, :workers => 2) }.to raise_error(TypeError)
+  end
+
+  it 'typed_arrays decodes RFC 8746 typed arrays' do
+    data = CBOR::Tagged.new(69, [1, 2, 65535].pack("S<*")).to_cbor
+    CBOR.decode(data).should == CBOR::Tagged.new(69, [1, 2, 65535].pack("S<*"))
+    ta = CBOR.decode(data, :typed_arrays => :packed)
+    ta.type.should == :uint16_le
+    ta.data.should == [1, 2, 65535].pack("S<*")
+    ta.tag.should == 69
+    ta.size.should == 3
+    ta.to_a.should == [1, 2, 65535]
+    CBOR.decode(data, :typed_arrays => :array).should == [1, 2, 65535]
+    expect { CBOR.decode(data, :typed_arrays => :list) }.to raise_error(ArgumentError)
+  end
+
+  it 'typed_arrays converts all integer and float element types' do
+    {
+      64 => [[0, 255], "C*"], 68 => [[0, 255], "C*"], 72 => [[-128, 127], "c*"],
+      65 => [[0, 65535], "S>*"], 77 => [[-32768, 32767], "s<*"],
+      66 => [[0, 2**32 - 1], "L>*"], 74 => [[-2**31, 2**31 - 1], "l>*"],
+      71 => [[0, 2**64 - 1], "Q<*"], 75 => [[-2**63, 2**63 - 1], "q>*"],
+      81 => [[1.5, -0.25], "g*"], 82 => [[1.5, -1e300], "G*"], 86 => [[1.5, -1e300], "E*"],
+    }.each do |tag, (values, format)|
+      data = CBOR::Tagged.new(tag, values.pack(format)).to_cbor
+      CBOR.decode(data, :typed_arrays => :array).should == values
+    end
+    half = CBOR::Tagged.new(84, "\x00\x3c\x00\xfc\x00\xc0".b).to_cbor
+    CBOR.decode(half, :typed_arrays => :array).should == [1.0, -Float::INFINITY, -2.0]
+  end
+
+  it 'typed_arrays leaves unconvertible typed arrays tagged' do
+    [[65, "\x00".b], [76, "\x00".b], [83, "\x00".b * 16], [64, "text"]].each do |tag, value|
+      data = CBOR::Tagged.new(tag, value).to_cbor
+      CBOR.decode(data, :typed_arrays => :array).should == CBOR::Tagged.new(tag, value)
+    end
+    CBOR.decode(CBOR::Tagged.new(83, "\x00".b * 16).to_cbor, :typed_arrays => :packed).type.should == :float128_be
+  end
+
+  it 'valid? and validate! accept well-formed data' do
+    data = [1, "a", {"b" => [1.5, nil, 2**70]}, CBOR::Tagged.new(99, "x".b)].to_cbor
+    CBOR.valid?(data).should == true
+    CBOR.validate!(data).should == true
+    # [_ 1, {_ "a": (_ h'01', h'02')}]
+    CBOR.valid?("\x9f\x01\xbf\x61a\x5f\x41\x01\x41\x02\xff\xff\xff".b).should == true
+    big = Array.new(10_000) { |i| {"k" => "v" * (i % 30)} }.to_cbor
+    CBOR.valid?(big, :utf8 => true).should == true
+  end
+
+  it 'valid? and validate! reject malformed data' do
+    ["", "\x82\x01", "\x9b\xff\xff\xff\xff\xff\xff\xff\xff", "\x61"].each do |bad|
+      CBOR.valid?(bad.b).should == false
+      expect { CBOR.validate!(bad.b) }.to raise_error(EOFError)
+    end
+    ["\xbf\x01\xff", "\x5f\x61a\xff", "\x9f\xc1\xff", "\x81\xff", "\xf8\x10", "\x1c", "\xff",
+     "\x01\x02"].each do |bad|
+      CBOR.valid?(bad.b).should == false
+      expect { CBOR.validate!(bad.b) }.to raise_error(CBOR::MalformedFormatError)
+    end
+    expect { CBOR.validate!("\x81" * 200 + "\x01") }.to raise_error(CBOR::StackError)
+  end
+
+  it 'valid? and decode agree on deeply tagged data' do
+    [100, 127, 128, 200].each do |n|
+      data = "\xd8\x64".b * n + "\x01".b
+      ok = begin
+             CBOR.decode(data)
+             true
+           rescue CBOR::StackError
+             false
+           end
+      CBOR.valid?(data).should == ok
+      expect { CBOR.validate!(data) }.to raise_error(CBOR::StackError) unless ok
+    end
+    CBOR.valid?("\xd8\x64".b * 200 + "\x01".b).should == false
+  end
+
+  it 'valid? checks UTF-8 and sequences on request' do
+    CBOR.valid?("\x62\xc3\x28".b).should == true
+    CBOR.valid?("\x62\xc3\x28".b, :utf8 => true).should == false
+    CBOR.valid?("\x63\xe2\x82\xac".b, :utf8 => true).should == true
+    CBOR.valid?("\x63\xed\xa0\x80".b, :utf8 => true).should == false
+    CBOR.valid?("\x01\x02".b, :sequence => true).should == true
+    CBOR.valid?("".b, :sequence => true).should == true
+    CBOR.valid?("\x01\x82".b, :sequence => true).should == false
+  end
+
   it 'handle outrageous sizes 1' do
     expect { CBOR.decode("\xa1") }.to raise_error(EOFError)
     expect { CBOR.decode("\xba\xff\xff\xff\xff") }.to raise_error(EOFError)
@@ -123,5 +123,213 @@ describe Packer do
     CustomPack02.new.to_cbor(s04)
     s04.string.should == [1,2].to_cbor
   end
-end
 
+  it 'typed_arrays writes homogeneous numeric Arrays as typed arrays' do
+    ints = (20...40).to_a
+    data = CBOR.encode(ints, :typed_arrays => true)
+    data.should == "\xd8\x40\x54".b + ints.pack("C*")
+    ints.to_cbor(:typed_arrays => true).should == data
+    CBOR.decode(data, :typed_arrays => :array).should == ints
+    CBOR.decode(data, :typed_arrays => true).should == ints
+
+    CBOR.decode(CBOR.encode(ints.map { |i| i * 1000 }, :typed_arrays => true)).tag.should == 69
+    CBOR.decode(CBOR.encode(ints.map { |i| -i * 100000 }, :typed_arrays => true)).tag.should == 78
+    CBOR.decode(CBOR.encode(ints.map { |i| i * 1000 + 0.5 }, :typed_arrays => true)).tag.should == 85
+    floats = ints.map { |i| i * 0.1 }
+    CBOR.decode(CBOR.encode(floats, :typed_arrays => true), :typed_arrays => :array).should == floats
+  end
+
+  it 'typed_arrays leaves short and mixed Arrays alone' do
+    CBOR.encode([1, 2, 3], :typed_arrays => true).should == [1, 2, 3].to_cbor
+    CBOR.encode([100, 200, 255], :typed_arrays => 3).should == "\xd8\x40\x43\x64\xc8\xff".b
+    mixed = (0...20).to_a + [1.5]
+    CBOR.encode(mixed, :typed_arrays => true).should == mixed.to_cbor
+    packer = Packer.new(:typed_arrays => 2)
+    packer.write([[1, 2], [3], ["a", "b"]])
+    CBOR.decode(packer.to_s, :typed_arrays => :array).should == [[1, 2], [3], ["a", "b"]]
+    expect { Packer.new(:typed_arrays => 0) }.to raise_error(ArgumentError)
+  end
+
+  it 'typed_arrays writes plain Arrays when they are smaller' do
+    [(-10..9).to_a, (0...100).map { |i| i % 24 }, [0] * 20 + [300], [0.5] * 20, [1.5, 2.0] * 10].each do |small|
+      CBOR.encode(small, :typed_arrays => true).should == small.to_cbor
+      CBOR.encoded_size(small, :typed_arrays => true).should == small.to_cbor.bytesize
+    end
+    CBOR.encode((-10..9).to_a, :typed_arrays => true).bytesize.should == 21
+    # the typed array wins a tie
+    CBOR.encode([300, 300, 100], :typed_arrays => 3).should == "\xd8\x45\x46\x2c\x01\x2c\x01\x64\x00".b
+  end
+
+  it 'encoded_size returns the size of the encoding' do
+    objs = [nil, 23, 24, -25, 65536, -2**32 - 1, 2**64 - 1, -2**64 - 1, 2**200, -2**200,
+            1.0, 1.1, 65504.0, 65520.0, 5.960464477539063e-08, Float::NAN, Float::INFINITY,
+            "", "a" * 24, "\u00e9", "\xfc".force_encoding("ISO-8859-1"), :sym, "x".b * 300,
+            [1, [2, {3 => 4}]], {"a" => [1.5, nil]}, CBOR::Tagged.new(2**40, [1]), CBOR::Simple.new(255),
+            Time.at(0), Time.at(1.5), Time.at(-100), /re/, (0..20).to_a]
+    objs.each do |obj|
+      CBOR.encoded_size(obj).should == CBOR.encode(obj).bytesize
+    end
+    CBOR.encoded_size(objs).should == CBOR.encode(objs).bytesize
+    CBOR.encoded_size((20..60).to_a, :typed_arrays => true).should == CBOR.encode((20..60).to_a, :typed_arrays => true).bytesize
+    CBOR.encoded_size([CustomPack01.new] * 3).should == [1, 2].to_cbor.bytesize * 3 + 1
+  end
+
+  it 'encode writes large containers the same when it sizes them first' do
+    big = (1..100).map { |i| ["x" * (i * 7), i, CBOR::Tagged.new(99, "y" * 50)] }
+    io = StringIO.new
+    CBOR.encode(big, io)
+    CBOR.encode(big).should == io.string
+    CBOR.encode(big + [CustomPack01.new]).should == CBOR.encode(big + [[1, 2]])
+    hash = (1..50).to_h { |i| ["k#{i}", "v" * 100] }
+    CBOR.decode(CBOR.encode(hash)).should == hash
+  end
+
+  it 'deterministic sorts map keys by their encoding' do
+    h = {"b" => 1, "a" => 2, 100 => 3, -1 => 4, "aa" => {"z" => 1, "y" => [{3 => 1, 2 => 2}]}, [1] => 0, 10 => 5}
+    data = CBOR.encode(h, :deterministic => true)
+    data.should == "\xa7\x0a\x05\x18\x64\x03\x20\x04\x41a\x02\x41b\x01\x42aa" \
+      "\xa2\x41y\x81\xa2\x02\x02\x03\x01\x41z\x01\x81\x01\x00"
+    CBOR.decode(data).should == h
+    h.to_cbor(:deterministic => true).should == data
+
+    packer = Packer.new(:deterministic => true)
+    packer.write([{2 => 1, 1 => 2}, {}])
+    packer.to_s.should == "\x82\xa2\x01\x02\x02\x01\xa0".b
+  end
+
+  it 'deterministic matches sorting keys by their encoding in large maps' do
+    h = (1..3000).map { |i| ["k#{i}", i.odd? ? i : {i => i.to_s}] }.shuffle.to_h
+    expected = "\xb9".b + [h.size].pack("n") +
+      h.map { |k, v| [k.to_cbor, CBOR.encode(v, :deterministic => true)] }.sort.join
+    CBOR.encode(h, :deterministic => true).should == expected
+    expect { CBOR.encode({:a => 1, "a".force_encoding("UTF-8") => 2}, :deterministic => true) }.to raise_error(ArgumentError)
+  end
+
+  it 'TypedArray.new packs an Array' do
+    ta = CBOR::TypedArray.new(:int16_be, [1, -2])
+    ta.data.should == "\x00\x01\xff\xfe".b
+    ta.to_cbor.should == "\xd8\x49\x44\x00\x01\xff\xfe".b
+    CBOR.decode(ta.to_cbor, :typed_arrays => :packed).should == ta
+    CBOR::TypedArray.new(:float16_le, [1.0, 65504.0, 1e10]).to_a.should == [1.0, 65504.0, Float::INFINITY]
+    CBOR::TypedArray.new(:float32_be, [1, 0.5]).to_a.should == [1.0, 0.5]
+    CBOR::TypedArray.new(:uint8_clamped, [-5, 300]).to_a.should == [0, 255]
+    CBOR::TypedArray.new(:uint64_le, [2**64 - 1]).to_a.should == [2**64 - 1]
+    expect { CBOR::TypedArray.new(:uint8, [256]) }.to raise_error(RangeError)
+    expect { CBOR::TypedArray.new(:uint32_le, [-1]) }.to raise_error(RangeError)
+    expect { CBOR::TypedArray.new(:int8, [1.5]) }.to raise_error(TypeError)
+    expect { CBOR::TypedArray.new(:int9, [1]) }.to raise_error(ArgumentError)
+    expect { CBOR::TypedArray.new(:float128_le, [1.0]) }.to raise_error(ArgumentError)
+  end
+
+  it 'Raw is written verbatim' do
+    raw = CBOR::Raw.new(CBOR.encode({"big" => "x" * 10000}))
+    raw.frozen?.should == true
+    raw.bytes.encoding.should == Encoding::BINARY
+    data = CBOR.encode([1, raw, raw])
+    CBOR.decode(data).should == [1, {"big" => "x" * 10000}, {"big" => "x" * 10000}]
+    io = StringIO.new
+    CBOR.encode([1, raw, raw], io)
+    io.string.should == data
+    CBOR.encoded_size([1, raw, raw]).should == data.bytesize
+    CBOR::Raw.new("\x18\x64", validate: true).to_cbor.should == "\x18\x64"
+    expect { CBOR::Raw.new("\x18", validate: true) }.to raise_error(EOFError)
+    expect { CBOR::Raw.new("\x1c", validate: true) }.to raise_error(CBOR::MalformedFormatError)
+    CBOR::Raw.new(1.to_cbor).should == CBOR::Raw.new(1.to_cbor)
+    raw.respond_to?(:bytes=).should == false
+    expect { CBOR.encode([CBOR::Raw.allocate]) }.to raise_error(TypeError)
+    expect { CBOR.encoded_size([CBOR::Raw.allocate]) }.to raise_error(TypeError)
+  end
+
+  it 'write_raw appends bytes verbatim' do
+    packer = Packer.new
+    packer.write_array_header(2).write_raw("\x01").write_raw(CBOR.encode("a" * 1000))
+    CBOR.decode(packer.to_s).should == [1, "a" * 1000]
+  end
+
+  it 'register_type writes registered classes without to_cbor' do
+    point = Struct.new(:y, :x)
+    money = Class.new { def to_s; "5 EUR"; end }
+    begin
+      CBOR.register_type(point, packer: :to_h, tag: 40000)
+      CBOR.register_type(money, packer: :to_s)
+      data = CBOR.encode([point.new(1, money.new), Class.new(point).new(3, 4)])
+      data.should == "\x82\xd9\x9c\x40\xa2\x61y\x01\x61x\x455 EUR\xd9\x9c\x40\xa2\x61y\x03\x61x\x04".b
+      CBOR.encoded_size([point.new(1, money.new)]).should == CBOR.encode([point.new(1, money.new)]).bytesize
+      CBOR.encode(point.new(1, 2), deterministic: true).should == "\xd9\x9c\x40\xa2\x61x\x02\x61y\x01".b
+      CBOR.register_type(point, packer: :to_a)
+      CBOR.encode(point.new(1, 2)).should == "\x82\x01\x02".b
+      CBOR.register_type(point, packer: lambda { |pt| pt.x + pt.y })
+      CBOR.encode(point.new(1, 2)).should == "\x03".b
+      CBOR.register_type(point)
+      expect { CBOR.encode(point.new(1, 2)) }.to raise_error(NoMethodError)
+    ensure
+      CBOR.register_type(point)
+      CBOR.register_type(money)
+    end
+  end
+
+  it 'register_type keeps the encoders of CBOR classes and Regexp' do
+    begin
+      CBOR.register_type(Struct, packer: :to_a)
+      CBOR.register_type(Object, packer: lambda { |obj| "object" })
+      CBOR.encode(CBOR::Tagged.new(5, 1)).should == "\xc5\x01".b
+      CBOR.encode(CBOR::Simple.new(5)).should == "\xe5".b
+      CBOR.encode(CBOR::Raw.new("\x01".b)).should == "\x01".b
+      CBOR.encode(/a/).should == "\xd8\x23\x61a".b
+      CBOR.encoded_size([CBOR::Tagged.new(5, 1)]).should == 3
+      CBOR.encode(Struct.new(:x).new(1)).should == "\x81\x01".b
+      CBOR.encode(Class.new.new).should == "\x46object".b
+    ensure
+      CBOR.register_type(Struct)
+      CBOR.register_type(Object)
+    end
+  end
+
+  it 'register_type checks its arguments' do
+    expect { CBOR.register_type(:point, packer: :to_h) }.to raise_error(ArgumentError)
+    expect { CBOR.register_type(Object, packer: 3) }.to raise_error(ArgumentError)
+    expect { CBOR.register_type(Object, packer: :to_s, tag: -1) }.to raise_error(ArgumentError)
+  end
+
+  it 'structs writes Struct and Data members natively' do
+    point = Struct.new(:x, :y)
+    objs = [point.new(1, [2])]
+    objs << Data.define(:x, :y).new(x: 1, y: [2]) if defined?(Data.define)
+    objs.each do |obj|
+      expect { CBOR.encode(obj) }.to raise_error(NoMethodError)
+      CBOR.encode(obj, structs: :array).should == "\x82\x01\x81\x02".b
+      CBOR.encode(obj, structs: :map).should == "\xa2\x61x\x01\x61y\x81\x02".b
+      CBOR.encoded_size([obj], structs: :map).should == 9
+    end
+    CBOR.encode(CBOR::Tagged.new(5, 1), structs: :map).should == "\xc5\x01".b
+    expect { CBOR.encode(objs, structs: :hash) }.to raise_error(ArgumentError)
+  end
+
+  it 'register_type with a tag decodes Struct and Data members back' do
+    point = Struct.new(:x, :y)
+    classes = [point]
+    classes << Data.define(:x, :y) if defined?(Data.define)
+    begin
+      classes.each do |klass|
+        CBOR.register_type(klass, packer: :to_h, tag: 40001)
+        obj = klass.new(1, [2])
+        CBOR.decode(CBOR.encode([obj])).should == [obj]
+        missing_x = CBOR.encode(CBOR::Tagged.new(40001, {"y" => 2, "z" => 3}))
+        if klass == point
+          CBOR.decode(missing_x).should == klass.new(nil, 2)
+        else
+          expect { CBOR.decode(missing_x) }.to raise_error(CBOR::MalformedFormatError)
+          expect { CBOR.decode(CBOR.encode(CBOR::Tagged.new(40001, [1]))) }.to raise_error(CBOR::MalformedFormatError)
+        end
+        CBOR.register_type(klass, packer: :to_a, tag: 40001)
+        CBOR.decode(CBOR.encode(obj)).should == obj
+        CBOR.decode(CBOR.encode(obj)).frozen?.should == obj.frozen?
+        expect { CBOR.decode(CBOR.encode(CBOR::Tagged.new(40001, [1, 2, 3]))) }.to raise_error(CBOR::MalformedFormatError)
+        CBOR.register_type(klass)
+        CBOR.decode(CBOR.encode(CBOR::Tagged.new(40001, [1]))).should == CBOR::Tagged.new(40001, [1])
+      end
+    ensure
+      classes.each { |klass| CBOR.register_type(klass) }
+    end
+  end
+end
@@ -0,0 +1,71 @@
+# encoding: ascii-8bit
+require 'spec_helper'
+require 'stringio'
+require 'tempfile'
+
+describe CBOR::SequenceIndex do
+  let :items do
+    [1, "a" * 3000, {"b" => [2]}, nil, [1] * 100]
+  end
+
+  let :data do
+    items.map(&:to_cbor).join
+  end
+
+  it 'indexes the items of a String' do
+    index = CBOR::SequenceIndex.build(data)
+    index.size.should == 5
+    index.offsets.should == [0, 1, 3004, 3009, 3010]
+    index.lengths.should == [1, 3003, 5, 1, 102]
+    index.raw(2).should == {"b" => [2]}.to_cbor
+  end
+
+  it 'decodes single items' do
+    index = CBOR::SequenceIndex.build(data)
+    (0...index.size).map { |i| index[i] }.should == items
+    index[-3].should == {"b" => [2]}
+    index[5].should == nil
+    text_keys = {"k".force_encoding("UTF-8") => 1}.to_cbor
+    CBOR::SequenceIndex.build(text_keys, :symbolize_keys => true)[0].should == {:k => 1}
+  end
+
+  it 'indexes an IO and reads items back from it' do
+    CBOR::SequenceIndex.build(StringIO.new(data))[1].should == "a" * 3000
+    Tempfile.create("sequence_index") do |f|
+      f.binmode
+      f.write(data)
+      f.flush
+      f.rewind
+      index = CBOR::SequenceIndex.build(f)
+      index.offsets.should == CBOR::SequenceIndex.build(data).offsets
+      index[4].should == [1] * 100
+    end
+  end
+
+  it 'reads items back from an IO that was not at its start' do
+    io = StringIO.new("junk" + data)
+    io.read(4)
+    index = CBOR::SequenceIndex.build(io)
+    index.offsets.should == CBOR::SequenceIndex.build(data).offsets
+    index[0].should == 1
+    index.raw(1).should == CBOR.encode("a" * 3000)
+    Tempfile.create("sequence_index") do |f|
+      f.binmode
+      f.write("junk" + data)
+      f.flush
+      f.pos = 4
+      CBOR::SequenceIndex.build(f)[4].should == [1] * 100
+    end
+  end
+
+  it 'indexes an empty sequence' do
+    CBOR::SequenceIndex.build("").size.should == 0
+  end
+
+  it 'raises on malformed or truncated sequences' do
+    expect { CBOR::SequenceIndex.build(data + "\x82\x01") }.to raise_error(EOFError)
+    expect { CBOR::SequenceIndex.build(StringIO.new(data + "\x82\x01")) }.to raise_error(EOFError)
+    expect { CBOR::SequenceIndex.build(data + "\xff") }.to raise_error(CBOR::MalformedFormatError)
+    expect { CBOR::SequenceIndex.build(42) }.to raise_error(ArgumentError)
+  end
+end
@@ -84,6 +84,176 @@ describe Unpacker do
     unpacker.read.should == 5
   end
 
+  it 'skip skips containers, strings and tags of any length' do
+    items = [
+      [1, [2, {"a" => "b" * 300}], 1.5, nil],
+      {1 => {2 => [3, 4]}, "x" => "y".b},
+      CBOR::Tagged.new(1234, [CBOR::Tagged.new(5, "z")]),
+      Time.at(1_000_000_000),
+      2**70,
+    ]
+    data = items.map(&:to_cbor).join + 42.to_cbor
+    unpacker.feed(data)
+    items.size.times { unpacker.skip.should == nil }
+    unpacker.read.should == 42
+  end
+
+  it 'skip skips indefinite length items' do
+    # [_ 1, {_ "a": (_ h'01', h'02')}, [_ ], "x"], then 7
+    unpacker.feed("\x9f\x01\xbf\x61a\x5f\x41\x01\x41\x02\xff\xff\x9f\xff\x61x\xff\x07")
+    unpacker.skip
+    unpacker.read.should == 7
+  end
+
+  it 'skip rejects malformed indefinite length items' do
+    ["\x5f\x61a\xff", "\x5f\x5f\xff\xff", "\x7f\x01\xff", "\xff", "\x81\xff",
+     "\xa1\x01\xff", "\xbf\x01\xff", "\x9f\xc1\xff", "\xc1\xff"].each do |bad|
+      expect { Unpacker.new.feed(bad).skip }.to raise_error(MessagePack::MalformedFormatError)
+    end
+  end
+
+  it 'skip resumes across fed chunks' do
+    data = [{"k" => "v" * 100}, [1, 2, [3]], "s" * 50].to_cbor + 9.to_cbor
+    unpacker = Unpacker.new
+    fed = 0
+    begin
+      unpacker.skip
+    rescue EOFError
+      unpacker.feed(data[fed, 7])
+      fed += 7
+      retry
+    end
+    unpacker.feed(data[fed..-1]) if fed < data.size
+    unpacker.read.should == 9
+  end
+
+  it 'dig reads only the item at a path' do
+    doc = {"meta" => {"trace_id" => "abc", "n" => [1, 2]}, 5 => "five",
+           "items" => [0, CBOR::Tagged.new(99, {"payload" => [9]})]}
+    data = doc.to_cbor
+    CBOR.dig(data, "meta", "trace_id").should == "abc"
+    CBOR.dig(data, "meta", "n", 1).should == 2
+    CBOR.dig(data, 5).should == "five"
+    CBOR.dig(data, "items", 1, "payload").should == [9]
+    CBOR.dig(data, "items", 1).should == CBOR::Tagged.new(99, {"payload" => [9]})
+    CBOR.dig(data).should == doc
+  end
+
+  it 'dig returns nil for missing items' do
+    data = {"a" => [1, 2], "b" => "c"}.to_cbor
+    CBOR.dig(data, "x").should == nil
+    CBOR.dig(data, "a", 2).should == nil
+    CBOR.dig(data, "a", "x").should == nil
+    CBOR.dig(data, "b", 0).should == nil
+    CBOR.dig(data, "a", 0, 0).should == nil
+  end
+
+  it 'dig walks indefinite length containers' do
+    # [_ 1, {_ "a": (_ h'01', h'02'), "b": 2}]
+    data = "\x9f\x01\xbf\x61a\x5f\x41\x01\x41\x02\xff\x61b\x02\xff\xff"
+    CBOR.dig(data, 1, :b).should == 2
+    CBOR.dig(data, 1, :a).should == "\x01\x02"
+    CBOR.dig(data, 2).should == nil
+  end
+
+  it 'dig reads the item found as a value, not as a key' do
+    data = {"a".force_encoding("UTF-8") => "b".force_encoding("UTF-8"), "c".force_encoding("UTF-8") => {}}.to_cbor
+    CBOR::Unpacker.new(symbolize_keys: true).feed(data).dig(:a).should == "b"
+    value = CBOR::Unpacker.new.feed(data).dig(:a)
+    value.should == "b"
+    value.frozen?.should == false
+    CBOR::Unpacker.new(symbolize_keys: true).feed("\xbf\x61a\x61b\xff").dig(:a).should == "b"
+  end
+
+  it 'dig tells text string keys from byte string keys' do
+    # {"a": 1, h'61': 2, (_ "b"): 3, (_ h'62'): 4}
+    data = "\xa4\x61a\x01\x41a\x02\x7f\x61b\xff\x03\x5f\x41b\xff\x04"
+    CBOR.dig(data, "a".force_encoding("UTF-8")).should == 1
+    CBOR.dig(data, :a).should == 1
+    CBOR.dig(data, "a".b).should == 2
+    CBOR.dig(data, "b".force_encoding("US-ASCII")).should == 3
+    CBOR.dig(data, "b".b).should == 4
+    CBOR.dig("\xa1\x41a\x01", :a).should == nil
+    CBOR.dig("\xa1\x61a\x01", "a".b).should == nil
+  end
+
+  it 'dig consumes the whole item from the unpacker' do
+    data = {"a" => {"b" => 1}, "c" => [2, 3]}.to_cbor
+    unpacker.feed(data + data + 4.to_cbor)
+    unpacker.dig("a", "b").should == 1
+    unpacker.dig("c", 5).should == nil
+    unpacker.read.should == 4
+  end
+
+  it 'dig raises on malformed input' do
+    expect { CBOR.dig("\x82\x01", 1) }.to raise_error(EOFError)
+    expect { CBOR.dig("\x82\x01\xff", 1) }.to raise_error(MessagePack::MalformedFormatError)
+    expect { CBOR.dig("\x01\x01") }.to raise_error(MessagePack::MalformedFormatError)
+  end
+
+  it 'next_event reports containers, tags and values' do
+    unpacker.feed([1, {"a" => [true, nil]}, CBOR::Tagged.new(7, "x"), []].to_cbor)
+    events = []
+    13.times { events << unpacker.next_event }
+    events.should == [
+      [:array_start, 4], [:value, 1],
+      [:map_start, 1], [:value, "a"], [:array_start, 2], [:value, true], [:value, nil], [:end], [:end],
+      [:tag, 7], [:value, "x"],
+      [:array_start, 0], [:end],
+    ]
+    unpacker.next_event.should == [:end]
+    expect { unpacker.next_event }.to raise_error(EOFError)
+    unpacker.feed(4.to_cbor)
+    unpacker.next_event.should == [:value, 4]
+  end
+
+  it 'next_event handles indefinite length items' do
+    # [_ 1, {_ "a": (_ h'01', h'02')}]
+    unpacker.feed("\x9f\x01\xbf\x61a\x5f\x41\x01\x41\x02\xff\xff\xff")
+    events = []
+    7.times { events << unpacker.next_event }
+    events.should == [[:array_start, nil], [:value, 1], [:map_start, nil],
+                      [:value, "a"], [:value, "\x01\x02"], [:end], [:end]]
+    expect { Unpacker.new.feed("\xbf\x01\xff").tap { |u| 2.times { u.next_event } }.next_event }.to raise_error(MessagePack::MalformedFormatError)
+  end
+
+  it 'next_event reads map values as values' do
+    data = "\xa1\x61a\x61b\xbf\x61c\x61d\xff"
+    unpacker = Unpacker.new(symbolize_keys: true).feed(data)
+    7.times.map { unpacker.next_event }.should ==
+      [[:map_start, 1], [:value, :a], [:value, "b"], [:end], [:map_start, nil], [:value, :c], [:value, "d"]]
+    Unpacker.new.feed(data).tap { |u| 2.times { u.next_event } }.next_event[1].frozen?.should == false
+  end
+
+  it 'next_event requires an item after a tag' do
+    unpacker = Unpacker.new.feed("\x81\xc1\xc2\x81\x01\x07")
+    8.times.map { unpacker.next_event }.should ==
+      [[:array_start, 1], [:tag, 1], [:tag, 2], [:array_start, 1], [:value, 1], [:end], [:end], [:value, 7]]
+    unpacker = Unpacker.new.feed("\x9f\xc1\xff")
+    2.times { unpacker.next_event }
+    expect { unpacker.next_event }.to raise_error(MessagePack::MalformedFormatError)
+    expect { Unpacker.new.feed("\x9f\xc1\xff").next_events([]) }.to raise_error(MessagePack::MalformedFormatError)
+    unpacker = Unpacker.new.feed("\xc1")
+    unpacker.next_event.should == [:tag, 1]
+    expect { unpacker.next_event }.to raise_error(EOFError)
+  end
+
+  it 'next_events fills an Array with event/argument pairs' do
+    data = "\x9f\x01\xbf\x61a\x5f\x41\x01\x41\x02\xff\xff\xff"
+    all = []
+    events = []
+    data.each_char do |c|
+      unpacker.feed(c)
+      unpacker.next_events(events).should == events.size / 2
+      all.concat(events)
+    end
+    all.should == [:array_start, nil, :value, 1, :map_start, nil, :value, "a",
+                   :value, "\x01\x02", :end, nil, :end, nil]
+    unpacker.feed([1, 2, 3].to_cbor)
+    unpacker.next_events(events, 2).should == 2
+    events.should == [:array_start, 3, :value, 1]
+  end
+
   it 'read raises EOFError' do
     lambda {
       unpacker.read
@@ -111,6 +281,41 @@ describe Unpacker do
     obj2.should == sample_object
   end
 
+  it 'reads maps of any size, nested and of indefinite length' do
+    [0, 1, 8, 9, 100, 1000].each do |n|
+      h = Array.new(n) {|i| ["k#{i}", {i => [i, {}]}] }.to_h
+      MessagePack.unpack(h.to_cbor).should == h
+    end
+    MessagePack.unpack("\xbf\x61a\xbf\x01\x02\xff\x61b\xa0\xff".b).should == {"a" => {1 => 2}, "b" => {}}
+  end
+
+  it 'reads arrays of any size, nested and of indefinite length' do
+    [0, 1, 100, 10000].each do |n|
+      a = Array.new(n) {|i| [i, [], {i => [i]}] }
+      MessagePack.unpack(a.to_cbor).should == a
+    end
+    indef = "\x9f".b + Array.new(1000) {|i| "\x9f\x01\x9f\xff\x82\x02\x9f\x03\xff\xff".b }.join + "\xff".b
+    MessagePack.unpack(indef).should == [[1, [], [2, [3]]]] * 1000
+  end
+
+  it 'keeps the last value of duplicate map keys' do
+    MessagePack.unpack("\xa3\x01\x61a\x02\x61b\x01\x61c".b).should == {1 => "c", 2 => "b"}
+    MessagePack.unpack("\xbf\x61k\x01\x61k\x02\xff".b).should == {"k" => 2}
+  end
+
+  it 'freezes String map keys' do
+    h = MessagePack.unpack("\xa2\x7f\x61a\x61b\xff\x01\x5f\x41c\xff\x02".b)
+    h.should == {"ab" => 1, "c".b => 2}
+    h.keys.all?(&:frozen?).should == true
+  end
+
+  it 'reads arrays and maps across fed chunks' do
+    h = Array.new(50) {|i| ["key#{i}", ["v#{i}"] * 3] }.to_h
+    objects = []
+    h.to_cbor.each_char {|b| GC.start if b == "k"; unpacker.feed_each(b) {|o| objects << o } }
+    objects.should == [h]
+  end
+
   it 'feed and each continue internal state' do
     raw = sample_object.to_cbor.to_s * 4
     objects = []